@@ -42,6 +42,55 @@ typedef union
 	uint64_t as64Bit;
 } SteamID;
 
+/* Callbacks, as delivered by SteamAPI_RunCallbacks() on the thread calling it */
+#define USERSTATSRECEIVED_CALLBACK 1101
+#define USERSTATSSTORED_CALLBACK 1102
+#define USERACHIEVEMENTSTORED_CALLBACK 1103
+
+/* CCallbackBase flags, set by steam */
+#define CALLBACK_FLAGS_REGISTERED 0x01
+#define CALLBACK_FLAGS_GAMESERVER 0x02
+
+/* Same layout as the SDK's CCallbackBase (g++ ABI): the virtual table with
+ * both Run() overloads in declaration order, then the members. */
+typedef struct CCallbackBase CCallbackBase;
+struct CCallbackBase
+{
+	const struct {
+		void (*Run)(CCallbackBase *thiz, void *param);
+		void (*RunResult)(CCallbackBase *thiz, void *param, uint8_t ioFailure, uint64_t call);
+		int (*GetCallbackSizeBytes)(CCallbackBase *thiz);
+	} *vtab;
+	uint8_t callbackFlags;
+	int32_t callback;
+};
+
+/* Callback structs are packed to 4 bytes on Linux. */
+#pragma pack(push, 4)
+typedef struct
+{
+	uint64_t gameId;
+	int32_t result;
+	SteamID user;
+} UserStatsReceived_t;
+
+typedef struct
+{
+	uint64_t gameId;
+	int32_t result;
+} UserStatsStored_t;
+
+typedef struct
+{
+	uint64_t gameId;
+	uint8_t groupAchievement;
+	char achievementName[128];
+	/* Both 0 for an unlock, else it's only progress */
+	uint32_t curProgress;
+	uint32_t maxProgress;
+} UserAchievementStored_t;
+#pragma pack(pop)
+
 /* Basically the all-pure-virtual ISteam* handle is the virtual table. */
 
 typedef struct
@@ -49,6 +98,8 @@ typedef struct
 	struct {
 		/* pure RGB (8bit per chan) data, data size (3 * w * h), image width, image height */
 		uint32_t (*WriteScreenshot)(void *thiz, void *pubRGB, uint32_t cubRGB, int w, int h);
+		/* JPEG/TGA/PNG file, optional thumbnail file (NULL), image width, image height */
+		uint32_t (*AddScreenshotToLibrary)(void *thiz, const char *file, const char *thumb, int w, int h);
 		/* ... */
 	} *vtab;
 } ISteamScreenshots;
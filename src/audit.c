@@ -0,0 +1,299 @@
+/**
+ *
+ * rtld-audit mode (LD_AUDIT), used together with LD_PRELOAD of the same
+ * library.
+ *
+ * The audit instance lives in its own link map namespace and does no
+ * screenshot work itself. It
+ *  - redirects bindings of the hooked X11/GL/steam functions that bypass the
+ *    preloaded instance (RTLD_DEEPBIND, objects loaded in odd orders) to the
+ *    preloaded instance's hooks. Only the libraries defining them get
+ *    LA_FLG_BINDTO, so la_symbind*() isn't called for anything else;
+ *  - records a startup profile: per object the time from the start of its
+ *    search to it being mapped, and the time its symbol bindings took. With
+ *    SSSP_AUDIT_PROFILE=1 every object is audited until startup is done, to
+ *    time all bindings; the profile is logged right before the program
+ *    starts.
+ * Bindings are reported once per symbol and object and no PLT enter/exit
+ * hooks are used, so there's no cost left once everything is bound.
+ *
+ */
+#include <dlfcn.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "sssp.h"
+
+#define AUDIT_OBJECTS 512
+/* Longer gaps between bindings are the program running, not binding. */
+#define AUDIT_BIND_GAP_NS 1000000
+
+typedef struct
+{
+    const char *name;
+    Bool relevant;
+    /* Mapped after the search started */
+    uint64_t loadNs;
+    /* Bindings of references from this object */
+    uint64_t bindNs;
+    uint32_t binds;
+    uint32_t redirects;
+} auditObject;
+
+/* What the preloaded instance hooks */
+static const char *const auditHookNames[] =
+{
+    "XCheckIfEvent",
+    "XCreateWindow",
+    "XEventsQueued",
+    "XGrabKeyboard",
+    "XLookupString",
+    "XOpenDisplay",
+    "XPending",
+    "XUngrabKeyboard",
+    "glXSwapBuffers",
+    "SteamAPI_Init",
+    "SteamAPI_InitSafe",
+};
+
+#define AUDIT_HOOKS (sizeof(auditHookNames) / sizeof(auditHookNames[0]))
+
+/* Libraries defining them */
+static const char *const auditLibs[] =
+{
+    "libX11.so",
+    "libGL.so",
+    "libGLX.so",
+    "libsteam_api.so",
+};
+
+static struct
+{
+    Bool profile;
+    Bool started;
+    uint64_t t0;
+    uint64_t searchStart;
+    uint64_t lastBind;
+    auditObject *lastFrom;
+    /* The preloaded instance and its hooks */
+    struct link_map *preload;
+    uintptr_t hooks[AUDIT_HOOKS];
+    auditObject objs[AUDIT_OBJECTS];
+    int count;
+} g_audit;
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *baseName(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+/* Whether map is this library, loaded by LD_PRELOAD. */
+static Bool isPreload(const struct link_map *map)
+{
+    Dl_info self;
+    struct stat a, b;
+
+    return strncmp(baseName(map->l_name), "sssp", 4) == 0 &&
+        dladdr((void *)isPreload, &self) && stat(self.dli_fname, &a) == 0 &&
+        stat(map->l_name, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/* Look up the preloaded instance's hooks in its dynamic symbol table. */
+static void findHooks(const struct link_map *map)
+{
+    ElfW(Addr) strTab = 0, symTab = 0;
+    const ElfW(Dyn) *dyn;
+    const ElfW(Sym) *sym;
+    size_t i;
+
+    for (dyn = map->l_ld; dyn->d_tag != DT_NULL; dyn++)
+    {
+        /* Relocated by the loader on most architectures */
+        ElfW(Addr) ptr = dyn->d_un.d_ptr < map->l_addr ? dyn->d_un.d_ptr + map->l_addr : dyn->d_un.d_ptr;
+        if (dyn->d_tag == DT_STRTAB)
+            strTab = ptr;
+        else if (dyn->d_tag == DT_SYMTAB)
+            symTab = ptr;
+    }
+
+    for (sym = (const ElfW(Sym) *)symTab; symTab && sym < (const ElfW(Sym) *)strTab; sym++)
+    {
+        if (sym->st_shndx == SHN_UNDEF || ELF32_ST_TYPE(sym->st_info) != STT_FUNC)
+            continue;
+        for (i = 0; i < AUDIT_HOOKS; i++)
+            if (strcmp((const char *)(strTab + sym->st_name), auditHookNames[i]) == 0)
+                g_audit.hooks[i] = map->l_addr + sym->st_value;
+    }
+}
+
+static int compareCost(const void *a, const void *b)
+{
+    const auditObject *x = *(const auditObject *const *)a, *y = *(const auditObject *const *)b;
+    uint64_t cx = x->loadNs + x->bindNs, cy = y->loadNs + y->bindNs;
+
+    return cx < cy ? 1 : cx > cy ? -1 : 0;
+}
+
+static void logProfile(void)
+{
+    /* The objects themselves stay in place, they are the cookies. */
+    const auditObject *sorted[AUDIT_OBJECTS];
+    uint64_t load = 0, bind = 0;
+    uint32_t binds = 0;
+    int i;
+
+    for (i = 0; i < g_audit.count; i++)
+        sorted[i] = &g_audit.objs[i];
+    qsort(sorted, g_audit.count, sizeof(sorted[0]), compareCost);
+
+    log(LOG_NOTICE, "Startup profile of '%s', %.2f ms until main:\n",
+            program_invocation_short_name, (nowNs() - g_audit.t0) / 1e6);
+    for (i = 0; i < g_audit.count; i++)
+    {
+        const auditObject *o = sorted[i];
+        log(LOG_NOTICE, "  %8.3f ms load %8.3f ms bind (%5u symbols, %u hooked)  %s\n",
+                o->loadNs / 1e6, o->bindNs / 1e6, o->binds, o->redirects, o->name);
+        load += o->loadNs;
+        bind += o->bindNs;
+        binds += o->binds;
+    }
+    log(LOG_NOTICE, "  %8.3f ms load %8.3f ms bind (%5u symbols)  total, %d objects\n",
+            load / 1e6, bind / 1e6, binds, g_audit.count);
+}
+
+unsigned int
+la_version(unsigned int version)
+{
+    g_audit.t0 = nowNs();
+    g_audit.profile = cfg_getLong("AUDIT_PROFILE", 0);
+
+    return version < LAV_CURRENT ? version : LAV_CURRENT;
+}
+
+char *
+la_objsearch(const char *name, uintptr_t *cookie UNUSED, unsigned int flag)
+{
+    if (flag == LA_SER_ORIG)
+        g_audit.searchStart = nowNs();
+
+    return (char *)name;
+}
+
+unsigned int
+la_objopen(struct link_map *map, Lmid_t lmid, uintptr_t *cookie)
+{
+    const char *name = map->l_name && *map->l_name ? map->l_name : program_invocation_name;
+    auditObject *o = NULL;
+    uint64_t now = nowNs();
+    unsigned int flags;
+    size_t i;
+
+    *cookie = 0;
+
+    /* dlmopen()ed namespaces are left alone */
+    if (lmid != LM_ID_BASE)
+        return 0;
+
+    if (g_audit.count < AUDIT_OBJECTS)
+    {
+        o = &g_audit.objs[g_audit.count++];
+        o->name = name;
+        o->loadNs = g_audit.searchStart ? now - g_audit.searchStart : 0;
+        *cookie = (uintptr_t)o;
+    }
+    g_audit.searchStart = 0;
+
+    if (!g_audit.preload && isPreload(map))
+    {
+        g_audit.preload = map;
+        findHooks(map);
+        /* Its own calls go to the real functions. */
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(auditLibs) / sizeof(auditLibs[0]); i++)
+        if (strncmp(baseName(name), auditLibs[i], strlen(auditLibs[i])) == 0 && o)
+            o->relevant = True;
+
+    flags = LA_FLG_BINDFROM;
+    if ((o && o->relevant) || (g_audit.profile && !g_audit.started))
+        flags |= LA_FLG_BINDTO;
+
+    if (g_audit.started && o)
+        log(LOG_INFO, "Loaded '%s' in %.3f ms.\n", name, o->loadNs / 1e6);
+
+    return flags;
+}
+
+void
+la_preinit(uintptr_t *cookie UNUSED)
+{
+    g_audit.started = True;
+
+    if (!g_audit.preload)
+        log(LOG_WARN, "Audit mode without the library in LD_PRELOAD, only profiling.\n");
+
+    logProfile();
+}
+
+static uintptr_t symbind(const char *symname, uintptr_t value, uintptr_t *refcook, uintptr_t *defcook,
+        unsigned int *flags)
+{
+    auditObject *from = (auditObject *)*refcook, *to = (auditObject *)*defcook;
+    uint64_t now = nowNs();
+    size_t i;
+
+    *flags |= LA_SYMB_NOPLTENTER | LA_SYMB_NOPLTEXIT;
+
+    if (from)
+    {
+        if (from == g_audit.lastFrom && now - g_audit.lastBind < AUDIT_BIND_GAP_NS)
+            from->bindNs += now - g_audit.lastBind;
+        from->binds++;
+    }
+    g_audit.lastFrom = from;
+    g_audit.lastBind = now;
+
+    if (!to || !to->relevant)
+        return value;
+
+    for (i = 0; i < AUDIT_HOOKS; i++)
+    {
+        if (g_audit.hooks[i] && strcmp(symname, auditHookNames[i]) == 0)
+        {
+            if (from)
+                from->redirects++;
+            return g_audit.hooks[i];
+        }
+    }
+
+    return value;
+}
+
+#if __ELF_NATIVE_CLASS == 64
+uintptr_t
+la_symbind64(Elf64_Sym *sym, unsigned int ndx UNUSED, uintptr_t *refcook, uintptr_t *defcook,
+        unsigned int *flags, const char *symname)
+{
+    return symbind(symname, sym->st_value, refcook, defcook, flags);
+}
+#else
+uintptr_t
+la_symbind32(Elf32_Sym *sym, unsigned int ndx UNUSED, uintptr_t *refcook, uintptr_t *defcook,
+        unsigned int *flags, const char *symname)
+{
+    return symbind(symname, sym->st_value, refcook, defcook, flags);
+}
+#endif
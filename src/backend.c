@@ -0,0 +1,601 @@
+/**
+ *
+ * Capture backends and their per window selection.
+ *
+ * Which way of reading a window is fastest depends on the setup: XShm only
+ * helps with a local server, a composited desktop already has the window in
+ * a pixmap, and GL games can be read back right before they swap. The first
+ * full grab of a window times every available backend on a small region and
+ * commits to the fastest one that worked; the choice is cached by window and
+ * visual. SSSP_CAPTURE_BACKEND forces one.
+ *
+ * Probing and grabbing run with X errors trapped, so a backend the server
+ * refuses fails instead of taking the game down with the default handler.
+ *
+ */
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <GL/gl.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+
+#include "sssp.h"
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER_BINDING
+#define GL_PIXEL_PACK_BUFFER_BINDING 0x88ED
+#endif
+#ifndef GL_READ_FRAMEBUFFER
+#define GL_READ_FRAMEBUFFER 0x8CA8
+#endif
+#ifndef GL_READ_FRAMEBUFFER_BINDING
+#define GL_READ_FRAMEBUFFER_BINDING 0x8CAA
+#endif
+
+/* Edge of the region backends are timed on */
+#define BACKEND_PROBE_SIZE 256
+#define BACKEND_CACHE_SIZE 16
+/* How long a GL readback waits for the game's next frame */
+#define BACKEND_GL_WAIT_MS 250
+
+enum
+{
+    BACKEND_XGETIMAGE,
+    BACKEND_XSHM,
+    BACKEND_COMPOSITE,
+    BACKEND_GL,
+
+    BACKEND_MAX,
+    BACKEND_AUTO = BACKEND_MAX
+};
+
+typedef struct
+{
+    const char *name;
+    Bool (*available)(Display *dpy, Window win, const XWindowAttributes *attrs);
+    /* busyNs, if set, is the time spent without waiting on anything. */
+    XImage *(*grab)(Display *dpy, Window win, const XWindowAttributes *attrs,
+            int x, int y, int w, int h, uint64_t *busyNs);
+    enum Metric metric;
+} backend;
+
+typedef struct
+{
+    Window win;
+    VisualID visual;
+    int backend;
+} backendChoice;
+
+static struct
+{
+    pthread_mutex_t lock;
+    int forced;
+    backendChoice cache[BACKEND_CACHE_SIZE];
+    unsigned int next;
+
+    /* XShm segment, reused until the size changes */
+    Display *shmDpy;
+    XShmSegmentInfo shmInfo;
+    XImage *shmImage;
+} g_backend = { .lock = PTHREAD_MUTEX_INITIALIZER, .forced = BACKEND_AUTO };
+
+/* Readback requests served by the glXSwapBuffers hook */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    XID lastDrawable;
+    /* Request */
+    XID drawable;
+    int x, y, w, h;
+    void *data;
+    Bool pending;
+    Bool done;
+    uint64_t busyNs;
+
+    void (*readPixels)(GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid *);
+    void (*getIntegerv)(GLenum, GLint *);
+    void (*pixelStorei)(GLenum, GLint);
+    void (*readBuffer)(GLenum);
+    void (*bindBuffer)(GLenum, GLuint);
+    void (*bindFramebuffer)(GLenum, GLuint);
+} g_gl = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ *
+ * X error trapping. The handler is process wide, errors of other displays
+ * go on to the previous one.
+ *
+ */
+
+static pthread_mutex_t g_trapLock = PTHREAD_MUTEX_INITIALIZER;
+static Display *g_trapDpy = NULL;
+static Bool g_trapped = False;
+static XErrorHandler g_trapOld = NULL;
+
+static int trapHandler(Display *dpy, XErrorEvent *e)
+{
+    if (dpy == g_trapDpy)
+    {
+        g_trapped = True;
+        return 0;
+    }
+    return g_trapOld ? g_trapOld(dpy, e) : 0;
+}
+
+void backend_trapErrors(Display *dpy)
+{
+    pthread_mutex_lock(&g_trapLock);
+    XSync(dpy, False);
+    g_trapDpy = dpy;
+    g_trapped = False;
+    g_trapOld = XSetErrorHandler(trapHandler);
+}
+
+/* True if an error happened since backend_trapErrors() */
+Bool backend_untrapErrors(Display *dpy)
+{
+    Bool failed;
+
+    XSync(dpy, False);
+    XSetErrorHandler(g_trapOld);
+    failed = g_trapped;
+    g_trapDpy = NULL;
+    pthread_mutex_unlock(&g_trapLock);
+
+    return failed;
+}
+
+/**
+ *
+ * Backends.
+ *
+ */
+
+static Bool xgetimageAvailable(Display *dpy UNUSED, Window win UNUSED, const XWindowAttributes *attrs UNUSED)
+{
+    return True;
+}
+
+static XImage *xgetimageGrab(Display *dpy, Window win, const XWindowAttributes *attrs UNUSED,
+        int x, int y, int w, int h, uint64_t *busyNs UNUSED)
+{
+    return XGetImage(dpy, win, x, y, w, h, AllPlanes, ZPixmap);
+}
+
+static void shmFree(void)
+{
+    if (!g_backend.shmImage)
+        return;
+
+    g_lazy.XShmDetach(g_backend.shmDpy, &g_backend.shmInfo);
+    XDestroyImage(g_backend.shmImage);
+    shmdt(g_backend.shmInfo.shmaddr);
+    g_backend.shmImage = NULL;
+}
+
+static Bool xshmAvailable(Display *dpy, Window win UNUSED, const XWindowAttributes *attrs UNUSED)
+{
+    return lazy_load(LAZY_XEXT) && g_lazy.XShmQueryExtension(dpy);
+}
+
+/* The image stays owned by the backend, see backend_release(). */
+static XImage *xshmGrab(Display *dpy, Window win, const XWindowAttributes *attrs,
+        int x, int y, int w, int h, uint64_t *busyNs UNUSED)
+{
+    XImage *image;
+
+    if (g_backend.shmImage && (g_backend.shmDpy != dpy ||
+        g_backend.shmImage->width != w || g_backend.shmImage->height != h ||
+        g_backend.shmImage->depth != attrs->depth))
+        shmFree();
+
+    if (!g_backend.shmImage)
+    {
+        image = g_lazy.XShmCreateImage(dpy, attrs->visual, attrs->depth, ZPixmap, NULL, &g_backend.shmInfo, w, h);
+        if (!image)
+            return NULL;
+
+        g_backend.shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+        g_backend.shmInfo.shmaddr = image->data =
+            g_backend.shmInfo.shmid >= 0 ? shmat(g_backend.shmInfo.shmid, NULL, 0) : (void *)-1;
+        g_backend.shmInfo.readOnly = False;
+        if (g_backend.shmInfo.shmaddr == (void *)-1 || !g_lazy.XShmAttach(dpy, &g_backend.shmInfo))
+        {
+            if (g_backend.shmInfo.shmid >= 0)
+                shmctl(g_backend.shmInfo.shmid, IPC_RMID, NULL);
+            if (g_backend.shmInfo.shmaddr != (void *)-1)
+                shmdt(g_backend.shmInfo.shmaddr);
+            image->data = NULL;
+            XDestroyImage(image);
+            return NULL;
+        }
+        /* Segment goes away with the last detach */
+        XSync(dpy, False);
+        shmctl(g_backend.shmInfo.shmid, IPC_RMID, NULL);
+        g_backend.shmImage = image;
+        g_backend.shmDpy = dpy;
+    }
+
+    return g_lazy.XShmGetImage(dpy, win, g_backend.shmImage, x, y, AllPlanes) ? g_backend.shmImage : NULL;
+}
+
+/* Only worth it with a compositing manager, which has the window in an
+ * offscreen pixmap anyway. */
+static Bool compositeAvailable(Display *dpy, Window win UNUSED, const XWindowAttributes *attrs)
+{
+    int event, error, major = 0, minor = 0;
+    char name[32];
+
+    if (!lazy_load(LAZY_XCOMPOSITE) || !g_lazy.XCompositeQueryExtension(dpy, &event, &error) ||
+        !g_lazy.XCompositeQueryVersion(dpy, &major, &minor) || (major == 0 && minor < 2))
+        return False;
+
+    snprintf(name, sizeof(name), "_NET_WM_CM_S%d", XScreenNumberOfScreen(attrs->screen));
+
+    return XGetSelectionOwner(dpy, XInternAtom(dpy, name, False)) != None;
+}
+
+static XImage *compositeGrab(Display *dpy, Window win, const XWindowAttributes *attrs UNUSED,
+        int x, int y, int w, int h, uint64_t *busyNs UNUSED)
+{
+    XImage *image;
+    Pixmap pix;
+
+    g_lazy.XCompositeRedirectWindow(dpy, win, CompositeRedirectAutomatic);
+    pix = g_lazy.XCompositeNameWindowPixmap(dpy, win);
+    image = XGetImage(dpy, pix, x, y, w, h, AllPlanes, ZPixmap);
+    XFreePixmap(dpy, pix);
+    g_lazy.XCompositeUnredirectWindow(dpy, win, CompositeRedirectAutomatic);
+
+    return image;
+}
+
+/* Once the game swapped buffers on win, it can be read back from GL. */
+static Bool glAvailable(Display *dpy UNUSED, Window win, const XWindowAttributes *attrs UNUSED)
+{
+    return __atomic_load_n(&g_gl.lastDrawable, __ATOMIC_RELAXED) == win;
+}
+
+static XImage *glGrab(Display *dpy, Window win, const XWindowAttributes *attrs,
+        int x, int y, int w, int h, uint64_t *busyNs)
+{
+    struct timespec ts;
+    XImage *image = NULL;
+    uint8_t *data, *flipped;
+    int rc = 0, row;
+    Bool done;
+
+    if ((data = malloc(4 * (size_t)w * h)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&g_gl.lock);
+    g_gl.drawable = win;
+    /* GL's origin is bottom left */
+    g_gl.x = x;
+    g_gl.y = attrs->height - y - h;
+    g_gl.w = w;
+    g_gl.h = h;
+    g_gl.data = data;
+    g_gl.done = False;
+    g_gl.pending = True;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += BACKEND_GL_WAIT_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    while (rc == 0 && !g_gl.done)
+        rc = pthread_cond_timedwait(&g_gl.cond, &g_gl.lock, &ts);
+    g_gl.pending = False;
+    done = g_gl.done;
+    pthread_mutex_unlock(&g_gl.lock);
+
+    if (!done || (flipped = malloc(4 * (size_t)w * h)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+
+    *busyNs = nowNs();
+    for (row = 0; row < h; row++)
+        memcpy(flipped + 4 * (size_t)w * row, data + 4 * (size_t)w * (h - row - 1), 4 * (size_t)w);
+    free(data);
+
+    image = XCreateImage(dpy, attrs->visual, 24, ZPixmap, 0, (char *)flipped, w, h, 32, 4 * w);
+    if (image)
+    {
+        image->red_mask = 0xFF0000;
+        image->green_mask = 0xFF00;
+        image->blue_mask = 0xFF;
+    }
+    else
+    {
+        free(flipped);
+    }
+    *busyNs = nowNs() - *busyNs + g_gl.busyNs;
+
+    return image;
+}
+
+/* Pack state the readback depends on, with the values it needs */
+static const struct
+{
+    GLenum name;
+    GLint value;
+} g_glPack[] =
+{
+    { GL_PACK_ALIGNMENT, 4 },
+    { GL_PACK_ROW_LENGTH, 0 },
+    { GL_PACK_SKIP_ROWS, 0 },
+    { GL_PACK_SKIP_PIXELS, 0 },
+    { GL_PACK_SWAP_BYTES, GL_FALSE },
+};
+
+#define BACKEND_GL_PACK (sizeof(g_glPack) / sizeof(g_glPack[0]))
+
+static const backend g_backends[BACKEND_MAX] =
+{
+    [BACKEND_XGETIMAGE] = { "xgetimage", xgetimageAvailable, xgetimageGrab, METRIC_BACKEND_XGETIMAGE },
+    [BACKEND_XSHM] = { "xshm", xshmAvailable, xshmGrab, METRIC_BACKEND_XSHM },
+    [BACKEND_COMPOSITE] = { "composite", compositeAvailable, compositeGrab, METRIC_BACKEND_COMPOSITE },
+    [BACKEND_GL] = { "gl", glAvailable, glGrab, METRIC_BACKEND_GL },
+};
+
+/* Called from the glXSwapBuffers hook, on the game's render thread with its
+ * context current, right before the real swap. */
+void backend_glSwap(Display *dpy UNUSED, XID drawable)
+{
+    GLint pack[BACKEND_GL_PACK], readBuf, pbo = 0, fbo = 0;
+    uint64_t t0;
+    size_t i;
+
+    if (__atomic_load_n(&g_gl.lastDrawable, __ATOMIC_RELAXED) != drawable)
+        __atomic_store_n(&g_gl.lastDrawable, drawable, __ATOMIC_RELAXED);
+
+    /* Cheap check first, this runs every frame. */
+    if (!__atomic_load_n(&g_gl.pending, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&g_gl.lock);
+    if (!g_gl.pending || g_gl.done || g_gl.drawable != drawable)
+    {
+        pthread_mutex_unlock(&g_gl.lock);
+        return;
+    }
+
+    if (!g_gl.readPixels)
+    {
+        g_gl.readPixels = dlsym(RTLD_DEFAULT, "glReadPixels");
+        g_gl.getIntegerv = dlsym(RTLD_DEFAULT, "glGetIntegerv");
+        g_gl.pixelStorei = dlsym(RTLD_DEFAULT, "glPixelStorei");
+        g_gl.readBuffer = dlsym(RTLD_DEFAULT, "glReadBuffer");
+        g_gl.bindBuffer = dlsym(RTLD_DEFAULT, "glBindBuffer");
+        g_gl.bindFramebuffer = dlsym(RTLD_DEFAULT, "glBindFramebuffer");
+    }
+
+    if (g_gl.readPixels && g_gl.getIntegerv && g_gl.pixelStorei && g_gl.readBuffer)
+    {
+        t0 = nowNs();
+
+        /* Leave the game's state as it was */
+        for (i = 0; i < BACKEND_GL_PACK; i++)
+        {
+            g_gl.getIntegerv(g_glPack[i].name, &pack[i]);
+            if (pack[i] != g_glPack[i].value)
+                g_gl.pixelStorei(g_glPack[i].name, g_glPack[i].value);
+        }
+        if (g_gl.bindBuffer)
+        {
+            g_gl.getIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pbo);
+            if (pbo)
+                g_gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        /* The back buffer is only readable from the default framebuffer */
+        if (g_gl.bindFramebuffer)
+        {
+            g_gl.getIntegerv(GL_READ_FRAMEBUFFER_BINDING, &fbo);
+            if (fbo)
+                g_gl.bindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        }
+        g_gl.getIntegerv(GL_READ_BUFFER, &readBuf);
+        g_gl.readBuffer(GL_BACK);
+
+        g_gl.readPixels(g_gl.x, g_gl.y, g_gl.w, g_gl.h, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, g_gl.data);
+
+        g_gl.readBuffer(readBuf);
+        if (fbo)
+            g_gl.bindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        if (pbo)
+            g_gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        for (i = 0; i < BACKEND_GL_PACK; i++)
+            if (pack[i] != g_glPack[i].value)
+                g_gl.pixelStorei(g_glPack[i].name, pack[i]);
+
+        g_gl.busyNs = nowNs() - t0;
+        g_gl.done = True;
+    }
+    else
+    {
+        log(LOG_WARN, "GL readback functions not found.\n");
+        g_gl.pending = False;
+    }
+
+    pthread_cond_signal(&g_gl.cond);
+    pthread_mutex_unlock(&g_gl.lock);
+}
+
+/**
+ *
+ * Selection.
+ *
+ */
+
+void backend_init(void)
+{
+    const char *name = cfg_getStr("CAPTURE_BACKEND", "auto");
+    int i;
+
+    for (i = 0; i < BACKEND_MAX && strcmp(g_backends[i].name, name); i++)
+        ;
+
+    if (i < BACKEND_MAX)
+        g_backend.forced = i;
+    else if (strcmp(name, "auto") != 0)
+        log(LOG_WARN, "Unknown capture backend \"%s\", selecting automatically.\n", name);
+}
+
+/* Grab with errors trapped, NULL if the server refused. Lock held. */
+static XImage *tryGrab(int b, Display *dpy, Window win, const XWindowAttributes *attrs,
+        int x, int y, int w, int h, uint64_t *busyNs)
+{
+    XImage *image;
+
+    /* The GL grab doesn't do X requests, but waits for the game's next
+     * frame; trapping meanwhile would swallow the game's own errors. */
+    if (b == BACKEND_GL)
+        return g_backends[b].grab(dpy, win, attrs, x, y, w, h, busyNs);
+
+    backend_trapErrors(dpy);
+    image = g_backends[b].grab(dpy, win, attrs, x, y, w, h, busyNs);
+    if (backend_untrapErrors(dpy) && image)
+    {
+        if (image != g_backend.shmImage)
+            XDestroyImage(image);
+        image = NULL;
+    }
+    if (!image && b == BACKEND_XSHM)
+        shmFree();
+
+    return image;
+}
+
+/* Time every available backend on a corner of win, return the fastest. */
+static int probe(Display *dpy, Window win, const XWindowAttributes *attrs)
+{
+    int w = attrs->width < BACKEND_PROBE_SIZE ? attrs->width : BACKEND_PROBE_SIZE;
+    int h = attrs->height < BACKEND_PROBE_SIZE ? attrs->height : BACKEND_PROBE_SIZE;
+    uint64_t t0, ns, busy, best = UINT64_MAX;
+    int b, i, fastest = BACKEND_XGETIMAGE;
+    XImage *image;
+    Bool ok;
+
+    metric_add(METRIC_BACKEND_PROBES, 1);
+
+    for (b = 0; b < BACKEND_MAX; b++)
+    {
+        if (!g_backends[b].available(dpy, win, attrs))
+        {
+            log(LOG_INFO, "Capture backend %s not available for window 0x%lx.\n", g_backends[b].name, win);
+            continue;
+        }
+
+        /* The first run sets things up, the second one is timed. */
+        for (i = 0, ok = True, ns = 0; ok && i < 2; i++)
+        {
+            busy = 0;
+            t0 = nowNs();
+            image = tryGrab(b, dpy, win, attrs, 0, 0, w, h, &busy);
+            ns = busy ? busy : nowNs() - t0;
+            ok = image != NULL;
+            if (image && image != g_backend.shmImage)
+                XDestroyImage(image);
+        }
+
+        if (!ok)
+        {
+            log(LOG_INFO, "Capture backend %s failed for window 0x%lx.\n", g_backends[b].name, win);
+            continue;
+        }
+
+        log(LOG_INFO, "Capture backend %s: %.3f ms for %dx%d.\n", g_backends[b].name, ns / 1e6, w, h);
+        if (ns < best)
+        {
+            best = ns;
+            fastest = b;
+        }
+    }
+
+    log(LOG_NOTICE, "Capture backend for window 0x%lx (visual 0x%lx): %s.\n",
+            win, attrs->visual->visualid, g_backends[fastest].name);
+
+    return fastest;
+}
+
+static int choose(Display *dpy, Window win, const XWindowAttributes *attrs)
+{
+    int i, b;
+
+    if (g_backend.forced != BACKEND_AUTO)
+        return g_backend.forced;
+
+    for (i = 0; i < BACKEND_CACHE_SIZE; i++)
+    {
+        if (g_backend.cache[i].win == win && g_backend.cache[i].visual == attrs->visual->visualid)
+            return g_backend.cache[i].backend;
+    }
+
+    b = probe(dpy, win, attrs);
+
+    /* Oldest entry goes */
+    i = g_backend.next++ % BACKEND_CACHE_SIZE;
+    g_backend.cache[i].win = win;
+    g_backend.cache[i].visual = attrs->visual->visualid;
+    g_backend.cache[i].backend = b;
+
+    return b;
+}
+
+/* Grab all of win with its backend, release with backend_release(). */
+XImage *backend_grab(Display *dpy, Window win, const XWindowAttributes *attrs)
+{
+    uint64_t busy;
+    XImage *image;
+    int b;
+
+    pthread_mutex_lock(&g_backend.lock);
+
+    b = choose(dpy, win, attrs);
+    image = tryGrab(b, dpy, win, attrs, 0, 0, attrs->width, attrs->height, &busy);
+    if (image)
+    {
+        metric_add(g_backends[b].metric, 1);
+    }
+    else if (b != BACKEND_XGETIMAGE)
+    {
+        log(LOG_WARN, "Capture backend %s failed, falling back to xgetimage.\n", g_backends[b].name);
+        metric_add(METRIC_BACKEND_FALLBACKS, 1);
+        image = XGetImage(dpy, win, 0, 0, attrs->width, attrs->height, AllPlanes, ZPixmap);
+    }
+
+    /* The XShm image is reused, keep it until released. */
+    if (image != g_backend.shmImage || !image)
+        pthread_mutex_unlock(&g_backend.lock);
+
+    return image;
+}
+
+void backend_release(XImage *image)
+{
+    if (!image)
+        return;
+
+    if (image == g_backend.shmImage)
+        pthread_mutex_unlock(&g_backend.lock);
+    else
+        XDestroyImage(image);
+}
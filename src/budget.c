@@ -0,0 +1,247 @@
+/**
+ *
+ * Memory budget for in-flight captures.
+ *
+ * Every capture reserves the bytes it is going to hold (grabbed XImage plus
+ * the converted RGB buffer) before allocating them. When the budget would be
+ * exceeded, the configured policy decides what happens:
+ *  - newest:    the new capture is dropped,
+ *  - oldest:    the oldest in-flight captures are asked to drop (they check
+ *               budget_isDropped() at their next stage) and the new one waits
+ *               a short while for the memory to be released,
+ *  - downscale: the new capture is grabbed in bands and downscaled by the
+ *               smallest integer factor that fits.
+ *
+ */
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "sssp.h"
+
+/* Maximum scale factor tried by the downscale policy */
+#define BUDGET_MAX_SCALE 16
+/* How long a capture waits for dropped ones to release their memory (ms) */
+#define BUDGET_WAIT_MS 250
+
+enum BudgetPolicy
+{
+    BUDGET_DROP_NEWEST,
+    BUDGET_DROP_OLDEST,
+    BUDGET_DOWNSCALE
+};
+
+static pthread_mutex_t g_budgetLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_budgetCond = PTHREAD_COND_INITIALIZER;
+static size_t g_budgetBytes = 0;
+static size_t g_budgetUsed = 0;
+static enum BudgetPolicy g_budgetPolicy = BUDGET_DROP_NEWEST;
+/* In-flight captures, oldest first */
+static budgetSlot *g_budgetSlots = NULL;
+
+void budget_init(void)
+{
+    const char *policy = cfg_getStr("MEM_POLICY", "newest");
+
+    /* 0 disables the budget */
+    g_budgetBytes = (size_t)cfg_getLong("MEM_BUDGET", 256) << 20;
+
+    if (strcmp(policy, "oldest") == 0)
+        g_budgetPolicy = BUDGET_DROP_OLDEST;
+    else if (strcmp(policy, "downscale") == 0)
+        g_budgetPolicy = BUDGET_DOWNSCALE;
+    else
+        g_budgetPolicy = BUDGET_DROP_NEWEST;
+
+    log(LOG_INFO, "Capture memory budget: %zu MiB, policy %s\n",
+            g_budgetBytes >> 20, policy);
+}
+
+/* Bytes held by a w x h capture downscaled by scale. Downscaled captures are
+ * grabbed in bands of CAPTURE_BAND_ROWS output rows, full size ones at once. */
+static size_t captureCost(int w, int h, int scale)
+{
+    size_t rgb = 3 * (size_t)(w / scale) * (h / scale);
+
+    if (scale == 1)
+        return 4 * (size_t)w * h + rgb;
+
+    return 4 * (size_t)w * CAPTURE_BAND_ROWS * scale + rgb;
+}
+
+static void linkSlot(budgetSlot *slot, size_t bytes)
+{
+    budgetSlot **s = &g_budgetSlots;
+
+    while (*s)
+        s = &(*s)->next;
+    *s = slot;
+
+    slot->bytes = bytes;
+    slot->dropped = False;
+    slot->next = NULL;
+    g_budgetUsed += bytes;
+    metric_max(METRIC_MEM_PEAK, g_budgetUsed);
+}
+
+/* Ask the oldest captures to drop until need fits. Returns False if even
+ * dropping all of them wouldn't be enough. */
+static Bool dropOldest(size_t need)
+{
+    size_t freed = 0;
+    budgetSlot *s;
+
+    for (s = g_budgetSlots; s; s = s->next)
+    {
+        if (s->dropped)
+            freed += s->bytes;
+    }
+
+    for (s = g_budgetSlots; s && g_budgetUsed - freed + need > g_budgetBytes; s = s->next)
+    {
+        if (s->dropped)
+            continue;
+
+        __atomic_store_n(&s->dropped, True, __ATOMIC_RELAXED);
+        freed += s->bytes;
+        metric_add(METRIC_MEM_DROP_OLDEST, 1);
+        log(LOG_WARN, "Memory budget exceeded, dropping in-flight capture (%zu bytes).\n", s->bytes);
+    }
+
+    return g_budgetUsed - freed + need <= g_budgetBytes;
+}
+
+int budget_reserveCapture(budgetSlot *slot, int w, int h)
+{
+    size_t need = captureCost(w, h, 1);
+    int scale = 1;
+    struct timespec ts;
+    int rc = 0;
+
+    pthread_mutex_lock(&g_budgetLock);
+
+    if (!g_budgetBytes || g_budgetUsed + need <= g_budgetBytes)
+    {
+        linkSlot(slot, need);
+        pthread_mutex_unlock(&g_budgetLock);
+        return 1;
+    }
+
+    switch (g_budgetPolicy)
+    {
+        case BUDGET_DOWNSCALE:
+            for (scale = 2; scale <= BUDGET_MAX_SCALE && w / scale && h / scale; scale++)
+            {
+                need = captureCost(w, h, scale);
+                if (g_budgetUsed + need <= g_budgetBytes)
+                {
+                    linkSlot(slot, need);
+                    metric_add(METRIC_MEM_DOWNSCALE, 1);
+                    log(LOG_WARN, "Memory budget exceeded, downscaling capture by %d.\n", scale);
+                    pthread_mutex_unlock(&g_budgetLock);
+                    return scale;
+                }
+            }
+            break;
+
+        case BUDGET_DROP_OLDEST:
+            if (!dropOldest(need))
+                break;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += BUDGET_WAIT_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            while (rc == 0 && g_budgetUsed + need > g_budgetBytes)
+                rc = pthread_cond_timedwait(&g_budgetCond, &g_budgetLock, &ts);
+
+            if (g_budgetUsed + need <= g_budgetBytes)
+            {
+                linkSlot(slot, need);
+                pthread_mutex_unlock(&g_budgetLock);
+                return 1;
+            }
+            break;
+
+        case BUDGET_DROP_NEWEST:
+            break;
+    }
+
+    metric_add(METRIC_MEM_DROP_NEWEST, 1);
+    log(LOG_ERROR, "Memory budget exceeded (%zu of %zu bytes in use), dropping %dx%d capture.\n",
+            g_budgetUsed, g_budgetBytes, w, h);
+    pthread_mutex_unlock(&g_budgetLock);
+
+    return 0;
+}
+
+/* Reserve a fixed amount, no policy applies. */
+Bool budget_reserveBytes(budgetSlot *slot, size_t bytes)
+{
+    Bool rc = False;
+
+    pthread_mutex_lock(&g_budgetLock);
+    if (!g_budgetBytes || g_budgetUsed + bytes <= g_budgetBytes)
+    {
+        linkSlot(slot, bytes);
+        rc = True;
+    }
+    pthread_mutex_unlock(&g_budgetLock);
+
+    return rc;
+}
+
+/* Lower a reservation once parts of the capture got freed. */
+void budget_shrink(budgetSlot *slot, size_t bytes)
+{
+    pthread_mutex_lock(&g_budgetLock);
+    if (bytes < slot->bytes)
+    {
+        g_budgetUsed -= slot->bytes - bytes;
+        slot->bytes = bytes;
+        pthread_cond_broadcast(&g_budgetCond);
+    }
+    pthread_mutex_unlock(&g_budgetLock);
+}
+
+/* Raise a reservation by bytes, no policy applies. */
+Bool budget_grow(budgetSlot *slot, size_t bytes)
+{
+    Bool rc = False;
+
+    pthread_mutex_lock(&g_budgetLock);
+    if (!g_budgetBytes || g_budgetUsed + bytes <= g_budgetBytes)
+    {
+        slot->bytes += bytes;
+        g_budgetUsed += bytes;
+        metric_max(METRIC_MEM_PEAK, g_budgetUsed);
+        rc = True;
+    }
+    pthread_mutex_unlock(&g_budgetLock);
+
+    return rc;
+}
+
+void budget_release(budgetSlot *slot)
+{
+    budgetSlot **s;
+
+    pthread_mutex_lock(&g_budgetLock);
+    for (s = &g_budgetSlots; *s; s = &(*s)->next)
+    {
+        if (*s == slot)
+        {
+            *s = slot->next;
+            g_budgetUsed -= slot->bytes;
+            slot->bytes = 0;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&g_budgetCond);
+    pthread_mutex_unlock(&g_budgetLock);
+}
+
+Bool budget_isDropped(budgetSlot *slot)
+{
+    return __atomic_load_n(&slot->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,258 @@
+/**
+ *
+ * Burst capture: a series of screenshots at a fixed rate.
+ *
+ * The game thread only records the request, everything else happens in pool
+ * jobs with their own X connection. Set up and submission run at normal
+ * priority, the frames are grabbed by a background job scheduled again for
+ * each one. Buffers for all frames are allocated (and accounted against the
+ * memory budget) before the first grab.
+ * Frames without changed content are skipped, determined by damage events
+ * when the Damage extension is there and by a content hash otherwise. The
+ * frames taken are submitted after the last one has been grabbed, so the
+ * submission doesn't disturb the capture rate.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sssp.h"
+
+static void startJob(void *arg);
+static void frameJob(void *arg);
+static void finishJob(void *arg);
+
+static struct
+{
+    poolJob startJob;
+    poolJob frameJob;
+    poolJob finishJob;
+    /* Set by the request, until the burst is done */
+    Bool busy;
+    Window pending;
+    Display *dpy;
+
+    /* Configuration */
+    long frames;
+    long fps;
+    Bool useDamage;
+
+    submitFunc submit;
+
+    /* The burst running, handed from job to job */
+    Window win;
+    XWindowAttributes attrs;
+    budgetSlot slot;
+    shadowFb *shadow;
+    uint8_t *buffers;
+    uint64_t *hashes;
+    size_t frameBytes;
+    uint64_t t0, period, gen;
+    long n, i, taken, skipped;
+} g_burst = {
+    .startJob = POOL_JOB(startJob, NULL),
+    .frameJob = POOL_BACKGROUND_JOB(frameJob, NULL),
+    .finishJob = POOL_JOB(finishJob, NULL)
+};
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Set up the burst at normal priority: it takes the budget's lock and loads
+ * the damage libraries. */
+static Bool startBurst(Display *dpy, Window target)
+{
+    XWindowAttributes *attrs = &g_burst.attrs;
+    long n = g_burst.frames;
+
+    if ((g_burst.win = capture_findWindow(dpy, target, attrs)) == None)
+        return False;
+
+    /* All frames plus one grab in flight have to fit. */
+    memset(&g_burst.slot, 0, sizeof(g_burst.slot));
+    g_burst.frameBytes = 3 * (size_t)attrs->width * attrs->height;
+    while (n && !budget_reserveBytes(&g_burst.slot, n * g_burst.frameBytes + 4 * (size_t)attrs->width * attrs->height))
+        n /= 2;
+
+    g_burst.buffers = n ? malloc(n * g_burst.frameBytes) : NULL;
+    g_burst.hashes = n ? malloc(n * sizeof(*g_burst.hashes)) : NULL;
+    if (!g_burst.buffers || !g_burst.hashes)
+    {
+        free(g_burst.buffers);
+        free(g_burst.hashes);
+        log(LOG_ERROR, "Burst: no memory for %dx%d frames.\n", attrs->width, attrs->height);
+        budget_release(&g_burst.slot);
+        return False;
+    }
+    if (n < g_burst.frames)
+        log(LOG_WARN, "Burst: memory budget limits the burst to %ld frames.\n", n);
+
+    g_burst.shadow = g_burst.useDamage ? shadow_create(dpy, g_burst.win) : NULL;
+
+    log(LOG_NOTICE, "Burst of %ld frames at %ld fps from window 0x%lx (%dx%d, %s).\n",
+            g_burst.frames, g_burst.fps, g_burst.win, attrs->width, attrs->height,
+            g_burst.shadow ? "damage gated" : "hash gated");
+
+    g_burst.n = n;
+    g_burst.i = g_burst.taken = g_burst.skipped = 0;
+    g_burst.gen = 0;
+    g_burst.period = 1000000000ULL / g_burst.fps;
+    g_burst.t0 = nowNs();
+
+    return True;
+}
+
+static void startJob(void *arg UNUSED)
+{
+    Window win = __atomic_load_n(&g_burst.pending, __ATOMIC_RELAXED);
+
+    /* Kept for the next burst, whichever worker runs it */
+    if (!g_burst.dpy && (g_burst.dpy = XOpenDisplay(NULL)) == NULL)
+        log(LOG_ERROR, "Burst: unable to open display.\n");
+
+    /* The GL backend reads back on buffer swaps */
+    got_require(GOT_SWAP);
+    if (g_burst.dpy && startBurst(g_burst.dpy, win) && pool_schedule(&g_burst.frameJob, 0))
+        return;
+
+    got_release(GOT_SWAP);
+    __atomic_store_n(&g_burst.busy, False, __ATOMIC_RELEASE);
+}
+
+/* Grab one frame, then schedule the next or the end. */
+static void frameJob(void *arg UNUSED)
+{
+    const XWindowAttributes *attrs = &g_burst.attrs;
+    uint8_t *buf = g_burst.buffers + g_burst.taken * g_burst.frameBytes;
+    XWindowAttributes cur;
+    const XImage *fb;
+    XImage *image = NULL;
+    hashState hs;
+    uint64_t next, now;
+    Bool updated = False;
+
+    /* The window may change or go away at any time, which mustn't end in
+     * Xlib's default error handler. */
+    backend_trapErrors(g_burst.dpy);
+    if (g_burst.shadow)
+        updated = shadow_update(g_burst.shadow);
+    else if (XGetWindowAttributes(g_burst.dpy, g_burst.win, &cur) && cur.map_state == IsViewable &&
+             cur.width == attrs->width && cur.height == attrs->height)
+        image = XGetImage(g_burst.dpy, g_burst.win, 0, 0, attrs->width, attrs->height, AllPlanes, ZPixmap);
+    else
+        g_burst.skipped++;
+
+    if (backend_untrapErrors(g_burst.dpy))
+    {
+        if (image)
+            XDestroyImage(image);
+        log(LOG_WARN, "Burst: window 0x%lx changed or went away, stopping.\n", g_burst.win);
+        pool_schedule(&g_burst.finishJob, 0);
+        return;
+    }
+
+    if (updated)
+    {
+        fb = shadow_lock(g_burst.shadow);
+        if (fb && fb->width == attrs->width && fb->height == attrs->height &&
+            shadow_generation(g_burst.shadow) != g_burst.gen)
+        {
+            g_burst.gen = shadow_generation(g_burst.shadow);
+            hash_init(&hs);
+            capture_convert(fb, buf, attrs->width, attrs->height, 1, &hs);
+            g_burst.hashes[g_burst.taken++] = hash_final(&hs);
+        }
+        else
+        {
+            g_burst.skipped++;
+        }
+        shadow_unlock(g_burst.shadow);
+    }
+    else if (image)
+    {
+        hash_init(&hs);
+        capture_convert(image, buf, attrs->width, attrs->height, 1, &hs);
+        XDestroyImage(image);
+
+        g_burst.hashes[g_burst.taken] = hash_final(&hs);
+        if (g_burst.taken && g_burst.hashes[g_burst.taken] == g_burst.hashes[g_burst.taken - 1])
+            g_burst.skipped++;
+        else
+            g_burst.taken++;
+    }
+
+    if (++g_burst.i >= g_burst.frames || g_burst.taken >= g_burst.n)
+    {
+        pool_schedule(&g_burst.finishJob, 0);
+        return;
+    }
+
+    next = g_burst.t0 + g_burst.i * g_burst.period;
+    now = nowNs();
+    pool_schedule(&g_burst.frameJob, next > now ? next - now : 0);
+}
+
+/* Submit at normal priority, steam and the dedup cache are shared. */
+static void finishJob(void *arg UNUSED)
+{
+    long i;
+
+    shadow_destroy(g_burst.shadow);
+    g_burst.shadow = NULL;
+
+    log(LOG_NOTICE, "Burst done: %ld frames taken, %ld unchanged skipped in %.1f ms.\n",
+            g_burst.taken, g_burst.skipped, (nowNs() - g_burst.t0) / 1e6);
+    metric_add(METRIC_BURST_FRAMES, g_burst.taken);
+    metric_add(METRIC_BURST_SKIPPED, g_burst.skipped);
+
+    /* The grab buffer isn't needed anymore */
+    budget_shrink(&g_burst.slot, g_burst.n * g_burst.frameBytes);
+
+    for (i = 0; i < g_burst.taken; i++)
+        g_burst.submit(g_burst.buffers + i * g_burst.frameBytes, g_burst.attrs.width, g_burst.attrs.height,
+                g_burst.hashes[i]);
+
+    free(g_burst.buffers);
+    free(g_burst.hashes);
+    g_burst.buffers = NULL;
+    g_burst.hashes = NULL;
+    budget_release(&g_burst.slot);
+
+    got_release(GOT_SWAP);
+    __atomic_store_n(&g_burst.busy, False, __ATOMIC_RELEASE);
+}
+
+void burst_init(submitFunc submit)
+{
+    g_burst.frames = cfg_getLong("BURST_FRAMES", 20);
+    g_burst.fps = cfg_getLong("BURST_FPS", 10);
+    g_burst.useDamage = cfg_getLong("DAMAGE", 1);
+    g_burst.submit = submit;
+
+    if (g_burst.frames <= 0 || g_burst.fps <= 0)
+        log(LOG_ERROR, "Burst capture disabled due to invalid configuration.\n");
+}
+
+/* Called from the game's thread, so only record the request. */
+Bool burst_request(Window win)
+{
+    Bool busy = False;
+
+    if (g_burst.frames <= 0)
+        return False;
+
+    if (!__atomic_compare_exchange_n(&g_burst.busy, &busy, True, False, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return False;
+
+    __atomic_store_n(&g_burst.pending, win, __ATOMIC_RELAXED);
+    if (pool_schedule(&g_burst.startJob, 0))
+        return True;
+
+    __atomic_store_n(&g_burst.busy, False, __ATOMIC_RELEASE);
+    return False;
+}
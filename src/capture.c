@@ -0,0 +1,499 @@
+/**
+ *
+ * Window capturing and conversion to the plain RGB steam expects.
+ *
+ * Crop and scale (SSSP_CAPTURE_CROP, SSSP_CAPTURE_SCALE) are applied on the
+ * X server: the window is composited through an XRender transform into an
+ * offscreen pixmap of the final size, and only that is read back. The
+ * downscale policy of the memory budget uses the same path when XRender is
+ * there.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <X11/extensions/Xrender.h>
+
+#include "sssp.h"
+
+/* Largest box kernel used for server side downscaling */
+#define CAPTURE_MAX_KERNEL 8
+
+static struct
+{
+    long scalePct;
+    Bool crop;
+    int cropFlags;
+    int cropX, cropY;
+    unsigned int cropW, cropH;
+} g_capture = { .scalePct = 100 };
+
+/* Position and width of a channel within a pixel */
+typedef struct
+{
+    int shift;
+    int bits;
+} channelMask;
+
+static inline channelMask maskOf(unsigned long mask)
+{
+    channelMask m = { 0, 0 };
+
+    if (mask)
+    {
+        m.shift = __builtin_ctzl(mask);
+        m.bits = __builtin_popcountl(mask);
+    }
+    return m;
+}
+
+/* Channel of val scaled to 8 bits, whatever its width (8 and 10 usually). */
+static inline uint8_t channel8(uint32_t val, channelMask m)
+{
+    uint32_t c = (val >> m.shift) & ((1U << m.bits) - 1);
+
+    if (m.bits >= 8)
+        return c >> (m.bits - 8);
+    return m.bits ? c * 255 / ((1U << m.bits) - 1) : 0;
+}
+
+/* Convert a grabbed TrueColor image to plain RGB, averaging scale x scale
+ * blocks of source pixels into one destination pixel. If hash is given, each
+ * converted row is hashed while it's still in cache. */
+void capture_convert(const XImage *image, uint8_t *data, int w, int h, int scale, hashState *hash)
+{
+    const channelMask rm = maskOf(image->red_mask), gm = maskOf(image->green_mask), bm = maskOf(image->blue_mask);
+    int x, y, sx, sy;
+    uint8_t *row;
+
+    /* TrueColor (which we assume) has got 4 bytes per pixel. */
+    /* TODO assert depth */
+    if (scale == 1)
+    {
+        for (y = 0; y < h; y++)
+        {
+            const uint32_t *src = (const uint32_t *)(image->data + y * image->bytes_per_line);
+            for (x = 0, row = data; x < w; x++, data += 3)
+            {
+                data[0] = channel8(src[x], rm);
+                data[1] = channel8(src[x], gm);
+                data[2] = channel8(src[x], bm);
+            }
+            if (hash)
+                hash_update(hash, row, 3 * w);
+        }
+        return;
+    }
+
+    for (y = 0; y < h; y++)
+    {
+        for (x = 0, row = data; x < w; x++, data += 3)
+        {
+            uint32_t r = 0, g = 0, b = 0;
+            for (sy = 0; sy < scale; sy++)
+            {
+                const uint32_t *src = (const uint32_t *)(image->data +
+                        (y * scale + sy) * image->bytes_per_line) + x * scale;
+                for (sx = 0; sx < scale; sx++)
+                {
+                    r += channel8(src[sx], rm);
+                    g += channel8(src[sx], gm);
+                    b += channel8(src[sx], bm);
+                }
+            }
+            data[0] = r / (scale * scale);
+            data[1] = g / (scale * scale);
+            data[2] = b / (scale * scale);
+        }
+        if (hash)
+            hash_update(hash, row, 3 * w);
+    }
+}
+
+/* True for 2:10:10:10 (depth 30) images. */
+Bool capture_isDeep(const XImage *image)
+{
+    return image->bits_per_pixel == 32 &&
+        maskOf(image->red_mask).bits == 10 &&
+        maskOf(image->green_mask).bits == 10 &&
+        maskOf(image->blue_mask).bits == 10;
+}
+
+/* Unpack a 2:10:10:10 image into 16 bit per channel RGB (deep) and the 8 bit
+ * RGB steam wants (data) in one pass. 10 bit values are widened by bit
+ * replication, so full scale stays full scale, and truncated for 8 bit like
+ * capture_convert() does. The 8 bit rows are hashed if hash is given. */
+void capture_convertDeep(const XImage *image, uint16_t *deep, uint8_t *data, int w, int h, hashState *hash)
+{
+    const channelMask rm = maskOf(image->red_mask), gm = maskOf(image->green_mask), bm = maskOf(image->blue_mask);
+    int x, y;
+
+    for (y = 0; y < h; y++, deep += 3 * w, data += 3 * w)
+    {
+        const uint32_t *src = (const uint32_t *)(image->data + y * image->bytes_per_line);
+        x = 0;
+
+#if defined(__SSE2__)
+        const __m128i m10 = _mm_set1_epi32(0x3FF);
+        const __m128i rs = _mm_cvtsi32_si128(rm.shift), gs = _mm_cvtsi32_si128(gm.shift), bs = _mm_cvtsi32_si128(bm.shift);
+
+        /* Four pixels at a time. Each pixel is stored with one 8 (4) byte
+         * write, whose excess bytes the next pixel overwrites; so stop while
+         * there's still a pixel left in the row. */
+        for (; x + 4 < w; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+            __m128i r = _mm_and_si128(_mm_srl_epi32(v, rs), m10);
+            __m128i g = _mm_and_si128(_mm_srl_epi32(v, gs), m10);
+            __m128i b = _mm_and_si128(_mm_srl_epi32(v, bs), m10);
+            __m128i r16 = _mm_or_si128(_mm_slli_epi32(r, 6), _mm_srli_epi32(r, 4));
+            __m128i g16 = _mm_or_si128(_mm_slli_epi32(g, 6), _mm_srli_epi32(g, 4));
+            __m128i b16 = _mm_or_si128(_mm_slli_epi32(b, 6), _mm_srli_epi32(b, 4));
+            __m128i rg16 = _mm_or_si128(r16, _mm_slli_epi32(g16, 16));
+            __m128i rgb8 = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(r, 2), _mm_slli_epi32(_mm_srli_epi32(g, 2), 8)),
+                                        _mm_slli_epi32(_mm_srli_epi32(b, 2), 16));
+            uint64_t q[4];
+            uint32_t d[4];
+            int i;
+
+            _mm_storeu_si128((__m128i *)q, _mm_unpacklo_epi32(rg16, b16));
+            _mm_storeu_si128((__m128i *)(q + 2), _mm_unpackhi_epi32(rg16, b16));
+            _mm_storeu_si128((__m128i *)d, rgb8);
+            for (i = 0; i < 4; i++)
+            {
+                memcpy(deep + 3 * (x + i), &q[i], sizeof(q[i]));
+                memcpy(data + 3 * (x + i), &d[i], sizeof(d[i]));
+            }
+        }
+#endif
+        for (; x < w; x++)
+        {
+            uint32_t r = (src[x] >> rm.shift) & 0x3FF;
+            uint32_t g = (src[x] >> gm.shift) & 0x3FF;
+            uint32_t b = (src[x] >> bm.shift) & 0x3FF;
+
+            deep[3 * x + 0] = (r << 6) | (r >> 4);
+            deep[3 * x + 1] = (g << 6) | (g >> 4);
+            deep[3 * x + 2] = (b << 6) | (b >> 4);
+            data[3 * x + 0] = r >> 2;
+            data[3 * x + 1] = g >> 2;
+            data[3 * x + 2] = b >> 2;
+        }
+
+        if (hash)
+            hash_update(hash, data, 3 * w);
+    }
+}
+
+/* Find the window holding the content of win. attrs receives win's attributes. */
+Window capture_findWindow(Display *dpy, Window win, XWindowAttributes *attrs)
+{
+    XWindowAttributes cattrs;
+    Window c, p;
+    int dx = -1, dy = -1;
+
+    if (XGetWindowAttributes(dpy, win, attrs) == 0)
+    {
+        log(LOG_ERROR, "failed to acquire window attributes!");
+        return None;
+    }
+
+    /* Can't directly use win, because SDL1 does have three windows, but only
+     * one for the content. Instead we translate from the root window and
+     * let X hand us the appropriate mapped child window that's probably the
+     * one we want. */
+    c = p = attrs->root;
+    while (1/*dx != 0 || dy != 0*/)
+    {
+        if (!XTranslateCoordinates(dpy, win, p, 0, 0, &dx, &dy, &c) ||
+            c == None || XGetWindowAttributes(dpy, c, &cattrs) == 0 ||
+            cattrs.height < attrs->height || cattrs.width < attrs->width)
+        {
+            break;
+        }
+
+        log(LOG_INFO, "XTranslateCoordinates: %d/%d %d/%d 0x%lx %d/%d\n", attrs->x, attrs->y, attrs->width, attrs->height, c, dx, dy);
+        p = c;
+    }
+
+    return p;
+}
+
+/* Get the first capture of win ready ahead of time: resolve the window to
+ * grab, load what the capture needs and have the backend probe it and set
+ * up its buffer. */
+void capture_warm(Display *dpy, Window win)
+{
+    XWindowAttributes attrs;
+
+    if ((win = capture_findWindow(dpy, win, &attrs)) == None)
+        return;
+
+    if (g_capture.crop || g_capture.scalePct != 100)
+        lazy_load(LAZY_XRENDER);
+    else
+        backend_release(backend_grab(dpy, win, &attrs));
+
+    log(LOG_INFO, "Capture of window 0x%lx prepared.\n", win);
+}
+
+void capture_init(void)
+{
+    const char *crop = cfg_getStr("CAPTURE_CROP", NULL);
+
+    g_capture.scalePct = cfg_getLong("CAPTURE_SCALE", 100);
+    if (g_capture.scalePct <= 0 || g_capture.scalePct > 100)
+    {
+        log(LOG_WARN, "SSSP_CAPTURE_SCALE must be within 1..100, capturing at full size.\n");
+        g_capture.scalePct = 100;
+    }
+
+    if (crop)
+    {
+        g_capture.cropFlags = XParseGeometry(crop, &g_capture.cropX, &g_capture.cropY,
+                &g_capture.cropW, &g_capture.cropH);
+        g_capture.crop = (g_capture.cropFlags & WidthValue) && (g_capture.cropFlags & HeightValue);
+        if (!g_capture.crop)
+            log(LOG_WARN, "Invalid SSSP_CAPTURE_CROP \"%s\", expected WxH+X+Y.\n", crop);
+    }
+}
+
+/* The configured crop rectangle, clipped to a w x h window. */
+static XRectangle cropRect(int w, int h)
+{
+    XRectangle r = { 0, 0, w, h };
+    int x = g_capture.cropX, y = g_capture.cropY;
+
+    if (!g_capture.crop)
+        return r;
+
+    if (g_capture.cropFlags & XNegative)
+        x += w - g_capture.cropW;
+    if (g_capture.cropFlags & YNegative)
+        y += h - g_capture.cropH;
+    if (x < 0)
+        x = 0;
+    if (y < 0)
+        y = 0;
+    if (x >= w || y >= h)
+        return r;
+
+    r.x = x;
+    r.y = y;
+    r.width = g_capture.cropW < (unsigned int)(w - x) ? g_capture.cropW : (unsigned int)(w - x);
+    r.height = g_capture.cropH < (unsigned int)(h - y) ? g_capture.cropH : (unsigned int)(h - y);
+
+    return r;
+}
+
+/* Let the server crop src out of win and scale it to w x h, then read back
+ * and convert the result. NULL if XRender can't do it. */
+static void *grabServerScaled(Display *dpy, Window win, const XWindowAttributes *attrs,
+        const XRectangle *src, int w, int h, uint64_t *hash)
+{
+    XRenderPictFormat *fmt;
+    XRenderPictureAttributes pa;
+    Picture srcPic, dstPic;
+    Pixmap pix;
+    XImage *image;
+    hashState hs;
+    uint8_t *data;
+    double fx = (double)src->width / w, fy = (double)src->height / h;
+    int event, error, kw, kh, i;
+
+    if (!lazy_load(LAZY_XRENDER) || !g_lazy.XRenderQueryExtension(dpy, &event, &error) ||
+        (fmt = g_lazy.XRenderFindVisualFormat(dpy, attrs->visual)) == NULL)
+        return NULL;
+
+    /* Destination pixel (x, y) samples the window at (x * fx + sx, y * fy + sy) */
+    XTransform xform = {{{XDoubleToFixed(fx), 0, XDoubleToFixed(src->x)},
+                         {0, XDoubleToFixed(fy), XDoubleToFixed(src->y)},
+                         {0, 0, XDoubleToFixed(1)}}};
+
+    pa.subwindow_mode = IncludeInferiors;
+    srcPic = g_lazy.XRenderCreatePicture(dpy, win, fmt, CPSubwindowMode, &pa);
+    g_lazy.XRenderSetPictureTransform(dpy, srcPic, &xform);
+
+    /* Bilinear only looks at 2x2 source pixels, average over a box
+     * covering the whole footprint when shrinking more than that. */
+    kw = (src->width + w - 1) / w;
+    kh = (src->height + h - 1) / h;
+    kw = kw > CAPTURE_MAX_KERNEL ? CAPTURE_MAX_KERNEL : kw;
+    kh = kh > CAPTURE_MAX_KERNEL ? CAPTURE_MAX_KERNEL : kh;
+    if (kw > 2 || kh > 2)
+    {
+        XFixed kernel[2 + CAPTURE_MAX_KERNEL * CAPTURE_MAX_KERNEL];
+        kernel[0] = XDoubleToFixed(kw);
+        kernel[1] = XDoubleToFixed(kh);
+        for (i = 0; i < kw * kh; i++)
+            kernel[2 + i] = XDoubleToFixed(1.0 / (kw * kh));
+        g_lazy.XRenderSetPictureFilter(dpy, srcPic, FilterConvolution, kernel, 2 + kw * kh);
+    }
+    else if (fx != 1.0 || fy != 1.0)
+    {
+        g_lazy.XRenderSetPictureFilter(dpy, srcPic, FilterBilinear, NULL, 0);
+    }
+
+    pix = XCreatePixmap(dpy, win, w, h, attrs->depth);
+    dstPic = g_lazy.XRenderCreatePicture(dpy, pix, fmt, 0, NULL);
+    g_lazy.XRenderComposite(dpy, PictOpSrc, srcPic, None, dstPic, 0, 0, 0, 0, 0, 0, w, h);
+    image = XGetImage(dpy, pix, 0, 0, w, h, AllPlanes, ZPixmap);
+
+    g_lazy.XRenderFreePicture(dpy, srcPic);
+    g_lazy.XRenderFreePicture(dpy, dstPic);
+    XFreePixmap(dpy, pix);
+
+    if (!image)
+        return NULL;
+
+    if ((data = malloc(3 * (size_t)w * h)) != NULL)
+    {
+        hash_init(&hs);
+        capture_convert(image, data, w, h, 1, &hs);
+        *hash = hash_final(&hs);
+    }
+    XDestroyImage(image);
+
+    return data;
+}
+
+/* Acquire Screenshot. For deep (depth 30) windows and a non NULL deep, a 16
+ * bit per channel copy is returned there as well, if the budget allows. */
+void *capture_grab(Display *dpy, Window *win, int *w, int *h, budgetSlot *slot, uint64_t *hash, uint16_t **deep)
+{
+    hashState hs;
+
+    XWindowAttributes attrs;
+    XRectangle crop;
+    Bool reduced;
+    uint8_t *data;
+    size_t held;
+    int y, rows, scale;
+    XImage *image;
+
+    if (deep)
+        *deep = NULL;
+
+    /* Update win to the one we grab from and we can display the feedback in. */
+    if ((*win = capture_findWindow(dpy, *win, &attrs)) == None)
+        return NULL;
+
+    /* Size after the configured crop and scale */
+    crop = cropRect(attrs.width, attrs.height);
+    reduced = g_capture.crop || g_capture.scalePct != 100;
+    *w = crop.width * g_capture.scalePct / 100;
+    *h = crop.height * g_capture.scalePct / 100;
+    *w = *w ? *w : 1;
+    *h = *h ? *h : 1;
+
+    /* Account the memory before grabbing anything. */
+    if ((scale = budget_reserveCapture(slot, *w, *h)) == 0)
+        return NULL;
+
+    /* Convert to plain RGB as required by steam. */
+    *h = *h / scale ? *h / scale : 1;
+    *w = *w / scale ? *w / scale : 1;
+
+    /* Budget downscales alone go to the bands below, they hold the least. */
+    if (reduced)
+    {
+        /* The server's result is read back whole, while a budget downscale
+         * on top only reserved the banded cost for it. */
+        held = 7 * (size_t)*w * *h;
+        if (held > slot->bytes && !budget_grow(slot, held - slot->bytes))
+        {
+            metric_add(METRIC_MEM_DROP_NEWEST, 1);
+            log(LOG_ERROR, "Memory budget exceeded, dropping %dx%d capture.\n", *w, *h);
+            return NULL;
+        }
+
+        data = grabServerScaled(dpy, *win, &attrs, &crop, *w, *h, hash);
+        if (data && budget_isDropped(slot))
+        {
+            free(data);
+            return NULL;
+        }
+        if (!data)
+        {
+            log(LOG_ERROR, "XRender unavailable, unable to crop/scale the capture!\n");
+            return NULL;
+        }
+
+        log(LOG_NOTICE, "Grabbed image of window 0x%lx (%dx%d+%d+%d scaled to %dx%d on the server).\n",
+                *win, crop.width, crop.height, crop.x, crop.y, *w, *h);
+        budget_shrink(slot, 3 * *w * *h);
+        return (void *)data;
+    }
+
+    if (scale == 1)
+    {
+        /* A damage tracked shadow of the window makes this a memcpy. */
+        if ((image = shadow_grab(*win)) != NULL &&
+            (image->width != attrs.width || image->height != attrs.height))
+        {
+            XDestroyImage(image);
+            image = NULL;
+        }
+
+        /* Otherwise the fastest backend for the window */
+        if (!image && (image = backend_grab(dpy, *win, &attrs)) == NULL)
+        {
+            log(LOG_ERROR, "failed to acquire window screenshot!");
+            return NULL;
+        }
+
+        log(LOG_NOTICE, "Grabbed image of window 0x%lx (size %dx%d, depth %d).\n", *win, image->width, image->height, image->depth);
+
+        if (budget_isDropped(slot) || (data = (uint8_t *)malloc(3 * *w * *h)) == NULL)
+        {
+            backend_release(image);
+            return NULL;
+        }
+
+        hash_init(&hs);
+        if (deep && capture_isDeep(image) && budget_grow(slot, 6 * (size_t)*w * *h) &&
+            (*deep = malloc(6 * (size_t)*w * *h)) != NULL)
+        {
+            capture_convertDeep(image, *deep, data, *w, *h, &hs);
+            budget_shrink(slot, 9 * (size_t)*w * *h);
+        }
+        else
+        {
+            capture_convert(image, data, *w, *h, 1, &hs);
+            budget_shrink(slot, 3 * (size_t)*w * *h);
+        }
+        *hash = hash_final(&hs);
+        backend_release(image);
+
+        return (void *)data;
+    }
+
+    /* Downscaled: grab in bands, so the full size image is never held. */
+    if ((data = (uint8_t *)malloc(3 * *w * *h)) == NULL)
+        return NULL;
+
+    hash_init(&hs);
+    for (y = 0; y < *h; y += rows)
+    {
+        rows = *h - y < CAPTURE_BAND_ROWS ? *h - y : CAPTURE_BAND_ROWS;
+
+        if (budget_isDropped(slot) ||
+            (image = XGetImage(dpy, *win, 0, y * scale, *w * scale, rows * scale, AllPlanes, ZPixmap)) == NULL)
+        {
+            log(LOG_ERROR, "failed to acquire window screenshot!");
+            free(data);
+            return NULL;
+        }
+
+        capture_convert(image, data + 3 * y * *w, *w, rows, scale, &hs);
+        XDestroyImage(image);
+    }
+
+    *hash = hash_final(&hs);
+    log(LOG_NOTICE, "Grabbed image of window 0x%lx (size %dx%d, downscaled by %d).\n", *win, *w, *h, scale);
+    budget_shrink(slot, 3 * *w * *h);
+
+    return (void *)data;
+}
@@ -0,0 +1,187 @@
+/**
+ *
+ * Client side of the capture daemon (ssspd).
+ *
+ * With SSSP_DAEMON=1 the hotkey only queues a request with the target window
+ * in a ring shared with the daemon and kicks its eventfd. Grabbing,
+ * conversion, PNG encoding and the file I/O happen in the daemon; the game
+ * process only hands the finished file over to steam, once the reply shows
+ * up in the ring. Checking for replies is a load from the shared mapping,
+ * so it's cheap enough for the X event hooks.
+ *
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sssp.h"
+
+/* The handshake runs before the game's main(), a stalled daemon mustn't
+ * hold it up for longer. */
+#define CLIENT_HANDSHAKE_MS 300
+
+static struct
+{
+    daemonRing *ring;
+    int eventFd;
+    int sock;
+    uint32_t seq;
+    /* The hooks request and poll from any of the game's threads, the ring
+     * has one producer and one consumer */
+    pthread_mutex_t reqLock;
+    pthread_mutex_t pollLock;
+} g_client = {
+    .eventFd = -1,
+    .sock = -1,
+    .reqLock = PTHREAD_MUTEX_INITIALIZER,
+    .pollLock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Connect and receive the ring and eventfd. */
+Bool client_init(uint32_t appId)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    daemonHello hello = { .magic = DAEMON_MAGIC, .version = DAEMON_VERSION };
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctrl;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct timeval tv = { 0, CLIENT_HANDSHAKE_MS * 1000 };
+    const char *display = getenv("DISPLAY");
+    uint32_t version = 0;
+    ssize_t n;
+    int fds[2];
+    void *map;
+
+    if (!cfg_getLong("DAEMON", 0) || g_client.ring)
+        return g_client.ring != NULL;
+
+    ipc_socketPath(addr.sun_path, sizeof(addr.sun_path));
+    if ((g_client.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(g_client.sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(g_client.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        connect(g_client.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        log(LOG_WARN, "Capture daemon not reachable at %s (%s), capturing in-process.\n",
+                addr.sun_path, strerror(errno));
+        goto fail;
+    }
+
+    hello.pid = getpid();
+    hello.appId = appId;
+    snprintf(hello.display, sizeof(hello.display), "%s", display ? display : "");
+    if (write(g_client.sock, &hello, sizeof(hello)) != sizeof(hello))
+    {
+        log(LOG_ERROR, "Capture daemon handshake failed (%s), capturing in-process.\n", strerror(errno));
+        goto fail;
+    }
+
+    iov.iov_base = &version;
+    iov.iov_len = sizeof(version);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    if ((n = recvmsg(g_client.sock, &msg, MSG_CMSG_CLOEXEC)) != sizeof(version) || version != DAEMON_VERSION ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        log(LOG_ERROR, "Capture daemon handshake failed (%s), capturing in-process.\n",
+                n < 0 ? strerror(errno) : "invalid reply");
+        goto fail;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    map = mmap(NULL, sizeof(daemonRing), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (map == MAP_FAILED || ((daemonRing *)map)->magic != DAEMON_MAGIC)
+    {
+        if (map != MAP_FAILED)
+            munmap(map, sizeof(daemonRing));
+        close(fds[1]);
+        log(LOG_ERROR, "Capture daemon ring unusable, capturing in-process.\n");
+        goto fail;
+    }
+
+    g_client.ring = map;
+    g_client.eventFd = fds[1];
+    log(LOG_NOTICE, "Connected to capture daemon at %s.\n", addr.sun_path);
+
+    return True;
+
+fail:
+    if (g_client.sock >= 0)
+        close(g_client.sock);
+    g_client.sock = -1;
+    return False;
+}
+
+/* Queue a capture of win. False if there's no daemon to do it. */
+Bool client_request(Window win)
+{
+    daemonRing *r = g_client.ring;
+    uint32_t head;
+    uint64_t one = 1;
+
+    if (!r)
+        return False;
+
+    pthread_mutex_lock(&g_client.reqLock);
+    head = r->reqHead;
+    if (head - __atomic_load_n(&r->reqTail, __ATOMIC_ACQUIRE) >= DAEMON_RING_SLOTS)
+    {
+        pthread_mutex_unlock(&g_client.reqLock);
+        log(LOG_WARN, "Capture daemon busy, request dropped.\n");
+        return True;
+    }
+
+    r->req[head % DAEMON_RING_SLOTS].seq = ++g_client.seq;
+    r->req[head % DAEMON_RING_SLOTS].flags = 0;
+    r->req[head % DAEMON_RING_SLOTS].window = win;
+    __atomic_store_n(&r->reqHead, head + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_client.reqLock);
+
+    if (write(g_client.eventFd, &one, sizeof(one)) != sizeof(one))
+        log(LOG_ERROR, "Unable to notify the capture daemon: %s\n", strerror(errno));
+
+    return True;
+}
+
+/* Hand finished shots to submit. */
+void client_poll(fileSubmitFunc submit)
+{
+    daemonRing *r = g_client.ring;
+    uint32_t tail;
+
+    if (!r || r->repTail == __atomic_load_n(&r->repHead, __ATOMIC_ACQUIRE) ||
+        pthread_mutex_trylock(&g_client.pollLock))
+        return;
+
+    for (tail = r->repTail; tail != __atomic_load_n(&r->repHead, __ATOMIC_ACQUIRE); tail++)
+    {
+        daemonReply *rep = &r->rep[tail % DAEMON_RING_SLOTS];
+        char path[sizeof(rep->path)];
+
+        memcpy(path, rep->path, sizeof(path));
+        path[sizeof(path) - 1] = '\0';
+
+        if (rep->ok > 0)
+            submit(path, rep->w, rep->h);
+        else if (rep->ok == 0)
+            log(LOG_WARN, "Capture daemon failed request %u.\n", rep->seq);
+
+        __atomic_store_n(&r->repTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&g_client.pollLock);
+}
@@ -0,0 +1,72 @@
+/**
+ *
+ * Duplicate screenshot suppression.
+ *
+ * Paused games or menus produce byte identical shots on repeated hotkey
+ * presses, which steam would still encode and store. The content hash
+ * computed during conversion is looked up in a small LRU of recently
+ * submitted shots; a hit means the shot can be skipped.
+ *
+ */
+#include <pthread.h>
+
+#include "sssp.h"
+
+#define DEDUP_MAX_HISTORY 64
+
+typedef struct
+{
+    uint64_t hash;
+    int w, h;
+} dedupEntry;
+
+static pthread_mutex_t g_dedupLock = PTHREAD_MUTEX_INITIALIZER;
+/* Most recently used first */
+static dedupEntry g_dedupHistory[DEDUP_MAX_HISTORY];
+static unsigned int g_dedupCount = 0;
+static long g_dedupSize = -1;
+
+void dedup_init(void)
+{
+    g_dedupSize = cfg_getLong("DEDUP", 8);
+
+    if (g_dedupSize > DEDUP_MAX_HISTORY)
+        g_dedupSize = DEDUP_MAX_HISTORY;
+    if (g_dedupSize < 0)
+        g_dedupSize = 0;
+}
+
+/* True if the shot was submitted recently, otherwise remember it. */
+Bool dedup_isDuplicate(uint64_t hash, int w, int h)
+{
+    dedupEntry e = { hash, w, h };
+    unsigned int i;
+    Bool found = False;
+
+    if (g_dedupSize <= 0)
+        return False;
+
+    pthread_mutex_lock(&g_dedupLock);
+
+    for (i = 0; i < g_dedupCount; i++)
+    {
+        if (g_dedupHistory[i].hash == hash && g_dedupHistory[i].w == w && g_dedupHistory[i].h == h)
+        {
+            found = True;
+            break;
+        }
+    }
+
+    /* Move to front, dropping the least recently used one when full. */
+    if (!found && g_dedupCount < g_dedupSize)
+        g_dedupCount++;
+    if (i == g_dedupCount)
+        i--;
+    for (; i > 0; i--)
+        g_dedupHistory[i] = g_dedupHistory[i - 1];
+    g_dedupHistory[0] = e;
+
+    pthread_mutex_unlock(&g_dedupLock);
+
+    return found;
+}
@@ -0,0 +1,204 @@
+/**
+ *
+ * Thumbnail feedback shown in the corner of the game window after a shot.
+ *
+ * The thumbnail is scaled down on the CPU from the RGB buffer of the shot,
+ * so it shows exactly what was saved, and uploaded with one XPutImage into a
+ * pixmap that is the feedback window's background. The window, pixmap, GC
+ * and image are created once and kept; a size change of the game window
+ * only moves/resizes the feedback window. Neither Composite nor XRender are
+ * involved.
+ *
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sssp.h"
+
+#define FEEDBACK_HEIGHT 100
+#define FEEDBACK_BORDER 2
+#define FEEDBACK_BORDER_COLOR 0x45323232
+
+static struct
+{
+    pthread_mutex_t lock;
+    Display *dpy;
+    /* Game window the thumbnail is a child of */
+    Window parent;
+    int parentW, parentH;
+    Window win;
+    /* Thumbnail, also the background of win */
+    Pixmap pix;
+    GC gc;
+    XImage *image;
+    uint8_t *rgb;
+    int w, h;
+    Bool mapped;
+} g_fb = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Free everything, the window too when it belongs to another parent. */
+static void release(Bool window)
+{
+    if (g_fb.image)
+        XDestroyImage(g_fb.image);
+    if (g_fb.gc)
+        XFreeGC(g_fb.dpy, g_fb.gc);
+    if (g_fb.pix)
+        XFreePixmap(g_fb.dpy, g_fb.pix);
+    free(g_fb.rgb);
+    g_fb.image = NULL;
+    g_fb.gc = NULL;
+    g_fb.pix = None;
+    g_fb.rgb = NULL;
+    g_fb.w = g_fb.h = 0;
+    g_fb.parentW = g_fb.parentH = 0;
+
+    if (window && g_fb.win)
+    {
+        XDestroyWindow(g_fb.dpy, g_fb.win);
+        g_fb.win = None;
+        g_fb.parent = None;
+        g_fb.mapped = False;
+    }
+}
+
+/* Bring the cached objects in line with the game window and a thumbnail for
+ * a w x h shot. */
+static Bool setup(Display *dpy, Window parent, const XWindowAttributes *attrs, int w, int h)
+{
+    int tw, th, x, y;
+    char *data;
+
+    if (g_fb.dpy != dpy || g_fb.parent != parent)
+    {
+        if (g_fb.dpy)
+            release(True);
+        g_fb.dpy = dpy;
+    }
+
+    th = FEEDBACK_HEIGHT < h ? FEEDBACK_HEIGHT : h;
+    tw = th * (w * 1.0 / h);
+    if (tw < 1)
+        tw = 1;
+
+    if (g_fb.win && g_fb.image && attrs->width == g_fb.parentW && attrs->height == g_fb.parentH &&
+        tw == g_fb.w && th == g_fb.h)
+        return True;
+
+    x = attrs->width - tw - 2 * FEEDBACK_BORDER;
+    y = attrs->height - th - 2 * FEEDBACK_BORDER;
+
+    if (!g_fb.win)
+    {
+        g_fb.win = XCreateSimpleWindow(dpy, parent, x, y, tw, th,
+                FEEDBACK_BORDER, FEEDBACK_BORDER_COLOR, 0);
+        g_fb.parent = parent;
+        log(LOG_INFO, "Feedback window 0x%lx created.\n", g_fb.win);
+    }
+    else
+    {
+        XMoveResizeWindow(dpy, g_fb.win, x, y, tw, th);
+    }
+
+    if (tw != g_fb.w || th != g_fb.h || !g_fb.image)
+        release(False);
+    g_fb.parentW = attrs->width;
+    g_fb.parentH = attrs->height;
+    if (g_fb.image)
+        return True;
+
+    g_fb.rgb = malloc(3 * (size_t)tw * th);
+    data = malloc(4 * (size_t)tw * th);
+    if (!g_fb.rgb || !data ||
+        (g_fb.image = XCreateImage(dpy, attrs->visual, attrs->depth, ZPixmap, 0, data, tw, th, 32, 0)) == NULL)
+    {
+        free(data);
+        release(False);
+        log(LOG_ERROR, "Unable to set up the %dx%d feedback image.\n", tw, th);
+        return False;
+    }
+
+    g_fb.pix = XCreatePixmap(dpy, g_fb.win, tw, th, attrs->depth);
+    g_fb.gc = XCreateGC(dpy, g_fb.pix, 0, NULL);
+    XSetWindowBackgroundPixmap(dpy, g_fb.win, g_fb.pix);
+    g_fb.w = tw;
+    g_fb.h = th;
+
+    return True;
+}
+
+/* Scale a channel value to the width of mask and move it in place. */
+static inline unsigned long packChannel(uint8_t c, unsigned long mask)
+{
+    int shift, bits;
+    unsigned long v;
+
+    if (!mask)
+        return 0;
+
+    shift = __builtin_ctzl(mask);
+    bits = __builtin_popcountl(mask);
+    v = bits <= 8 ? (unsigned long)(c >> (8 - bits)) : ((unsigned long)c << (bits - 8)) | (c >> (16 - bits));
+
+    return (v << shift) & mask;
+}
+
+/* Fill the XImage from the scaled RGB thumbnail. */
+static void pack(void)
+{
+    XImage *image = g_fb.image;
+    const uint8_t *p = g_fb.rgb;
+    int x, y;
+
+    for (y = 0; y < g_fb.h; y++)
+    {
+        uint32_t *row = (uint32_t *)(image->data + y * image->bytes_per_line);
+        for (x = 0; x < g_fb.w; x++, p += 3)
+        {
+            unsigned long v = packChannel(p[0], image->red_mask) |
+                    packChannel(p[1], image->green_mask) |
+                    packChannel(p[2], image->blue_mask);
+            if (image->bits_per_pixel == 32)
+                row[x] = v;
+            else
+                XPutPixel(image, x, y, v);
+        }
+    }
+}
+
+/* Show a thumbnail of the w x h RGB shot in the corner of win. */
+void feedback_show(Display *dpy, Window win, const XWindowAttributes *attrs, const void *rgb, int w, int h)
+{
+    pthread_mutex_lock(&g_fb.lock);
+
+    if (setup(dpy, win, attrs, w, h) && scale_box(rgb, w, h, g_fb.rgb, g_fb.w, g_fb.h))
+    {
+        pack();
+        XPutImage(dpy, g_fb.pix, g_fb.gc, g_fb.image, 0, 0, 0, 0, g_fb.w, g_fb.h);
+        XClearWindow(dpy, g_fb.win);
+        XMapRaised(dpy, g_fb.win);
+        XFlush(dpy);
+        g_fb.mapped = True;
+    }
+
+    pthread_mutex_unlock(&g_fb.lock);
+}
+
+void feedback_hide(void)
+{
+    pthread_mutex_lock(&g_fb.lock);
+
+    if (g_fb.mapped)
+    {
+        log(LOG_INFO, "Unmapping feedback window 0x%lx.\n", g_fb.win);
+        /* Disappears on next repaint of parent */
+        XUnmapWindow(g_fb.dpy, g_fb.win);
+        XFlush(g_fb.dpy);
+        g_fb.mapped = False;
+        /* Give the game a chance to repaint before the next capture */
+        usleep(50000);
+    }
+
+    pthread_mutex_unlock(&g_fb.lock);
+}
@@ -0,0 +1,259 @@
+/**
+ *
+ * GOT hook installer (SSSP_HOOK_MODE=got).
+ *
+ * With LD_PRELOAD alone, the hooks interpose on the whole process for its
+ * whole lifetime. This instead rewrites the GOT entries (PLT jump slots and
+ * GLOB_DAT pointers) of every loaded object, found with dl_iterate_phdr(),
+ * for the functions of interest: installing points them at the hook,
+ * uninstalling points them straight at the real function, so the game calls
+ * the library directly while a hook isn't needed.
+ *
+ * Hooks are registered in groups, which are installed while required at
+ * least once (got_require()/got_release()). Addresses the game got from
+ * dlsym() can't be rewritten later, they keep going through the exported
+ * hooks. Objects loaded later bind to the exported hooks too, until the next
+ * install or uninstall walks them.
+ *
+ */
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sssp.h"
+
+#if __ELF_NATIVE_CLASS == 64
+#define GOT_R_SYM ELF64_R_SYM
+#define GOT_R_TYPE ELF64_R_TYPE
+#else
+#define GOT_R_SYM ELF32_R_SYM
+#define GOT_R_TYPE ELF32_R_TYPE
+#endif
+
+#if defined(__x86_64__)
+#define GOT_JUMP_SLOT R_X86_64_JUMP_SLOT
+#define GOT_GLOB_DAT R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+#define GOT_JUMP_SLOT R_386_JMP_SLOT
+#define GOT_GLOB_DAT R_386_GLOB_DAT
+#endif
+
+static struct
+{
+    pthread_mutex_t lock;
+    const gotHook *hooks[GOT_MAX];
+    int count[GOT_MAX];
+    int required[GOT_MAX];
+    /* Our own object, never patched */
+    ElfW(Addr) self;
+    long pageSize;
+} g_got = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct
+{
+    const gotHook *hooks;
+    int count;
+    Bool install;
+    int patched;
+} gotWalk;
+
+/* Dynamic section pointers are relocated by the loader, except e.g. the
+ * vDSO's. */
+static inline ElfW(Addr) dynPtr(const struct dl_phdr_info *info, ElfW(Addr) ptr)
+{
+    return ptr < info->dlpi_addr ? ptr + info->dlpi_addr : ptr;
+}
+
+static void patchSlot(const struct dl_phdr_info *info, void **slot, void *value, gotWalk *walk)
+{
+    const ElfW(Addr) mask = ~(ElfW(Addr))(g_got.pageSize - 1);
+    ElfW(Addr) page = (ElfW(Addr))slot & mask;
+    Bool relro = False;
+    int i;
+
+    if (__atomic_load_n(slot, __ATOMIC_RELAXED) == value)
+        return;
+
+    /* Full RELRO leaves the GOT read-only. The loader rounds both ends of
+     * the range down, so a last partial page (shared with .got.plt or .data)
+     * stays writable and mustn't be protected afterwards. */
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_GNU_RELRO && page >= ((info->dlpi_addr + ph->p_vaddr) & mask) &&
+            page < ((info->dlpi_addr + ph->p_vaddr + ph->p_memsz) & mask))
+            relro = True;
+    }
+
+    if (relro && mprotect((void *)page, g_got.pageSize, PROT_READ | PROT_WRITE))
+    {
+        log(LOG_WARN, "Unable to unprotect the GOT of '%s'.\n", info->dlpi_name);
+        return;
+    }
+
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+    walk->patched++;
+
+    if (relro)
+        mprotect((void *)page, g_got.pageSize, PROT_READ);
+}
+
+/* Patch the entries of rels (REL or RELA, with relSize bytes each) for hooks. */
+static void patchRels(const struct dl_phdr_info *info, const uint8_t *rels, size_t size, size_t relSize,
+        const ElfW(Sym) *symTab, const char *strTab, gotWalk *walk)
+{
+    const uint8_t *p;
+    int i;
+
+    for (p = rels; p + relSize <= rels + size; p += relSize)
+    {
+        /* r_offset and r_info lead both ElfW(Rel) and ElfW(Rela) */
+        const ElfW(Rel) *rel = (const ElfW(Rel) *)p;
+        const char *name;
+
+        if (GOT_R_TYPE(rel->r_info) != GOT_JUMP_SLOT && GOT_R_TYPE(rel->r_info) != GOT_GLOB_DAT)
+            continue;
+
+        name = strTab + symTab[GOT_R_SYM(rel->r_info)].st_name;
+        for (i = 0; i < walk->count; i++)
+        {
+            const gotHook *h = &walk->hooks[i];
+            if (*h->real && strcmp(name, h->name) == 0)
+            {
+                patchSlot(info, (void **)(info->dlpi_addr + rel->r_offset),
+                        walk->install ? h->hook : *h->real, walk);
+                break;
+            }
+        }
+    }
+}
+
+static int patchObject(struct dl_phdr_info *info, size_t size UNUSED, void *data)
+{
+    gotWalk *walk = data;
+    const ElfW(Dyn) *dyn = NULL;
+    const ElfW(Sym) *symTab = NULL;
+    const char *strTab = NULL;
+    const uint8_t *jmpRel = NULL, *rel = NULL, *rela = NULL;
+    size_t jmpRelSize = 0, relSize = 0, relaSize = 0;
+    ElfW(Sxword) pltRel = DT_RELA;
+    int i;
+
+    if (info->dlpi_addr == g_got.self)
+        return 0;
+
+    for (i = 0; i < info->dlpi_phnum && !dyn; i++)
+        if (info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+            dyn = (const ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+    if (!dyn)
+        return 0;
+
+    for (; dyn->d_tag != DT_NULL; dyn++)
+    {
+        switch (dyn->d_tag)
+        {
+            case DT_SYMTAB:
+                symTab = (const ElfW(Sym) *)dynPtr(info, dyn->d_un.d_ptr);
+                break;
+            case DT_STRTAB:
+                strTab = (const char *)dynPtr(info, dyn->d_un.d_ptr);
+                break;
+            case DT_JMPREL:
+                jmpRel = (const uint8_t *)dynPtr(info, dyn->d_un.d_ptr);
+                break;
+            case DT_PLTRELSZ:
+                jmpRelSize = dyn->d_un.d_val;
+                break;
+            case DT_PLTREL:
+                pltRel = dyn->d_un.d_val;
+                break;
+            case DT_REL:
+                rel = (const uint8_t *)dynPtr(info, dyn->d_un.d_ptr);
+                break;
+            case DT_RELSZ:
+                relSize = dyn->d_un.d_val;
+                break;
+            case DT_RELA:
+                rela = (const uint8_t *)dynPtr(info, dyn->d_un.d_ptr);
+                break;
+            case DT_RELASZ:
+                relaSize = dyn->d_un.d_val;
+                break;
+        }
+    }
+
+    if (!symTab || !strTab)
+        return 0;
+
+    if (jmpRel)
+        patchRels(info, jmpRel, jmpRelSize, pltRel == DT_RELA ? sizeof(ElfW(Rela)) : sizeof(ElfW(Rel)),
+                symTab, strTab, walk);
+    if (rel)
+        patchRels(info, rel, relSize, sizeof(ElfW(Rel)), symTab, strTab, walk);
+    if (rela)
+        patchRels(info, rela, relaSize, sizeof(ElfW(Rela)), symTab, strTab, walk);
+
+    return 0;
+}
+
+static void patch(enum GotGroup group, Bool install)
+{
+    gotWalk walk = { g_got.hooks[group], g_got.count[group], install, 0 };
+    uint64_t t0 = nowNs();
+
+    dl_iterate_phdr(patchObject, &walk);
+
+    metric_add(METRIC_GOT_PATCHES, walk.patched);
+    metric_add(METRIC_GOT_US, (nowNs() - t0) / 1000);
+    log(LOG_INFO, "%s hook group %d, %d GOT entries patched.\n",
+            install ? "Installed" : "Uninstalled", group, walk.patched);
+}
+
+/* Register group's hooks, uninstalled until required. */
+void got_register(enum GotGroup group, const gotHook *hooks, int count)
+{
+    Dl_info self;
+
+    pthread_mutex_lock(&g_got.lock);
+
+    if (!g_got.pageSize)
+    {
+        g_got.pageSize = sysconf(_SC_PAGESIZE);
+        if (dladdr((void *)got_register, &self))
+            g_got.self = (ElfW(Addr))self.dli_fbase;
+    }
+
+    g_got.hooks[group] = hooks;
+    g_got.count[group] = count;
+    patch(group, g_got.required[group] > 0);
+
+    pthread_mutex_unlock(&g_got.lock);
+}
+
+void got_require(enum GotGroup group)
+{
+    pthread_mutex_lock(&g_got.lock);
+    if (g_got.required[group]++ == 0 && g_got.hooks[group])
+        patch(group, True);
+    pthread_mutex_unlock(&g_got.lock);
+}
+
+void got_release(enum GotGroup group)
+{
+    pthread_mutex_lock(&g_got.lock);
+    if (g_got.required[group] > 0 && --g_got.required[group] == 0 && g_got.hooks[group])
+        patch(group, False);
+    pthread_mutex_unlock(&g_got.lock);
+}
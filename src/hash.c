@@ -0,0 +1,181 @@
+/**
+ *
+ * Fast non-cryptographic 64bit hash for frame contents.
+ *
+ * Same construction as XXH3's long input loop: eight 64bit accumulators, each
+ * 64 byte stripe is mixed in with one 32x32->64 multiply per lane, and the
+ * accumulators get scrambled every block. That maps directly onto SSE2/AVX2
+ * (pmuludq), which is used when the compiler targets it. All variants produce
+ * the same value. Not compatible with the real XXH3, only the speed class is.
+ *
+ */
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "sssp.h"
+
+#define HASH_STRIPES_PER_BLOCK 16
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+/* Per lane keys (the first bytes of XXH3's default secret) */
+static const uint64_t hashKeys[HASH_LANES] =
+{
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Mix one 64 byte stripe into the accumulators */
+static inline void accumulate(uint64_t *acc, const uint8_t *p)
+{
+#if defined(__AVX2__)
+    int i;
+    for (i = 0; i < HASH_LANES; i += 4)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + 8 * i));
+        __m256i k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(hashKeys + i)));
+        __m256i m = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+        /* acc[i ^ 1] += d */
+        a = _mm256_add_epi64(a, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi64(a, m));
+    }
+#elif defined(__SSE2__)
+    int i;
+    for (i = 0; i < HASH_LANES; i += 2)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + 8 * i));
+        __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(hashKeys + i)));
+        __m128i m = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi64(a, m));
+    }
+#else
+    int i;
+    for (i = 0; i < HASH_LANES; i++)
+    {
+        uint64_t d = read64(p + 8 * i);
+        uint64_t k = d ^ hashKeys[i];
+        acc[i ^ 1] += d;
+        acc[i] += (k & 0xFFFFFFFFULL) * (k >> 32);
+    }
+#endif
+}
+
+static inline void scramble(uint64_t *acc)
+{
+    int i;
+    for (i = 0; i < HASH_LANES; i++)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= hashKeys[(i + 3) % HASH_LANES];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static inline void stripe(hashState *h, const uint8_t *p)
+{
+    accumulate(h->acc, p);
+    if (++h->stripes == HASH_STRIPES_PER_BLOCK)
+    {
+        scramble(h->acc);
+        h->stripes = 0;
+    }
+}
+
+void hash_init(hashState *h)
+{
+    h->acc[0] = PRIME32_1;
+    h->acc[1] = PRIME64_1;
+    h->acc[2] = PRIME64_2;
+    h->acc[3] = PRIME64_3;
+    h->acc[4] = PRIME64_1 ^ PRIME64_2;
+    h->acc[5] = PRIME64_2 ^ PRIME64_3;
+    h->acc[6] = PRIME64_3 ^ PRIME32_1;
+    h->acc[7] = PRIME64_1 + PRIME64_3;
+    h->stripes = 0;
+    h->buffered = 0;
+    h->total = 0;
+}
+
+void hash_update(hashState *h, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t n;
+
+    h->total += len;
+
+    if (h->buffered)
+    {
+        n = HASH_STRIPE - h->buffered < len ? HASH_STRIPE - h->buffered : len;
+        memcpy(h->buf + h->buffered, p, n);
+        h->buffered += n;
+        p += n;
+        len -= n;
+        if (h->buffered < HASH_STRIPE)
+            return;
+        stripe(h, h->buf);
+        h->buffered = 0;
+    }
+
+    for (; len >= HASH_STRIPE; p += HASH_STRIPE, len -= HASH_STRIPE)
+        stripe(h, p);
+
+    memcpy(h->buf, p, len);
+    h->buffered = len;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_final(hashState *h)
+{
+    uint64_t acc[HASH_LANES];
+    uint64_t r = h->total * PRIME64_1;
+    int i;
+
+    memcpy(acc, h->acc, sizeof(acc));
+
+    /* Zero padded last stripe, the total length tells the difference */
+    if (h->buffered)
+    {
+        uint8_t last[HASH_STRIPE] = { 0 };
+        memcpy(last, h->buf, h->buffered);
+        accumulate(acc, last);
+    }
+
+    for (i = 0; i < HASH_LANES; i += 2)
+    {
+        uint64_t m = (acc[i] ^ hashKeys[i]) * ((acc[i + 1] ^ hashKeys[i + 1]) | 1);
+        r += m ^ (m >> 29);
+    }
+
+    return avalanche(r);
+}
+
+uint64_t hash64(const void *data, size_t len)
+{
+    hashState h;
+
+    hash_init(&h);
+    hash_update(&h, data, len);
+    return hash_final(&h);
+}
@@ -0,0 +1,101 @@
+/**
+ *
+ * Libraries loaded on first use.
+ *
+ * LD_PRELOAD puts the library into every process started from the game's
+ * launch options: launchers, shell helpers, steam's own processes. Most of
+ * them are filtered out by init() right away, but by then the dynamic linker
+ * has already loaded and relocated every library it's linked against. Only
+ * libX11 is needed for the hooks, the extension libraries and zlib are only
+ * used for capturing, so they are dlopen()ed and resolved into g_lazy the
+ * first time a capture needs them.
+ *
+ */
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "sssp.h"
+
+enum LazyState
+{
+    LAZY_UNLOADED,
+    LAZY_LOADED,
+    LAZY_FAILED,
+};
+
+static const char *const lazyNames[LAZY_MAX] =
+{
+    [LAZY_XEXT] = "libXext.so.6",
+    [LAZY_XCOMPOSITE] = "libXcomposite.so.1",
+    [LAZY_XDAMAGE] = "libXdamage.so.1",
+    [LAZY_XFIXES] = "libXfixes.so.3",
+    [LAZY_XRENDER] = "libXrender.so.1",
+    [LAZY_ZLIB] = "libz.so.1",
+};
+
+lazyFuncs g_lazy;
+
+static struct
+{
+    pthread_mutex_t lock;
+    enum LazyState state[LAZY_MAX];
+} g_lazyLibs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Resolve all of lib's entry points. */
+static Bool resolve(enum LazyLib lib, void *handle)
+{
+    void *sym;
+
+#define LAZY_RESOLVE(l, name) \
+    if (l == lib) \
+    { \
+        if ((sym = dlsym(handle, #name)) == NULL) \
+        { \
+            log(LOG_ERROR, "%s lacks %s.\n", lazyNames[lib], #name); \
+            return False; \
+        } \
+        g_lazy.name = (__typeof__(g_lazy.name))sym; \
+    }
+
+    LAZY_FUNCS(LAZY_RESOLVE)
+#undef LAZY_RESOLVE
+
+    return True;
+}
+
+/* Load lib, if it isn't yet. False if it's unavailable. */
+Bool lazy_load(enum LazyLib lib)
+{
+    enum LazyState state = __atomic_load_n(&g_lazyLibs.state[lib], __ATOMIC_ACQUIRE);
+    void *handle;
+
+    if (state != LAZY_UNLOADED)
+        return state == LAZY_LOADED;
+
+    pthread_mutex_lock(&g_lazyLibs.lock);
+
+    if ((state = g_lazyLibs.state[lib]) == LAZY_UNLOADED)
+    {
+        /* Never unloaded, the entry points stay valid until exit. */
+        if ((handle = dlopen(lazyNames[lib], RTLD_NOW | RTLD_LOCAL)) == NULL)
+        {
+            log(LOG_ERROR, "Unable to load %s: %s\n", lazyNames[lib], dlerror());
+            state = LAZY_FAILED;
+        }
+        else if (!resolve(lib, handle))
+        {
+            state = LAZY_FAILED;
+        }
+        else
+        {
+            log(LOG_INFO, "Loaded %s.\n", lazyNames[lib]);
+            state = LAZY_LOADED;
+        }
+
+        __atomic_store_n(&g_lazyLibs.state[lib], state, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&g_lazyLibs.lock);
+
+    return state == LAZY_LOADED;
+}
@@ -0,0 +1,208 @@
+/**
+ *
+ * Minimal LZ77 block compressor (LZ4 block layout).
+ *
+ * Sequence: token (literal length << 4 | match length - 4), extra literal
+ * length bytes, literals, 16bit little endian offset, extra match length
+ * bytes. Extra length bytes are added while they're 255. The last sequence
+ * carries literals only.
+ *
+ * Tuned for speed on raw framebuffer data, not ratio: greedy parsing, one
+ * hash table probe per position and skipping ahead faster the longer no match
+ * was found.
+ *
+ */
+#include <string.h>
+
+#include "sssp.h"
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* Literals a block has to end with (keeps the decoder's fast paths simple) */
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *writeLength(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz_compress(const void *src, size_t size, void *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *anchor = ip;
+    const uint8_t *const base = ip;
+    const uint8_t *const iend = ip + size;
+    const uint8_t *const mflimit = size > LZ_MFLIMIT ? iend - LZ_MFLIMIT : base;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *token;
+    size_t lit, mlen;
+    unsigned int searches = 1 << 6;
+
+    if (cap < lz_bound(size))
+        return 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (size > LZ_MFLIMIT)
+    {
+        ip++;
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t *ref = base + table[h];
+
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq)
+            {
+                /* Accelerate through incompressible regions */
+                ip += searches++ >> 6;
+                continue;
+            }
+            searches = 1 << 6;
+
+            /* Extend backwards over pending literals */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            /* Extend forward, keeping the trailing literals */
+            mlen = LZ_MIN_MATCH;
+            while (ip + mlen < iend - LZ_LAST_LITERALS && ip[mlen] == ref[mlen])
+                mlen++;
+
+            lit = ip - anchor;
+            token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4;
+            if (lit >= 15)
+                op = writeLength(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            *op++ = (uint8_t)(ip - ref);
+            *op++ = (uint8_t)((ip - ref) >> 8);
+
+            *token |= (mlen - LZ_MIN_MATCH >= 15 ? 15 : mlen - LZ_MIN_MATCH);
+            if (mlen - LZ_MIN_MATCH >= 15)
+                op = writeLength(op, mlen - LZ_MIN_MATCH - 15);
+
+            ip += mlen;
+            anchor = ip;
+
+            /* Index a position inside the match to find repeats sooner */
+            if (ip - 2 > base)
+                table[hash32(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    /* Last literals */
+    lit = iend - anchor;
+    token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+        op = writeLength(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (uint8_t *)dst;
+}
+
+size_t lz_decompress(const void *src, size_t size, void *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *const iend = ip + size;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *const oend = op + cap;
+    size_t len, off;
+    uint8_t token;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+
+        /* Literals */
+        len = token >> 4;
+        if (len == 15)
+        {
+            do
+            {
+                if (ip >= iend)
+                    return 0;
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return 0;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* Last sequence has no match */
+        if (ip >= iend)
+            break;
+
+        if (iend - ip < 2)
+            return 0;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!off || off > (size_t)(op - (uint8_t *)dst))
+            return 0;
+
+        len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15)
+        {
+            do
+            {
+                if (ip >= iend)
+                    return 0;
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+        if (len > (size_t)(oend - op))
+            return 0;
+
+        /* Overlapping copies replicate the pattern, so go bytewise for them */
+        if (off >= len)
+        {
+            memcpy(op, op - off, len);
+            op += len;
+        }
+        else
+        {
+            const uint8_t *m = op - off;
+            while (len--)
+                *op++ = *m++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
@@ -1,5 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "sssp.h"
 
@@ -40,3 +42,124 @@ log_dolog(enum LogLevel ll, const char *func,
 		}
 	}
 }
+
+long
+cfg_getLong(const char *name, long dflt)
+{
+	const char *val = cfg_getStr(name, NULL);
+	char *end = NULL;
+	long l;
+
+	if (!val)
+		return dflt;
+
+	l = strtol(val, &end, 0);
+	if (end == val || *end)
+	{
+		log(LOG_WARN, "Ignoring invalid value SSSP_%s=%s\n", name, val);
+		return dflt;
+	}
+
+	return l;
+}
+
+const char *
+cfg_getStr(const char *name, const char *dflt)
+{
+	char env[128];
+	const char *val;
+
+	snprintf(env, sizeof(env), "SSSP_%s", name);
+	val = getenv(env);
+
+	return val && *val ? val : dflt;
+}
+
+static const char *metricNames[METRIC_MAX] =
+{
+	[METRIC_MEM_DROP_NEWEST] = "mem.drop_newest",
+	[METRIC_MEM_DROP_OLDEST] = "mem.drop_oldest",
+	[METRIC_MEM_DOWNSCALE] = "mem.downscale",
+	[METRIC_MEM_PEAK] = "mem.peak_bytes",
+	[METRIC_REPLAY_FRAMES] = "replay.frames",
+	[METRIC_REPLAY_BYTES] = "replay.compressed_bytes",
+	[METRIC_REPLAY_CPU_US] = "replay.cpu_us",
+	[METRIC_REPLAY_THROTTLED] = "replay.throttled",
+	[METRIC_REPLAY_SUBMITTED] = "replay.submitted",
+	[METRIC_REPLAY_UNCHANGED] = "replay.unchanged",
+	[METRIC_SHADOW_FULL] = "shadow.full_grabs",
+	[METRIC_SHADOW_RECTS] = "shadow.damage_rects",
+	[METRIC_SHADOW_PIXELS] = "shadow.damage_pixels",
+	[METRIC_SHADOW_GRABS] = "shadow.captures",
+	[METRIC_BURST_FRAMES] = "burst.frames",
+	[METRIC_BURST_SKIPPED] = "burst.unchanged",
+	[METRIC_DEDUP_SKIPPED] = "dedup.skipped",
+	[METRIC_DEDUP_SAVED_BYTES] = "dedup.saved_bytes",
+	[METRIC_DEDUP_SAVED_US] = "dedup.saved_us",
+	[METRIC_BACKEND_PROBES] = "backend.probes",
+	[METRIC_BACKEND_FALLBACKS] = "backend.fallbacks",
+	[METRIC_BACKEND_XGETIMAGE] = "backend.xgetimage",
+	[METRIC_BACKEND_XSHM] = "backend.xshm",
+	[METRIC_BACKEND_COMPOSITE] = "backend.composite",
+	[METRIC_BACKEND_GL] = "backend.gl",
+	[METRIC_GOT_PATCHES] = "got.patches",
+	[METRIC_GOT_US] = "got.us",
+	[METRIC_STATS_REFRESHES] = "stats.refreshes",
+	[METRIC_STATS_US] = "stats.refresh_us",
+	[METRIC_STATS_CALLS] = "stats.steam_calls",
+	[METRIC_STATS_UNLOCKS] = "stats.unlocks",
+	[METRIC_STATS_UPDATES] = "stats.updates",
+	[METRIC_POOL_JOBS] = "pool.jobs",
+};
+static uint64_t metrics[METRIC_MAX];
+
+void
+metric_add(enum Metric m, uint64_t val)
+{
+	__atomic_add_fetch(&metrics[m], val, __ATOMIC_RELAXED);
+}
+
+void
+metric_max(enum Metric m, uint64_t val)
+{
+	uint64_t cur = __atomic_load_n(&metrics[m], __ATOMIC_RELAXED);
+
+	while (val > cur && !__atomic_compare_exchange_n(&metrics[m], &cur, val,
+				False, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t
+metric_get(enum Metric m)
+{
+	return __atomic_load_n(&metrics[m], __ATOMIC_RELAXED);
+}
+
+void
+metrics_log(enum LogLevel ll)
+{
+	int m;
+
+	if (!log_check(ll))
+		return;
+
+	for (m = 0; m < METRIC_MAX; m++)
+		log(ll, "metric %s = %ju\n", metricNames[m], (uintmax_t)metric_get(m));
+}
+
+/* UNIX socket of the capture daemon */
+const char *
+ipc_socketPath(char *buf, size_t len)
+{
+	const char *path = cfg_getStr("DAEMON_SOCKET", NULL);
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (path)
+		snprintf(buf, len, "%s", path);
+	else if (dir && *dir)
+		snprintf(buf, len, "%s/ssspd.sock", dir);
+	else
+		snprintf(buf, len, "/tmp/ssspd-%u.sock", (unsigned int)getuid());
+
+	return buf;
+}
@@ -0,0 +1,158 @@
+/**
+ *
+ * Minimal PNG writer for RGB images with 8 or 16 bits per channel.
+ *
+ * Used for deep (depth 30) captures, which steam's 8 bit WriteScreenshot
+ * can't take, and as the fallback when steam isn't there. Every row gets the
+ * Up filter, which is cheap and helps deflate a lot on game content; deflate
+ * runs at its fastest level, this happens while the game is running.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "sssp.h"
+
+#define PNG_CHUNK_BYTES 65536
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static Bool writeChunk(FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+    uint8_t hdr[8], crc[4];
+    uLong c = g_lazy.crc32(0, (const Bytef *)type, 4);
+
+    put32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    if (len)
+        c = g_lazy.crc32(c, data, len);
+    put32(crc, c);
+
+    return fwrite(hdr, sizeof(hdr), 1, f) == 1 &&
+        (!len || fwrite(data, len, 1, f) == 1) &&
+        fwrite(crc, sizeof(crc), 1, f) == 1;
+}
+
+/* Hand the compressor's output over as IDAT chunks. */
+static Bool deflateRows(FILE *f, z_stream *zs, uint8_t *out, int flush)
+{
+    int rc;
+
+    do
+    {
+        zs->next_out = out;
+        zs->avail_out = PNG_CHUNK_BYTES;
+        rc = g_lazy.deflate(zs, flush);
+        if (rc == Z_STREAM_ERROR)
+            return False;
+        if (zs->avail_out < PNG_CHUNK_BYTES && !writeChunk(f, "IDAT", out, PNG_CHUNK_BYTES - zs->avail_out))
+            return False;
+    } while (zs->avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+
+    return True;
+}
+
+/* Write the w x h RGB image data (host order uint16_t channels for depth 16)
+ * to path. */
+Bool png_write(const char *path, const void *data, int w, int h, int depth)
+{
+    static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    const size_t rowBytes = 3 * (size_t)w * (depth / 8);
+    uint8_t ihdr[13];
+    uint8_t *row, *prev, *out;
+    z_stream zs;
+    FILE *f;
+    Bool ok;
+    int y;
+    size_t i;
+
+    if (!lazy_load(LAZY_ZLIB))
+        return False;
+
+    if ((f = fopen(path, "wb")) == NULL)
+    {
+        log(LOG_ERROR, "Unable to create %s: %s\n", path, strerror(errno));
+        return False;
+    }
+
+    row = malloc(2 * (rowBytes + 1) + PNG_CHUNK_BYTES);
+    memset(&zs, 0, sizeof(zs));
+    if (!row || g_lazy.deflateInit_(&zs, Z_BEST_SPEED, ZLIB_VERSION, (int)sizeof(zs)) != Z_OK)
+    {
+        free(row);
+        fclose(f);
+        remove(path);
+        return False;
+    }
+    prev = row + rowBytes + 1;
+    out = prev + rowBytes + 1;
+
+    put32(ihdr, w);
+    put32(ihdr + 4, h);
+    ihdr[8] = depth;
+    ihdr[9] = 2;    /* truecolor */
+    ihdr[10] = 0;   /* deflate */
+    ihdr[11] = 0;   /* adaptive filtering */
+    ihdr[12] = 0;   /* no interlace */
+
+    ok = fwrite(sig, sizeof(sig), 1, f) == 1 && writeChunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+    /* Starts out as the row above the image, which is all zero. */
+    memset(prev, 0, rowBytes + 1);
+
+    for (y = 0; ok && y < h; y++)
+    {
+        const uint8_t *src = (const uint8_t *)data + y * rowBytes;
+
+        /* PNG is big endian, filtering works on bytes afterwards. */
+        if (depth == 16)
+        {
+            const uint16_t *s16 = (const uint16_t *)src;
+            for (i = 0; i < rowBytes / 2; i++)
+            {
+                row[1 + 2 * i] = s16[i] >> 8;
+                row[2 + 2 * i] = s16[i];
+            }
+        }
+        else
+        {
+            memcpy(row + 1, src, rowBytes);
+        }
+
+        /* Up filter, prev keeps the unfiltered row for the next one. */
+        for (i = 1; i <= rowBytes; i++)
+        {
+            uint8_t v = row[i];
+            row[i] = v - prev[i];
+            prev[i] = v;
+        }
+        row[0] = 2;
+
+        zs.next_in = row;
+        zs.avail_in = rowBytes + 1;
+        ok = deflateRows(f, &zs, out, Z_NO_FLUSH);
+    }
+
+    ok = ok && deflateRows(f, &zs, out, Z_FINISH) && writeChunk(f, "IEND", NULL, 0);
+    ok = (fclose(f) == 0) && ok;
+
+    g_lazy.deflateEnd(&zs);
+    free(row);
+
+    if (!ok)
+    {
+        log(LOG_ERROR, "Failed to write %s.\n", path);
+        remove(path);
+    }
+
+    return ok;
+}
@@ -0,0 +1,334 @@
+/**
+ *
+ * Worker pool for everything sssp does in the background: screenshots,
+ * bursts, the instant replay grabber, warming up captures and the stats
+ * cache.
+ *
+ * There are two classes of workers, started once. The background ones run
+ * with SCHED_IDLE (or the nice level in SSSP_POOL_NICE), so they only get the
+ * CPU time the game leaves; they only run background jobs, which don't touch
+ * anything the game's threads might wait for. A worker that is starved there
+ * must not hold the game's Display lock or a lock the game takes, so jobs
+ * using these run on the normal worker at normal priority.
+ *
+ * The workers' affinity excludes the CPUs the game's main (event processing)
+ * and render (buffer swap) threads were last seen on, sampled in the hooks; a
+ * worker updates it before a job when these moved.
+ *
+ * Jobs are owned by the modules and scheduled like one-shot timers:
+ * scheduling a queued job again moves it, and a job never runs on two
+ * workers at once. Periodic work schedules its job again when done.
+ * Scheduling takes no lock, it posts the request to the class' inbox, which
+ * its workers move to their queue.
+ *
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "sssp.h"
+
+#define POOL_THREADS_MAX 16
+/* Request to take a job off the queue */
+#define POOL_CANCEL UINT64_MAX
+
+enum PoolClass
+{
+    POOL_NORMAL,
+    POOL_BACKGROUND,
+    POOL_CLASSES
+};
+
+typedef struct
+{
+    /* Only the class' workers take it */
+    pthread_mutex_t lock;
+    sem_t wake;
+    /* Queued jobs, by due time */
+    poolJob *queue;
+    /* Jobs with new requests, pushed by any thread */
+    poolJob *inbox;
+    int threads;
+} poolClass;
+
+static struct
+{
+    poolClass classes[POOL_CLASSES];
+
+    /* Configuration */
+    Bool idle;
+    long nice;
+    Bool avoidGame;
+    /* What the process may run on */
+    cpu_set_t allowed;
+
+    /* Last CPU the game's threads were seen on, -1 before */
+    int gameCpu[POOL_GAME_MAX];
+} g_pool = {
+    .classes = { { .lock = PTHREAD_MUTEX_INITIALIZER }, { .lock = PTHREAD_MUTEX_INITIALIZER } },
+    .gameCpu = { -1, -1 }
+};
+
+static __thread Bool t_worker;
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setPriority(void)
+{
+    struct sched_param sp = { .sched_priority = 0 };
+
+    if (g_pool.idle)
+    {
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp))
+            log(LOG_WARN, "Pool: unable to use SCHED_IDLE.\n");
+    }
+    /* Per thread on Linux */
+    else if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), g_pool.nice) < 0)
+    {
+        log(LOG_WARN, "Pool: unable to set nice level %ld.\n", g_pool.nice);
+    }
+}
+
+/* Keep off the game's CPUs, applied holds what the mask was made for. */
+static void updateAffinity(int applied[POOL_GAME_MAX])
+{
+    int cpus[POOL_GAME_MAX], i;
+    Bool changed = False;
+    cpu_set_t set;
+
+    if (!g_pool.avoidGame)
+        return;
+
+    for (i = 0; i < POOL_GAME_MAX; i++)
+    {
+        cpus[i] = __atomic_load_n(&g_pool.gameCpu[i], __ATOMIC_RELAXED);
+        changed |= cpus[i] != applied[i];
+    }
+    if (!changed)
+        return;
+
+    set = g_pool.allowed;
+    for (i = 0; i < POOL_GAME_MAX; i++)
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+            CPU_CLR(cpus[i], &set);
+    /* With a single CPU left to the game, share it */
+    if (CPU_COUNT(&set) == 0)
+        set = g_pool.allowed;
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+        memcpy(applied, cpus, sizeof(cpus));
+}
+
+static void dequeue(poolClass *c, poolJob *job)
+{
+    poolJob **p;
+
+    for (p = &c->queue; *p; p = &(*p)->next)
+    {
+        if (*p == job)
+        {
+            *p = job->next;
+            break;
+        }
+    }
+    job->queued = False;
+}
+
+static void enqueue(poolClass *c, poolJob *job, uint64_t due)
+{
+    poolJob **p;
+
+    job->due = due;
+    for (p = &c->queue; *p && (*p)->due <= due; p = &(*p)->next)
+        ;
+    job->next = *p;
+    *p = job;
+    job->queued = True;
+}
+
+static inline poolClass *classOf(const poolJob *job)
+{
+    return &g_pool.classes[job->background ? POOL_BACKGROUND : POOL_NORMAL];
+}
+
+/* Move the posted requests to the queue. Lock held. */
+static void drain(poolClass *c)
+{
+    poolJob *job, *next;
+    uint64_t request;
+
+    for (job = __atomic_exchange_n(&c->inbox, NULL, __ATOMIC_ACQUIRE); job; job = next)
+    {
+        /* Once posted is clear, the job may be posted again */
+        next = job->postedNext;
+        __atomic_exchange_n(&job->posted, False, __ATOMIC_ACQ_REL);
+        request = __atomic_load_n(&job->request, __ATOMIC_RELAXED);
+
+        if (job->queued)
+            dequeue(c, job);
+        if (request != POOL_CANCEL)
+            enqueue(c, job, request);
+    }
+}
+
+/* Set the request, then make sure the job is in the inbox once. */
+static void post(poolJob *job, uint64_t request)
+{
+    poolClass *c = classOf(job);
+    poolJob *head;
+
+    __atomic_store_n(&job->request, request, __ATOMIC_RELAXED);
+    if (!__atomic_exchange_n(&job->posted, True, __ATOMIC_ACQ_REL))
+    {
+        head = __atomic_load_n(&c->inbox, __ATOMIC_RELAXED);
+        do
+            job->postedNext = head;
+        while (!__atomic_compare_exchange_n(&c->inbox, &head, job, True, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    sem_post(&c->wake);
+}
+
+static void *poolThread(void *arg)
+{
+    poolClass *c = arg;
+    int applied[POOL_GAME_MAX] = { -1, -1 };
+    struct timespec ts;
+    poolJob *job;
+
+    t_worker = True;
+    if (c == &g_pool.classes[POOL_BACKGROUND])
+    {
+        pthread_setname_np(pthread_self(), "sssp-pool-bg");
+        setPriority();
+    }
+    else
+    {
+        pthread_setname_np(pthread_self(), "sssp-pool");
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while (1)
+    {
+        drain(c);
+
+        /* Jobs still running elsewhere wait for their worker */
+        for (job = c->queue; job && job->running; job = job->next)
+            ;
+
+        if (!job || job->due > nowNs())
+        {
+            pthread_mutex_unlock(&c->lock);
+            if (!job)
+            {
+                sem_wait(&c->wake);
+            }
+            else
+            {
+                ts.tv_sec = job->due / 1000000000ULL;
+                ts.tv_nsec = job->due % 1000000000ULL;
+                sem_clockwait(&c->wake, CLOCK_MONOTONIC, &ts);
+            }
+            pthread_mutex_lock(&c->lock);
+            continue;
+        }
+
+        dequeue(c, job);
+        job->running = True;
+        pthread_mutex_unlock(&c->lock);
+
+        updateAffinity(applied);
+        job->func(job->arg);
+        metric_add(METRIC_POOL_JOBS, 1);
+
+        pthread_mutex_lock(&c->lock);
+        job->running = False;
+    }
+
+    return NULL;
+}
+
+static void startClass(poolClass *c, long threads)
+{
+    pthread_t thread;
+
+    sem_init(&c->wake, 0, 0);
+    for (; c->threads < threads; c->threads++)
+    {
+        if (pthread_create(&thread, NULL, poolThread, c))
+        {
+            log(LOG_ERROR, "Pool: unable to start thread %d.\n", c->threads + 1);
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void pool_init(void)
+{
+    const char *nice = cfg_getStr("POOL_NICE", "idle");
+    long threads = cfg_getLong("POOL_THREADS", 1);
+
+    g_pool.idle = strcmp(nice, "idle") == 0;
+    g_pool.nice = strtol(nice, NULL, 10);
+    g_pool.avoidGame = cfg_getLong("POOL_AVOID_GAME", 1);
+    if (sched_getaffinity(0, sizeof(g_pool.allowed), &g_pool.allowed))
+        g_pool.avoidGame = False;
+
+    if (threads < 1 || threads > POOL_THREADS_MAX)
+        threads = threads < 1 ? 1 : POOL_THREADS_MAX;
+    startClass(&g_pool.classes[POOL_NORMAL], 1);
+    startClass(&g_pool.classes[POOL_BACKGROUND], threads);
+
+    log(LOG_INFO, "Pool: %d+%d threads, background %s, %s.\n",
+            g_pool.classes[POOL_NORMAL].threads, g_pool.classes[POOL_BACKGROUND].threads,
+            g_pool.idle ? "SCHED_IDLE" : "niced", g_pool.avoidGame ? "avoiding the game's CPUs" : "any CPU");
+}
+
+/* Run job in delayNs, False without workers for it. */
+Bool pool_schedule(poolJob *job, uint64_t delayNs)
+{
+    if (!classOf(job)->threads)
+        return False;
+
+    post(job, nowNs() + delayNs);
+
+    return True;
+}
+
+/* Unless it's already running */
+void pool_cancel(poolJob *job)
+{
+    if (classOf(job)->threads)
+        post(job, POOL_CANCEL);
+}
+
+/* Whether this is a worker, whose calls into the hooked functions are
+ * sssp's own. */
+Bool pool_isWorker(void)
+{
+    return t_worker;
+}
+
+/* Called from the hooks, on the game's threads. */
+void pool_noteGame(enum PoolGameThread thread)
+{
+    int cpu;
+
+    if (t_worker)
+        return;
+
+    cpu = sched_getcpu();
+    if (cpu >= 0 && __atomic_load_n(&g_pool.gameCpu[thread], __ATOMIC_RELAXED) != cpu)
+        __atomic_store_n(&g_pool.gameCpu[thread], cpu, __ATOMIC_RELAXED);
+}
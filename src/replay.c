@@ -0,0 +1,471 @@
+/**
+ *
+ * Instant replay: continuously grab the target window at a low rate into a
+ * fixed size ring of LZ compressed frames, so a late hotkey press can still
+ * submit what was on screen a moment ago.
+ *
+ * The grabber is a background pool job with its own X connection, scheduled
+ * again after each frame. With the Damage
+ * extension it keeps a shadow framebuffer of the window and only compresses
+ * frames that changed, otherwise it uses XShm when the server is local (no
+ * copy through the socket) and falls back to XGetImage.
+ * Frames are kept in the server's pixel format and only converted to RGB on
+ * submission. The worker's CPU time is measured per frame, and the interval
+ * is stretched whenever grabbing and compressing would exceed the configured
+ * CPU share.
+ *
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "sssp.h"
+
+#define REPLAY_MAX_FRAMES 256
+/* Re-resolve the content window every that many ms */
+#define REPLAY_RESOLVE_MS 2000
+/* Log the steady-state cost every that many ms */
+#define REPLAY_REPORT_MS 10000
+
+typedef struct
+{
+    uint64_t seq;
+    size_t off, len;
+    int w, h;
+    unsigned long masks[3];
+} replayFrame;
+
+/* XShm segment (re-)allocated on size changes */
+typedef struct
+{
+    XShmSegmentInfo info;
+    XImage *image;
+} shmImage;
+
+static void connectJob(void *arg);
+static void replayJob(void *arg);
+
+static struct
+{
+    poolJob connectJob;
+    poolJob job;
+    pthread_mutex_t lock;
+    Window target;
+
+    /* Configuration */
+    long fps;
+    long cpuPct;
+    long submitCount;
+    Bool pickBest;
+
+    /* Ring of compressed frames in one arena */
+    uint8_t *arena;
+    size_t cap;
+    size_t head;
+    replayFrame frames[REPLAY_MAX_FRAMES];
+    unsigned int first, count;
+    uint64_t nextSeq;
+
+    /* Grabber state, only the job touches it */
+    Display *dpy;
+    Window grabTarget;
+    Window win;
+    shmImage si;
+    shadowFb *shadow;
+    Bool useShm;
+    Bool useDamage;
+    uint8_t *scratch;
+    size_t scratchLen;
+    uint64_t resolved;
+    uint64_t reported;
+    uint64_t cpuSum;
+    uint64_t grabs;
+    uint64_t stored;
+} g_replay = {
+    .connectJob = POOL_JOB(connectJob, NULL),
+    .job = POOL_BACKGROUND_JOB(replayJob, NULL),
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static inline uint64_t nowNs(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static Bool overlaps(const replayFrame *f, size_t off, size_t len)
+{
+    return f->off < off + len && off < f->off + f->len;
+}
+
+/* Store a compressed frame, evicting the oldest ones to make room. */
+static void storeFrame(const uint8_t *data, size_t len, const XImage *image)
+{
+    replayFrame *f;
+    unsigned int i;
+    Bool overlap;
+
+    pthread_mutex_lock(&g_replay.lock);
+
+    if (g_replay.head + len > g_replay.cap)
+        g_replay.head = 0;
+
+    /* Frames are laid out in ring order, so the oldest ones go first. */
+    do
+    {
+        overlap = g_replay.count == REPLAY_MAX_FRAMES;
+        for (i = 0; !overlap && i < g_replay.count; i++)
+            overlap = overlaps(&g_replay.frames[(g_replay.first + i) % REPLAY_MAX_FRAMES], g_replay.head, len);
+
+        if (overlap)
+        {
+            g_replay.first = (g_replay.first + 1) % REPLAY_MAX_FRAMES;
+            g_replay.count--;
+        }
+    } while (overlap);
+
+    f = &g_replay.frames[(g_replay.first + g_replay.count++) % REPLAY_MAX_FRAMES];
+    f->seq = g_replay.nextSeq++;
+    f->off = g_replay.head;
+    f->len = len;
+    f->w = image->width;
+    f->h = image->height;
+    f->masks[0] = image->red_mask;
+    f->masks[1] = image->green_mask;
+    f->masks[2] = image->blue_mask;
+    memcpy(g_replay.arena + f->off, data, len);
+    g_replay.head += len;
+
+    pthread_mutex_unlock(&g_replay.lock);
+}
+
+static void shmFree(Display *dpy, shmImage *si)
+{
+    if (!si->image)
+        return;
+
+    g_lazy.XShmDetach(dpy, &si->info);
+    XDestroyImage(si->image);
+    shmdt(si->info.shmaddr);
+    si->image = NULL;
+}
+
+static XImage *shmGrab(Display *dpy, shmImage *si, Window win, XWindowAttributes *attrs)
+{
+    if (si->image && (si->image->width != attrs->width || si->image->height != attrs->height))
+        shmFree(dpy, si);
+
+    if (!si->image)
+    {
+        si->image = g_lazy.XShmCreateImage(dpy, attrs->visual, attrs->depth, ZPixmap, NULL,
+                &si->info, attrs->width, attrs->height);
+        if (!si->image)
+            return NULL;
+
+        si->info.shmid = shmget(IPC_PRIVATE, si->image->bytes_per_line * si->image->height, IPC_CREAT | 0600);
+        si->info.shmaddr = si->image->data = si->info.shmid >= 0 ? shmat(si->info.shmid, NULL, 0) : (void *)-1;
+        si->info.readOnly = False;
+        if (si->info.shmaddr == (void *)-1 || !g_lazy.XShmAttach(dpy, &si->info))
+        {
+            log(LOG_WARN, "XShm setup failed, using XGetImage.\n");
+            if (si->info.shmid >= 0)
+                shmctl(si->info.shmid, IPC_RMID, NULL);
+            si->image->data = NULL;
+            XDestroyImage(si->image);
+            si->image = NULL;
+            return NULL;
+        }
+        /* Segment goes away with the last detach */
+        XSync(dpy, False);
+        shmctl(si->info.shmid, IPC_RMID, NULL);
+    }
+
+    return g_lazy.XShmGetImage(dpy, win, si->image, 0, 0, AllPlanes) ? si->image : NULL;
+}
+
+/* Compress and store a frame. */
+static void compressFrame(const XImage *image, uint8_t **scratch, size_t *scratchLen)
+{
+    size_t size = (size_t)image->bytes_per_line * image->height;
+    size_t len;
+
+    if (*scratchLen < lz_bound(size))
+    {
+        free(*scratch);
+        *scratch = malloc(lz_bound(size));
+        *scratchLen = *scratch ? lz_bound(size) : 0;
+    }
+
+    len = *scratch && image->bits_per_pixel == 32 && image->bytes_per_line == 4 * image->width ?
+        lz_compress(image->data, size, *scratch, *scratchLen) : 0;
+    if (len && len <= g_replay.cap)
+    {
+        storeFrame(*scratch, len, image);
+        metric_add(METRIC_REPLAY_FRAMES, 1);
+        metric_add(METRIC_REPLAY_BYTES, len);
+    }
+}
+
+/* Connect and load what the grabs need at normal priority: the loader's
+ * lock is one the game's threads take too. Then start grabbing. */
+static void connectJob(void *arg UNUSED)
+{
+    if ((g_replay.dpy = XOpenDisplay(NULL)) == NULL)
+    {
+        log(LOG_ERROR, "Instant replay: unable to open display.\n");
+        return;
+    }
+
+    /* Runs until exit, so does its need for the GL swap hook */
+    got_require(GOT_SWAP);
+    g_replay.useDamage = cfg_getLong("DAMAGE", 1) && lazy_load(LAZY_XDAMAGE) && lazy_load(LAZY_XFIXES);
+    g_replay.useShm = lazy_load(LAZY_XEXT) && g_lazy.XShmQueryExtension(g_replay.dpy);
+    g_replay.reported = nowNs(CLOCK_MONOTONIC);
+    log(LOG_NOTICE, "Instant replay running at %ld fps using %s, %zu KiB ring.\n",
+            g_replay.fps, g_replay.useDamage ? "damage tracking" : g_replay.useShm ? "XShm" : "XGetImage",
+            g_replay.cap >> 10);
+
+    pool_schedule(&g_replay.job, 0);
+}
+
+/* Grab one frame, then schedule the next. */
+static void replayJob(void *arg UNUSED)
+{
+    Display *dpy = g_replay.dpy;
+    XWindowAttributes attrs;
+    Window target, w;
+    const XImage *fb;
+    XImage *image = NULL;
+    uint64_t interval = 1000000000ULL / g_replay.fps;
+    uint64_t t0, cpu0, cost, period, now;
+
+    t0 = nowNs(CLOCK_MONOTONIC);
+    cpu0 = nowNs(CLOCK_THREAD_CPUTIME_ID);
+
+    target = __atomic_load_n(&g_replay.target, __ATOMIC_RELAXED);
+    if (target != g_replay.grabTarget || t0 - g_replay.resolved > REPLAY_RESOLVE_MS * 1000000ULL)
+    {
+        g_replay.grabTarget = target;
+        w = target ? capture_findWindow(dpy, target, &attrs) : None;
+        g_replay.resolved = t0;
+
+        if (w != g_replay.win)
+        {
+            shadow_destroy(g_replay.shadow);
+            g_replay.shadow = NULL;
+            g_replay.win = w;
+        }
+        if (g_replay.win != None && g_replay.useDamage && !g_replay.shadow)
+        {
+            g_replay.shadow = shadow_create(dpy, g_replay.win);
+            g_replay.useDamage = g_replay.shadow != NULL;
+            g_replay.stored = 0;
+        }
+    }
+
+    if (g_replay.shadow)
+    {
+        /* Only changed content is transferred, and only new frames stored */
+        if (!shadow_update(g_replay.shadow))
+        {
+            g_replay.resolved = 0;
+        }
+        else
+        {
+            fb = shadow_lock(g_replay.shadow);
+            if (fb && shadow_generation(g_replay.shadow) != g_replay.stored)
+            {
+                g_replay.stored = shadow_generation(g_replay.shadow);
+                compressFrame(fb, &g_replay.scratch, &g_replay.scratchLen);
+            }
+            else
+            {
+                metric_add(METRIC_REPLAY_UNCHANGED, 1);
+            }
+            shadow_unlock(g_replay.shadow);
+        }
+    }
+    /* Size may change at any time, keep the grab inside the window. */
+    else if (g_replay.win != None && XGetWindowAttributes(dpy, g_replay.win, &attrs) && attrs.map_state == IsViewable)
+    {
+        if (g_replay.useShm)
+            image = shmGrab(dpy, &g_replay.si, g_replay.win, &attrs);
+        if (!image)
+            image = XGetImage(dpy, g_replay.win, 0, 0, attrs.width, attrs.height, AllPlanes, ZPixmap);
+
+        if (image)
+        {
+            compressFrame(image, &g_replay.scratch, &g_replay.scratchLen);
+            if (image != g_replay.si.image)
+                XDestroyImage(image);
+        }
+    }
+
+    /* Bound the CPU share: the period is at least cost * 100 / pct. */
+    cost = nowNs(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    period = cost * 100 / g_replay.cpuPct;
+    if (period > interval)
+        metric_add(METRIC_REPLAY_THROTTLED, 1);
+    else
+        period = interval;
+    g_replay.cpuSum += cost;
+    g_replay.grabs++;
+    metric_add(METRIC_REPLAY_CPU_US, cost / 1000);
+
+    if (t0 - g_replay.reported > REPLAY_REPORT_MS * 1000000ULL)
+    {
+        log(LOG_INFO, "Instant replay: %ju frames, %.2f%% CPU, %.1f ms/frame, %u frames buffered.\n",
+                (uintmax_t)g_replay.grabs, 100.0 * g_replay.cpuSum / (t0 - g_replay.reported),
+                g_replay.cpuSum / 1e6 / g_replay.grabs, g_replay.count);
+        g_replay.cpuSum = g_replay.grabs = 0;
+        g_replay.reported = t0;
+    }
+
+    now = nowNs(CLOCK_MONOTONIC);
+    pool_schedule(&g_replay.job, t0 + period > now ? t0 + period - now : 0);
+}
+
+void replay_init(void)
+{
+    if (!cfg_getLong("REPLAY", 0))
+        return;
+
+    g_replay.fps = cfg_getLong("REPLAY_FPS", 2);
+    g_replay.cpuPct = cfg_getLong("REPLAY_CPU", 5);
+    g_replay.submitCount = cfg_getLong("REPLAY_FRAMES", 5);
+    g_replay.pickBest = strcmp(cfg_getStr("REPLAY_PICK", "recent"), "best") == 0;
+    g_replay.cap = (size_t)cfg_getLong("REPLAY_MB", 64) << 20;
+
+    if (g_replay.fps <= 0 || g_replay.cpuPct <= 0 || g_replay.cap == 0 ||
+        (g_replay.arena = malloc(g_replay.cap)) == NULL)
+    {
+        log(LOG_ERROR, "Instant replay disabled due to invalid configuration.\n");
+        return;
+    }
+
+    if (!pool_schedule(&g_replay.connectJob, 0))
+    {
+        log(LOG_ERROR, "Instant replay: no worker to run on.\n");
+        free(g_replay.arena);
+        g_replay.arena = NULL;
+    }
+}
+
+void replay_setTarget(Window win)
+{
+    __atomic_store_n(&g_replay.target, win, __ATOMIC_RELAXED);
+}
+
+/* Find a frame by sequence number, NULL if it was evicted. Lock held. */
+static replayFrame *findFrame(uint64_t seq)
+{
+    replayFrame *oldest = &g_replay.frames[g_replay.first];
+
+    if (!g_replay.count || seq < oldest->seq || seq - oldest->seq >= g_replay.count)
+        return NULL;
+
+    return &g_replay.frames[(g_replay.first + (seq - oldest->seq)) % REPLAY_MAX_FRAMES];
+}
+
+static int compareLen(const void *a, const void *b)
+{
+    const replayFrame *fa = *(const replayFrame **)a, *fb = *(const replayFrame **)b;
+    return fa->len < fb->len ? 1 : fa->len > fb->len ? -1 : 0;
+}
+
+static int compareSeq(const void *a, const void *b)
+{
+    const uint64_t sa = *(const uint64_t *)a, sb = *(const uint64_t *)b;
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* Submit the best or most recent frames, oldest first. */
+void replay_submit(submitFunc submit)
+{
+    replayFrame *sorted[REPLAY_MAX_FRAMES];
+    uint64_t picked[REPLAY_MAX_FRAMES];
+    unsigned int i, n;
+    budgetSlot slot = { 0 };
+    hashState hs;
+    XImage image;
+    uint8_t *raw, *rgb;
+    replayFrame *f;
+    size_t size;
+    int w, h;
+
+    if (!g_replay.arena)
+        return;
+
+    pthread_mutex_lock(&g_replay.lock);
+    n = g_replay.count < g_replay.submitCount ? g_replay.count : g_replay.submitCount;
+    for (i = 0; i < g_replay.count; i++)
+        sorted[i] = &g_replay.frames[(g_replay.first + i) % REPLAY_MAX_FRAMES];
+
+    /* Best: the frames compressing worst carry the most detail. */
+    if (g_replay.pickBest)
+        qsort(sorted, g_replay.count, sizeof(sorted[0]), compareLen);
+    else
+        memmove(sorted, sorted + g_replay.count - n, n * sizeof(sorted[0]));
+
+    for (i = 0; i < n; i++)
+        picked[i] = sorted[i]->seq;
+    pthread_mutex_unlock(&g_replay.lock);
+
+    qsort(picked, n, sizeof(picked[0]), compareSeq);
+
+    for (i = 0; i < n; i++)
+    {
+        pthread_mutex_lock(&g_replay.lock);
+        f = findFrame(picked[i]);
+        w = f ? f->w : 0;
+        h = f ? f->h : 0;
+        pthread_mutex_unlock(&g_replay.lock);
+
+        if (!f || budget_reserveCapture(&slot, w, h) != 1)
+        {
+            budget_release(&slot);
+            continue;
+        }
+
+        size = 4 * (size_t)w * h;
+        raw = malloc(size);
+        rgb = malloc(3 * (size_t)w * h);
+
+        /* Decompress while holding the lock, the grabber may evict it. */
+        pthread_mutex_lock(&g_replay.lock);
+        f = findFrame(picked[i]);
+        if (f && raw && rgb && lz_decompress(g_replay.arena + f->off, f->len, raw, size) == size)
+        {
+            memset(&image, 0, sizeof(image));
+            image.width = w;
+            image.height = h;
+            image.data = (char *)raw;
+            image.bytes_per_line = 4 * w;
+            image.bits_per_pixel = 32;
+            image.red_mask = f->masks[0];
+            image.green_mask = f->masks[1];
+            image.blue_mask = f->masks[2];
+            pthread_mutex_unlock(&g_replay.lock);
+
+            hash_init(&hs);
+            capture_convert(&image, rgb, w, h, 1, &hs);
+            submit(rgb, w, h, hash_final(&hs));
+            metric_add(METRIC_REPLAY_SUBMITTED, 1);
+        }
+        else
+        {
+            pthread_mutex_unlock(&g_replay.lock);
+        }
+
+        free(raw);
+        free(rgb);
+        budget_release(&slot);
+    }
+}
@@ -0,0 +1,268 @@
+/**
+ *
+ * Process rules: which processes the preload handles and which it only passes
+ * through.
+ *
+ * Rules come from SSSP_RULES (separated by ';') and SSSP_RULES_FILE (one per
+ * line, '#' comments), followed by the built-in defaults. Each is '+' (handle)
+ * or '-' (pass through) and a pattern:
+ *  - app:<id>      steam AppID of the game (SteamAppId environment variable)
+ *  - name          exact program name
+ *  - /path/prog    exact program path
+ *  - /path/        path prefix
+ *  - glob          fnmatch() glob, against the path when it contains a '/',
+ *                  else against the name
+ * The first rule that matches decides, a process no rule matches is handled.
+ *
+ * Everything but globs is compiled into one hash table, keyed by the kind of
+ * the pattern and its text. Checking a process takes a lookup for the name,
+ * the path and the AppID, plus one for each directory of the path against
+ * the prefixes. Helper processes are the bulk of what gets the preload, so
+ * this is all the constructor does for them.
+ *
+ */
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sssp.h"
+
+#define RULES_MAX 256
+
+/* Key kinds */
+#define RULE_APP 'a'
+#define RULE_NAME 'n'
+#define RULE_PATH 'p'
+#define RULE_PREFIX 'd'
+
+static const char *const rulesDefault =
+    // Shells
+    "-sh;-bash;-dash;-zsh;"
+    // System paths
+    "-/bin/;-/sbin/;"
+    // Steam's own executables and the runtime's helpers
+    "-steam*;-streaming_client;-reaper;-pressure-vessel-*;-srt-*";
+
+typedef struct
+{
+    /* Position in the rule list, lower wins */
+    int index;
+    Bool allow;
+    char kind;
+    size_t len;
+    const char *key;
+} rule;
+
+static struct
+{
+    char *text;
+    rule rules[RULES_MAX];
+    int count;
+    /* Open addressing, indices into rules + 1, 0 is empty */
+    uint16_t table[2 * RULES_MAX];
+    /* Globs in rule order */
+    int globs[RULES_MAX];
+    int globCount;
+} g_rules;
+
+/* FNV-1a, over the kind and the key */
+static inline uint32_t ruleHashStep(uint32_t h, uint8_t c)
+{
+    return (h ^ c) * 16777619U;
+}
+
+static uint32_t ruleHash(char kind, const char *key, size_t len)
+{
+    uint32_t h = ruleHashStep(2166136261U, kind);
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = ruleHashStep(h, key[i]);
+
+    return h;
+}
+
+static const rule *lookup(uint32_t h, char kind, const char *key, size_t len)
+{
+    const size_t mask = sizeof(g_rules.table) / sizeof(g_rules.table[0]) - 1;
+    size_t i;
+
+    for (i = h & mask; g_rules.table[i]; i = (i + 1) & mask)
+    {
+        const rule *r = &g_rules.rules[g_rules.table[i] - 1];
+        if (r->kind == kind && r->len == len && memcmp(r->key, key, len) == 0)
+            return r;
+    }
+
+    return NULL;
+}
+
+static void insert(rule *r)
+{
+    const size_t mask = sizeof(g_rules.table) / sizeof(g_rules.table[0]) - 1;
+    size_t i;
+
+    /* An earlier rule for the same key shadows this one. */
+    if (lookup(ruleHash(r->kind, r->key, r->len), r->kind, r->key, r->len))
+        return;
+
+    for (i = ruleHash(r->kind, r->key, r->len) & mask; g_rules.table[i]; i = (i + 1) & mask)
+        ;
+    g_rules.table[i] = r - g_rules.rules + 1;
+}
+
+/* Compile the rules in text, separated by any of seps. Modifies text. */
+static void compile(char *text, const char *seps)
+{
+    char *save = NULL, *tok;
+
+    for (tok = strtok_r(text, seps, &save); tok; tok = strtok_r(NULL, seps, &save))
+    {
+        rule *r = &g_rules.rules[g_rules.count];
+        char *end;
+
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        for (end = tok + strlen(tok); end > tok && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); end--)
+            ;
+        *end = '\0';
+        if (!*tok || *tok == '#')
+            continue;
+
+        if ((*tok != '+' && *tok != '-') || !tok[1])
+        {
+            log(LOG_WARN, "Ignoring rule '%s', needs to start with + or -.\n", tok);
+            continue;
+        }
+        if (g_rules.count == RULES_MAX)
+        {
+            log(LOG_WARN, "More than %d rules, ignoring the rest.\n", RULES_MAX);
+            return;
+        }
+
+        r->index = g_rules.count;
+        r->allow = *tok++ == '+';
+        r->key = tok;
+
+        if (strncmp(tok, "app:", 4) == 0)
+        {
+            r->kind = RULE_APP;
+            r->key += 4;
+        }
+        else if (strpbrk(tok, "*?["))
+        {
+            r->kind = strchr(tok, '/') ? RULE_PATH : RULE_NAME;
+            g_rules.globs[g_rules.globCount++] = r->index;
+            g_rules.count++;
+            continue;
+        }
+        else if (*tok == '/' && end[-1] == '/')
+        {
+            r->kind = RULE_PREFIX;
+        }
+        else
+        {
+            r->kind = strchr(tok, '/') ? RULE_PATH : RULE_NAME;
+        }
+
+        r->len = strlen(r->key);
+        g_rules.count++;
+        insert(r);
+    }
+}
+
+/* Read SSSP_RULES_FILE as one string. */
+static char *readFile(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char *text = NULL;
+    long len;
+
+    if (!f)
+    {
+        log(LOG_WARN, "Unable to open rules file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0 &&
+        (text = malloc(len + 1)) != NULL)
+    {
+        len = fread(text, 1, len, f);
+        text[len] = '\0';
+    }
+    fclose(f);
+
+    return text;
+}
+
+void rules_init(void)
+{
+    const char *env = cfg_getStr("RULES", NULL);
+    const char *file = cfg_getStr("RULES_FILE", NULL);
+    char *fileText = file ? readFile(file) : NULL;
+    size_t envLen = env ? strlen(env) : 0;
+    size_t fileLen = fileText ? strlen(fileText) : 0;
+    char *p;
+
+    /* Keys point into one copy of all rule texts, kept for the lifetime of
+     * the process. */
+    g_rules.text = malloc(envLen + fileLen + strlen(rulesDefault) + 3);
+    if (!g_rules.text)
+    {
+        free(fileText);
+        return;
+    }
+
+    p = g_rules.text;
+    memcpy(p, env ? env : "", envLen + 1);
+    compile(p, ";");
+    p += envLen + 1;
+
+    memcpy(p, fileText ? fileText : "", fileLen + 1);
+    compile(p, "\n;");
+    p += fileLen + 1;
+    free(fileText);
+
+    memcpy(p, rulesDefault, strlen(rulesDefault) + 1);
+    compile(p, ";");
+}
+
+/* Whether the process at path (as started) named name, running the game
+ * appId (or NULL), is to be handled. */
+Bool rules_allowed(const char *path, const char *name, const char *appId)
+{
+    const rule *best = NULL, *r;
+    uint32_t h = ruleHashStep(2166136261U, RULE_PREFIX);
+    size_t i;
+    int g;
+
+#define RULE_TAKE(m) if ((r = (m)) != NULL && (!best || r->index < best->index)) best = r;
+
+    if (appId && *appId)
+        RULE_TAKE(lookup(ruleHash(RULE_APP, appId, strlen(appId)), RULE_APP, appId, strlen(appId)));
+    RULE_TAKE(lookup(ruleHash(RULE_NAME, name, strlen(name)), RULE_NAME, name, strlen(name)));
+    RULE_TAKE(lookup(ruleHash(RULE_PATH, path, strlen(path)), RULE_PATH, path, strlen(path)));
+
+    /* Every directory of path against the prefixes, hashed incrementally */
+    for (i = 0; path[i]; i++)
+    {
+        h = ruleHashStep(h, path[i]);
+        if (path[i] == '/')
+            RULE_TAKE(lookup(h, RULE_PREFIX, path, i + 1));
+    }
+
+    for (g = 0; g < g_rules.globCount && (!best || g_rules.globs[g] < best->index); g++)
+    {
+        r = &g_rules.rules[g_rules.globs[g]];
+        if (fnmatch(r->key, r->kind == RULE_PATH ? path : name, 0) == 0)
+            best = r;
+    }
+
+#undef RULE_TAKE
+
+    if (best)
+        log(LOG_DEBUG, "Rule %d (%c%s) matches '%s'.\n", best->index, best->allow ? '+' : '-', best->key, path);
+
+    return !best || best->allow;
+}
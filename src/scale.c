@@ -0,0 +1,104 @@
+/**
+ *
+ * Box filter downscaling of plain RGB images.
+ *
+ * Separable: the source rows making up one destination row are summed into a
+ * row of 32bit accumulators first (SSE2, 16 bytes per step, when the compiler
+ * targets it), then each destination pixel averages its columns out of that
+ * row. Every source pixel is read once, whatever the factor. Enlarging falls
+ * back to nearest neighbour, since every destination pixel covers at least
+ * one source pixel.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "sssp.h"
+
+/* acc[i] += row[i] for len bytes */
+static inline void accumulateRow(uint32_t *acc, const uint8_t *row, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *a = (__m128i *)(acc + i);
+
+        _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for (; i < len; i++)
+        acc[i] += row[i];
+}
+
+/* Scale the sw x sh RGB image src down to dw x dh into dst. */
+Bool scale_box(const uint8_t *src, int sw, int sh, uint8_t *dst, int dw, int dh)
+{
+    uint32_t *acc;
+    int *cols;
+    int x, y, sy, y0, y1;
+
+    if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+        return False;
+
+    acc = malloc(3 * (size_t)sw * sizeof(*acc));
+    cols = malloc((dw + 1) * sizeof(*cols));
+    if (!acc || !cols)
+    {
+        free(acc);
+        free(cols);
+        return False;
+    }
+
+    /* Source column range of destination column x is [cols[x], cols[x + 1]) */
+    for (x = 0; x <= dw; x++)
+        cols[x] = (int)((int64_t)x * sw / dw);
+
+    for (y = 0; y < dh; y++)
+    {
+        y0 = (int)((int64_t)y * sh / dh);
+        y1 = (int)((int64_t)(y + 1) * sh / dh);
+        if (y1 <= y0)
+            y1 = y0 + 1;
+
+        memset(acc, 0, 3 * (size_t)sw * sizeof(*acc));
+        for (sy = y0; sy < y1; sy++)
+            accumulateRow(acc, src + (size_t)sy * sw * 3, 3 * (size_t)sw);
+
+        for (x = 0; x < dw; x++, dst += 3)
+        {
+            int x0 = cols[x], x1 = cols[x + 1] > x0 ? cols[x + 1] : x0 + 1;
+            uint32_t n = (uint32_t)(x1 - x0) * (y1 - y0);
+            uint32_t r = 0, g = 0, b = 0;
+            const uint32_t *a = acc + 3 * x0;
+
+            for (; x0 < x1; x0++, a += 3)
+            {
+                r += a[0];
+                g += a[1];
+                b += a[2];
+            }
+
+            /* Rounded */
+            dst[0] = (r + n / 2) / n;
+            dst[1] = (g + n / 2) / n;
+            dst[2] = (b + n / 2) / n;
+        }
+    }
+
+    free(acc);
+    free(cols);
+
+    return True;
+}
@@ -0,0 +1,662 @@
+/**
+ *
+ * Streaming parser for steam's binary KeyValues, the format of the stats
+ * schemas.
+ *
+ * Every item is a type byte, a NUL terminated key and the value, collections
+ * hold items up to an end marker. The parser makes one pass and reports the
+ * items to a visitor as it goes, SAX style. The only state is the path of
+ * enclosing collections, bounded by SCHEMA_DEPTH_MAX, so it allocates
+ * nothing. Visitors skip collections they don't care about and stop once
+ * they have what they want. Every read is checked against the size.
+ *
+ * The index is a visitor too, flattening the schema into nodes linked by
+ * indices and a hash table of their full key paths. It's one block with a
+ * header of offsets, written to a cache file as is and mapped from it later.
+ * The header is checked on load, everything else when it's used, so a
+ * corrupt cache can't send lookups out of the block, nor traversals in
+ * circles.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "schema.h"
+
+#define SCHEMA_ERROR(...) \
+    do { \
+        if (err) \
+            snprintf(err, errLen, __VA_ARGS__); \
+        return -1; \
+    } while (0)
+
+#define SCHEMA_ERROR_NULL(...) \
+    do { \
+        if (err) \
+            snprintf(err, errLen, __VA_ARGS__); \
+        return NULL; \
+    } while (0)
+
+/* Size of the value of type at off, 0 if it doesn't fit into size. */
+static size_t valueLen(const uint8_t *data, size_t size, size_t off, enum SchemaType type)
+{
+    const uint8_t *end;
+    size_t len;
+
+    switch (type)
+    {
+        case SCHEMA_STRING:
+            if ((end = memchr(data + off, '\0', size - off)) == NULL)
+                return 0;
+            return end - (data + off) + 1;
+        case SCHEMA_INT32:
+        case SCHEMA_FLOAT:
+        case SCHEMA_POINTER:
+        case SCHEMA_COLOR:
+            len = 4;
+            break;
+        case SCHEMA_UINT64:
+            len = 8;
+            break;
+        case SCHEMA_WSTRING:
+            /* Length in characters, big endian unlike everything else */
+            if (size - off < 2)
+                return 0;
+            len = 2 + sizeof(wchar_t) * (data[off] << 8 | data[off + 1]);
+            break;
+        default:
+            return 0;
+    }
+
+    return size - off < len ? 0 : len;
+}
+
+int schema_parse(const void *data, size_t size, const schemaVisitor *visitor, void *ctx, char *err, size_t errLen)
+{
+    const uint8_t *p = data;
+    schemaItem path[SCHEMA_DEPTH_MAX];
+    schemaItem item;
+    enum SchemaNext next;
+    const uint8_t *end;
+    size_t off = 0, depth = 0, len;
+    /* Depth of the collection being skipped, 0 if none */
+    size_t skip = 0;
+
+    while (off < size)
+    {
+        item.offset = off;
+        item.type = p[off++];
+
+        if (item.type == SCHEMA_END)
+        {
+            /* End of the top level */
+            if (depth == 0)
+                return 0;
+
+            depth--;
+            if (skip)
+            {
+                if (depth < skip)
+                    skip = 0;
+            }
+            else if (visitor->leave && visitor->leave(ctx, &path[depth], path) == SCHEMA_STOP)
+            {
+                return 1;
+            }
+            continue;
+        }
+
+        if (item.type > SCHEMA_END)
+            SCHEMA_ERROR("Unknown type %u at offset %zu.", item.type, item.offset);
+
+        if (off >= size || (end = memchr(p + off, '\0', size - off)) == NULL)
+            SCHEMA_ERROR("Truncated key at offset %zu.", off);
+        item.depth = depth;
+        item.key = (const char *)p + off;
+        item.keyLen = end - (p + off);
+        off += item.keyLen + 1;
+
+        if (item.type == SCHEMA_COLLECTION)
+        {
+            if (depth == SCHEMA_DEPTH_MAX)
+                SCHEMA_ERROR("Nesting too deep at offset %zu.", item.offset);
+
+            item.value = NULL;
+            item.valueLen = 0;
+            path[depth++] = item;
+            if (skip || !visitor->enter)
+                continue;
+
+            next = visitor->enter(ctx, &path[depth - 1], path);
+            if (next == SCHEMA_STOP)
+                return 1;
+            if (next == SCHEMA_SKIP)
+                skip = depth;
+            continue;
+        }
+
+        if (off >= size || (len = valueLen(p, size, off, item.type)) == 0)
+            SCHEMA_ERROR("Truncated value of '%.*s' at offset %zu.", (int)item.keyLen, item.key, off);
+        item.value = p + off;
+        item.valueLen = item.type == SCHEMA_STRING ? len - 1 : len;
+        off += len;
+
+        if (!skip && visitor->value && visitor->value(ctx, &item, path) == SCHEMA_STOP)
+            return 1;
+    }
+
+    /* The top level may end with the file */
+    if (depth)
+        SCHEMA_ERROR("Collection '%.*s' ends with the file.", (int)path[depth - 1].keyLen, path[depth - 1].key);
+
+    return 0;
+}
+
+int schema_parseFile(const char *path, const schemaVisitor *visitor, void *ctx, char *err, size_t errLen)
+{
+    struct stat st;
+    void *data;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        SCHEMA_ERROR("Unable to open %s: %s", path, strerror(errno));
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        SCHEMA_ERROR("Unable to map %s: %s", path, strerror(errno));
+
+    rc = schema_parse(data, st.st_size, visitor, ctx, err, errLen);
+    munmap(data, st.st_size);
+
+    return rc;
+}
+
+uint32_t schema_uint32(const schemaItem *item)
+{
+    const uint8_t *v = item->value;
+
+    return (uint32_t)v[0] | (uint32_t)v[1] << 8 | (uint32_t)v[2] << 16 | (uint32_t)v[3] << 24;
+}
+
+int32_t schema_int32(const schemaItem *item)
+{
+    return (int32_t)schema_uint32(item);
+}
+
+uint64_t schema_uint64(const schemaItem *item)
+{
+    const uint8_t *v = item->value;
+    uint64_t val = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        val = val << 8 | v[i];
+
+    return val;
+}
+
+float schema_float(const schemaItem *item)
+{
+    uint32_t bits = schema_uint32(item);
+    float f;
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+int schema_isKey(const schemaItem *item, const char *key)
+{
+    return strncmp(item->key, key, item->keyLen) == 0 && key[item->keyLen] == '\0';
+}
+
+struct schemaIndex
+{
+    /* The whole index, as saved */
+    uint8_t *base;
+    size_t size;
+    int mapped;
+    const schemaIndexHeader *header;
+    const schemaNode *nodes;
+    const uint32_t *table;
+    const char *pool;
+};
+
+typedef struct
+{
+    schemaNode *nodes;
+    uint32_t count;
+    uint32_t cap;
+    char *pool;
+    uint32_t poolLen;
+    uint32_t poolCap;
+    /* Open collections, and the last node seen at each depth */
+    uint32_t open[SCHEMA_DEPTH_MAX];
+    uint32_t last[SCHEMA_DEPTH_MAX + 1];
+    int failed;
+} indexBuild;
+
+/* FNV-1a, continued over '/' and key below the top level */
+static uint32_t pathHash(uint32_t h, int top, const char *key, size_t len)
+{
+    if (!top)
+        h = (h ^ '/') * 16777619U;
+    while (len--)
+        h = (h ^ (uint8_t)*key++) * 16777619U;
+
+    return h;
+}
+
+#define HASH_BASIS 2166136261U
+
+static int poolAdd(indexBuild *b, const void *data, size_t len, uint32_t *off)
+{
+    char *pool;
+    size_t cap;
+
+    if (len >= UINT32_MAX - b->poolLen)
+        return -1;
+    if (b->poolLen + len + 1 > b->poolCap)
+    {
+        for (cap = b->poolCap ? b->poolCap : 4096; cap < b->poolLen + len + 1; cap *= 2)
+            ;
+        if (cap > UINT32_MAX || (pool = realloc(b->pool, cap)) == NULL)
+            return -1;
+        b->pool = pool;
+        b->poolCap = cap;
+    }
+
+    memcpy(b->pool + b->poolLen, data, len);
+    b->pool[b->poolLen + len] = '\0';
+    *off = b->poolLen;
+    b->poolLen += len + 1;
+
+    return 0;
+}
+
+static enum SchemaNext indexAdd(indexBuild *b, const schemaItem *item)
+{
+    uint32_t parent = item->depth ? b->open[item->depth - 1] : SCHEMA_NONE;
+    schemaNode *n;
+
+    if (b->count == b->cap)
+    {
+        uint32_t cap = b->cap ? 2 * b->cap : 256;
+        if (cap > UINT32_MAX / 2 || (n = realloc(b->nodes, cap * sizeof(*n))) == NULL)
+            goto fail;
+        b->nodes = n;
+        b->cap = cap;
+    }
+
+    n = &b->nodes[b->count];
+    n->type = item->type;
+    n->parent = parent;
+    n->first = n->next = SCHEMA_NONE;
+    n->valueLen = item->type == SCHEMA_COLLECTION ? 0 : item->valueLen;
+    n->value = SCHEMA_NONE;
+    n->hash = pathHash(item->depth ? b->nodes[parent].hash : HASH_BASIS, !item->depth, item->key, item->keyLen);
+    if (poolAdd(b, item->key, item->keyLen, &n->key) < 0 ||
+        (item->type != SCHEMA_COLLECTION && poolAdd(b, item->value, item->valueLen, &n->value) < 0))
+        goto fail;
+
+    if (b->last[item->depth] != SCHEMA_NONE)
+        b->nodes[b->last[item->depth]].next = b->count;
+    else if (parent != SCHEMA_NONE)
+        b->nodes[parent].first = b->count;
+    b->last[item->depth] = b->count;
+
+    if (item->type == SCHEMA_COLLECTION)
+    {
+        b->open[item->depth] = b->count;
+        b->last[item->depth + 1] = SCHEMA_NONE;
+    }
+    b->count++;
+
+    return SCHEMA_CONTINUE;
+
+fail:
+    b->failed = 1;
+    return SCHEMA_STOP;
+}
+
+static enum SchemaNext indexVisit(void *ctx, const schemaItem *item, const schemaItem *path)
+{
+    (void)path;
+    return indexAdd(ctx, item);
+}
+
+/* Point index at the parts of its block, -1 if the header doesn't fit it. */
+static int indexMap(schemaIndex *index, char *err, size_t errLen)
+{
+    const schemaIndexHeader *h = (const schemaIndexHeader *)index->base;
+
+    if (index->size < sizeof(*h) || memcmp(h->magic, SCHEMA_INDEX_MAGIC, sizeof(h->magic)) != 0)
+        SCHEMA_ERROR("Not a schema index.");
+    if (h->version != SCHEMA_INDEX_VERSION || h->order != 0x01020304)
+        SCHEMA_ERROR("Schema index version %u, expected %u.", h->version, SCHEMA_INDEX_VERSION);
+    if (h->size != index->size ||
+        h->nodesOff % 4 || h->nodesOff > index->size ||
+        h->nodeCount > (index->size - h->nodesOff) / sizeof(schemaNode) ||
+        h->tableSize == 0 || (h->tableSize & (h->tableSize - 1)) ||
+        h->tableOff % 4 || h->tableOff > index->size ||
+        h->tableSize > (index->size - h->tableOff) / sizeof(uint32_t) ||
+        h->poolOff > index->size || h->poolLen > index->size - h->poolOff ||
+        h->poolLen == 0 || index->base[h->poolOff + h->poolLen - 1] != '\0')
+        SCHEMA_ERROR("Corrupt schema index.");
+
+    index->header = h;
+    index->nodes = (const schemaNode *)(index->base + h->nodesOff);
+    index->table = (const uint32_t *)(index->base + h->tableOff);
+    index->pool = (const char *)index->base + h->poolOff;
+
+    return 0;
+}
+
+schemaIndex *schema_indexBuild(const void *data, size_t size, char *err, size_t errLen)
+{
+    const schemaVisitor visitor = { indexVisit, NULL, indexVisit };
+    indexBuild b;
+    schemaIndex *index = NULL;
+    schemaIndexHeader *h;
+    uint32_t *table, i, slot, tableSize = 1;
+    size_t total;
+
+    memset(&b, 0, sizeof(b));
+    memset(b.last, 0xff, sizeof(b.last));
+
+    if (schema_parse(data, size, &visitor, &b, err, errLen) < 0)
+        goto out;
+    if (b.failed || poolAdd(&b, "", 0, &i) < 0)
+    {
+        if (err)
+            snprintf(err, errLen, "Out of memory.");
+        goto out;
+    }
+
+    while (tableSize < 2 * b.count)
+        tableSize *= 2;
+    total = sizeof(*h) + (size_t)b.count * sizeof(schemaNode) + (size_t)tableSize * sizeof(uint32_t) + b.poolLen;
+    if (total > UINT32_MAX || (index = calloc(1, sizeof(*index))) == NULL ||
+        (index->base = calloc(1, total)) == NULL)
+    {
+        if (err)
+            snprintf(err, errLen, "Out of memory.");
+        free(index);
+        index = NULL;
+        goto out;
+    }
+    index->size = total;
+
+    h = (schemaIndexHeader *)index->base;
+    memcpy(h->magic, SCHEMA_INDEX_MAGIC, sizeof(h->magic));
+    h->version = SCHEMA_INDEX_VERSION;
+    h->order = 0x01020304;
+    h->size = total;
+    h->sourceSize = size;
+    h->nodeCount = b.count;
+    h->nodesOff = sizeof(*h);
+    h->tableSize = tableSize;
+    h->tableOff = h->nodesOff + b.count * sizeof(schemaNode);
+    h->poolLen = b.poolLen;
+    h->poolOff = h->tableOff + tableSize * sizeof(uint32_t);
+
+    memcpy(index->base + h->nodesOff, b.nodes, b.count * sizeof(schemaNode));
+    memcpy(index->base + h->poolOff, b.pool, b.poolLen);
+    table = (uint32_t *)(index->base + h->tableOff);
+    for (i = 0; i < b.count; i++)
+    {
+        for (slot = b.nodes[i].hash & (tableSize - 1); table[slot]; slot = (slot + 1) & (tableSize - 1))
+            ;
+        table[slot] = i + 1;
+    }
+
+    indexMap(index, NULL, 0);
+
+out:
+    free(b.nodes);
+    free(b.pool);
+    return index;
+}
+
+schemaIndex *schema_indexLoad(const char *cache, char *err, size_t errLen)
+{
+    schemaIndex *index;
+    struct stat st;
+    void *data;
+    int fd;
+
+    if ((fd = open(cache, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        if (err)
+            snprintf(err, errLen, "Unable to open %s: %s", cache, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        if (err)
+            snprintf(err, errLen, "Unable to map %s.", cache);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    if ((index = calloc(1, sizeof(*index))) == NULL)
+    {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    index->base = data;
+    index->size = st.st_size;
+    index->mapped = 1;
+    if (indexMap(index, err, errLen) < 0)
+    {
+        schema_indexFree(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+int schema_indexSave(const schemaIndex *index, const char *cache)
+{
+    char tmp[4096];
+    size_t off = 0;
+    ssize_t n;
+    int fd;
+
+    /* Replaced in one go, readers map either the old or the new one. */
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid()) >= sizeof(tmp) ||
+        (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    while (off < index->size && (n = write(fd, index->base + off, index->size - off)) > 0)
+        off += n;
+    if (close(fd) < 0 || off < index->size || rename(tmp, cache) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+schemaIndex *schema_indexFile(const char *path, const char *cache, char *err, size_t errLen)
+{
+    schemaIndex *index;
+    struct stat st;
+    void *data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        SCHEMA_ERROR_NULL("Unable to open %s: %s", path, strerror(errno));
+    }
+
+    if (cache && (index = schema_indexLoad(cache, NULL, 0)) != NULL)
+    {
+        if (index->header->sourceSize == (uint64_t)st.st_size && index->header->sourceMtime == st.st_mtime)
+        {
+            close(fd);
+            return index;
+        }
+        schema_indexFree(index);
+    }
+
+    data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+        SCHEMA_ERROR_NULL("Unable to map %s: %s", path, strerror(errno));
+
+    index = schema_indexBuild(data, st.st_size, err, errLen);
+    if (data)
+        munmap(data, st.st_size);
+
+    if (index)
+    {
+        ((schemaIndexHeader *)index->base)->sourceMtime = st.st_mtime;
+        if (cache)
+            schema_indexSave(index, cache);
+    }
+
+    return index;
+}
+
+void schema_indexFree(schemaIndex *index)
+{
+    if (!index)
+        return;
+
+    if (index->mapped)
+        munmap(index->base, index->size);
+    else
+        free(index->base);
+    free(index);
+}
+
+static inline const schemaNode *nodeAt(const schemaIndex *index, uint32_t i)
+{
+    return i < index->header->nodeCount ? &index->nodes[i] : NULL;
+}
+
+static inline const char *poolStr(const schemaIndex *index, uint32_t off)
+{
+    /* The pool ends with a NUL */
+    return off < index->header->poolLen ? index->pool + off : "";
+}
+
+/* Whether node's full key path is path[0..len) */
+static int isPath(const schemaIndex *index, const schemaNode *node, const char *path, size_t len)
+{
+    const char *key, *start;
+    size_t keyLen, depth;
+
+    for (depth = 0; node && depth < SCHEMA_DEPTH_MAX; depth++)
+    {
+        key = poolStr(index, node->key);
+        keyLen = strlen(key);
+        for (start = path + len; start > path && start[-1] != '/'; start--)
+            ;
+        if ((size_t)(path + len - start) != keyLen || memcmp(start, key, keyLen) != 0)
+            return 0;
+
+        if (node->parent == SCHEMA_NONE)
+            return start == path;
+        if (start == path)
+            return 0;
+        len = start - path - 1;
+        node = nodeAt(index, node->parent);
+    }
+
+    return 0;
+}
+
+const schemaNode *schema_find(const schemaIndex *index, const char *path)
+{
+    const char *key = path, *end;
+    uint32_t h = HASH_BASIS, mask = index->header->tableSize - 1, slot, i;
+    const schemaNode *node;
+    size_t len = strlen(path);
+
+    for (end = key; ; end++)
+    {
+        if (*end == '/' || *end == '\0')
+        {
+            h = pathHash(h, key == path, key, end - key);
+            if (*end == '\0')
+                break;
+            key = end + 1;
+        }
+    }
+
+    for (slot = h & mask, i = 0; index->table[slot] && i <= mask; slot = (slot + 1) & mask, i++)
+    {
+        node = nodeAt(index, index->table[slot] - 1);
+        if (node && node->hash == h && isPath(index, node, path, len))
+            return node;
+    }
+
+    return NULL;
+}
+
+/* Nodes are in file order, children and siblings come after node. Links
+ * that don't are corrupt and would loop. */
+static inline const schemaNode *linkAt(const schemaIndex *index, const schemaNode *node, uint32_t i)
+{
+    return i > (uint32_t)(node - index->nodes) ? nodeAt(index, i) : NULL;
+}
+
+const schemaNode *schema_first(const schemaIndex *index, const schemaNode *node)
+{
+    if (!node)
+        return nodeAt(index, 0);
+    return node->type == SCHEMA_COLLECTION ? linkAt(index, node, node->first) : NULL;
+}
+
+const schemaNode *schema_next(const schemaIndex *index, const schemaNode *node)
+{
+    return linkAt(index, node, node->next);
+}
+
+int schema_item(const schemaIndex *index, const schemaNode *node, schemaItem *item)
+{
+    const schemaNode *p;
+    size_t depth = 0;
+
+    memset(item, 0, sizeof(*item));
+    for (p = node; p->parent != SCHEMA_NONE && depth < SCHEMA_DEPTH_MAX; depth++)
+        if ((p = nodeAt(index, p->parent)) == NULL)
+            return 0;
+
+    item->type = node->type;
+    item->depth = depth;
+    item->key = poolStr(index, node->key);
+    item->keyLen = strlen(item->key);
+    if (node->type != SCHEMA_COLLECTION)
+    {
+        /* NUL terminated copies of the values as parsed */
+        size_t len = node->value < index->header->poolLen ?
+            valueLen((const uint8_t *)index->pool, index->header->poolLen, node->value, node->type) : 0;
+
+        if (len == 0 || node->valueLen != len - (node->type == SCHEMA_STRING))
+            return 0;
+        item->value = (const uint8_t *)index->pool + node->value;
+        item->valueLen = node->valueLen;
+    }
+
+    return 1;
+}
@@ -0,0 +1,167 @@
+#ifndef __SCHEMA_H__
+#define __SCHEMA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Steam's binary KeyValues format, as in appcache/stats/UserGameStatsSchema_<appid>.bin.
+ * Standalone, statsread uses it too. */
+
+enum SchemaType
+{
+	SCHEMA_COLLECTION = 0,
+	SCHEMA_STRING,
+	SCHEMA_INT32,
+	SCHEMA_FLOAT,
+	SCHEMA_POINTER,
+	SCHEMA_WSTRING,
+	SCHEMA_COLOR,
+	SCHEMA_UINT64,
+	SCHEMA_END
+};
+
+/* What a visitor wants next */
+enum SchemaNext
+{
+	SCHEMA_CONTINUE,
+	/* Don't report what's in the collection just entered */
+	SCHEMA_SKIP,
+	/* Done, stop parsing */
+	SCHEMA_STOP
+};
+
+/* Nesting deeper than that is taken for a corrupt file. */
+#define SCHEMA_DEPTH_MAX 64
+
+typedef struct
+{
+	enum SchemaType type;
+	/* Depth of the item, 0 for the top level */
+	size_t depth;
+	/* Not terminated, key[keyLen] is the NUL in the data */
+	const char *key;
+	size_t keyLen;
+	/* Undefined for collections. Strings without the NUL. */
+	const uint8_t *value;
+	size_t valueLen;
+	/* Offset into the data */
+	size_t offset;
+} schemaItem;
+
+/* Any callback may be NULL. enter() is called for collections, leave() after
+ * their last item (not for skipped ones), value() for everything else.
+ * path holds the enclosing collections, path[depth - 1] is the parent. */
+typedef struct
+{
+	enum SchemaNext (*enter)(void *ctx, const schemaItem *item, const schemaItem *path);
+	enum SchemaNext (*leave)(void *ctx, const schemaItem *item, const schemaItem *path);
+	enum SchemaNext (*value)(void *ctx, const schemaItem *item, const schemaItem *path);
+} schemaVisitor;
+
+/* Parse size bytes of data in one pass, without allocating. Returns 0 when
+ * done, 1 when a visitor stopped and -1 for corrupt or truncated data,
+ * described in err (if not NULL) then. */
+extern int
+schema_parse(const void *data, size_t size, const schemaVisitor *visitor, void *ctx, char *err, size_t errLen);
+
+/* Same for a file, which is mapped. */
+extern int
+schema_parseFile(const char *path, const schemaVisitor *visitor, void *ctx, char *err, size_t errLen);
+
+/* Values, little endian in the file */
+extern int32_t
+schema_int32(const schemaItem *item);
+
+extern uint32_t
+schema_uint32(const schemaItem *item);
+
+extern uint64_t
+schema_uint64(const schemaItem *item);
+
+extern float
+schema_float(const schemaItem *item);
+
+/* Whether item's key is key */
+extern int
+schema_isKey(const schemaItem *item, const char *key);
+
+/* Index of a parsed schema, by full key path ("440/stats/1/bits/0").
+ *
+ * It is a single block of offsets and indices without pointers, so it can be
+ * saved as is and mapped again as a cache. Lookups are O(1) either way. */
+#define SCHEMA_INDEX_MAGIC "SSSPSCHI"
+#define SCHEMA_INDEX_VERSION 1
+#define SCHEMA_NONE UINT32_MAX
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	/* 0x01020304, refuses caches from the other byte order */
+	uint32_t order;
+	uint64_t size;
+	/* Of the schema it was built from, to tell when it's stale */
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	uint32_t nodeCount;
+	uint32_t nodesOff;
+	/* Power of 2, node indices + 1 */
+	uint32_t tableSize;
+	uint32_t tableOff;
+	uint32_t poolLen;
+	uint32_t poolOff;
+} schemaIndexHeader;
+
+/* Collections and values, in file order. Indices are SCHEMA_NONE if there's
+ * none, strings are pool offsets of NUL terminated copies. */
+typedef struct
+{
+	uint32_t type;
+	uint32_t key;
+	uint32_t value;
+	uint32_t valueLen;
+	uint32_t parent;
+	uint32_t first;
+	uint32_t next;
+	/* Of the full key path */
+	uint32_t hash;
+} schemaNode;
+
+typedef struct schemaIndex schemaIndex;
+
+/* Index size bytes of data, NULL on error, described in err. */
+extern schemaIndex *
+schema_indexBuild(const void *data, size_t size, char *err, size_t errLen);
+
+/* Index a file. With a cache path, the cache is used if it's current and
+ * (re)written if not. */
+extern schemaIndex *
+schema_indexFile(const char *path, const char *cache, char *err, size_t errLen);
+
+/* Map a cache, NULL if it's unusable. */
+extern schemaIndex *
+schema_indexLoad(const char *cache, char *err, size_t errLen);
+
+extern int
+schema_indexSave(const schemaIndex *index, const char *cache);
+
+extern void
+schema_indexFree(schemaIndex *index);
+
+/* The node at path, NULL if there's none */
+extern const schemaNode *
+schema_find(const schemaIndex *index, const char *path);
+
+/* Children of node, NULL when done; node NULL for the top level */
+extern const schemaNode *
+schema_first(const schemaIndex *index, const schemaNode *node);
+
+extern const schemaNode *
+schema_next(const schemaIndex *index, const schemaNode *node);
+
+/* A view of node as parsed, for schema_isKey() and the values; 0 if the
+ * node is corrupt. */
+extern int
+schema_item(const schemaIndex *index, const schemaNode *node, schemaItem *item);
+
+#endif /* __SCHEMA_H__ */
@@ -0,0 +1,277 @@
+/**
+ *
+ * Damage tracked shadow framebuffer of a window.
+ *
+ * Keeps a client side copy of a window's content, which is only updated from
+ * the rectangles the Damage extension reports as changed. Taking a frame is
+ * then a memcpy of an up-to-date buffer instead of a full window transfer,
+ * which pays off for menus or strategy games where little changes per frame.
+ *
+ * A shadow uses the display connection it is created with for the damage
+ * events, so that one shouldn't be the game's. Shadows are registered by
+ * window, so a hotkey capture of the same window can be served from it by
+ * shadow_grab().
+ *
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+
+#include "sssp.h"
+
+/* Above that many rectangles or that part of the window (percent), one
+ * full transfer is cheaper than many small ones. */
+#define SHADOW_MAX_RECTS 64
+#define SHADOW_FULL_PCT 50
+
+struct shadowFb_s
+{
+    pthread_mutex_t lock;
+    struct shadowFb_s *next;
+    Display *dpy;
+    Window win;
+    Damage damage;
+    XserverRegion region;
+    int damageEvent;
+    Bool resized;
+    XImage *fb;
+    uint64_t generation;
+};
+
+static pthread_mutex_t g_shadowsLock = PTHREAD_MUTEX_INITIALIZER;
+static shadowFb *g_shadows = NULL;
+
+shadowFb *shadow_create(Display *dpy, Window win)
+{
+    int error;
+    shadowFb *s;
+
+    if (!lazy_load(LAZY_XDAMAGE) || !lazy_load(LAZY_XFIXES) ||
+        !g_lazy.XDamageQueryExtension(dpy, &error, &error))
+    {
+        log(LOG_WARN, "Damage extension not available, no shadow framebuffer.\n");
+        return NULL;
+    }
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        return NULL;
+
+    g_lazy.XDamageQueryExtension(dpy, &s->damageEvent, &error);
+    s->dpy = dpy;
+    s->win = win;
+    s->resized = True;
+    s->region = g_lazy.XFixesCreateRegion(dpy, NULL, 0);
+    s->damage = g_lazy.XDamageCreate(dpy, win, XDamageReportNonEmpty);
+    XSelectInput(dpy, win, StructureNotifyMask);
+    pthread_mutex_init(&s->lock, NULL);
+
+    pthread_mutex_lock(&g_shadowsLock);
+    s->next = g_shadows;
+    g_shadows = s;
+    pthread_mutex_unlock(&g_shadowsLock);
+
+    log(LOG_INFO, "Shadow framebuffer for window 0x%lx created.\n", win);
+
+    return s;
+}
+
+void shadow_destroy(shadowFb *s)
+{
+    shadowFb **p;
+
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&g_shadowsLock);
+    for (p = &g_shadows; *p; p = &(*p)->next)
+    {
+        if (*p == s)
+        {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_shadowsLock);
+
+    /* Wait for a running shadow_grab() */
+    pthread_mutex_lock(&s->lock);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_destroy(&s->lock);
+
+    g_lazy.XDamageDestroy(s->dpy, s->damage);
+    g_lazy.XFixesDestroyRegion(s->dpy, s->region);
+    XSelectInput(s->dpy, s->win, NoEventMask);
+    if (s->fb)
+        XDestroyImage(s->fb);
+    free(s);
+}
+
+static Bool fullGrab(shadowFb *s)
+{
+    XWindowAttributes attrs;
+
+    if (s->fb)
+    {
+        XDestroyImage(s->fb);
+        s->fb = NULL;
+    }
+
+    if (XGetWindowAttributes(s->dpy, s->win, &attrs) == 0 || attrs.map_state != IsViewable)
+        return False;
+
+    s->fb = XGetImage(s->dpy, s->win, 0, 0, attrs.width, attrs.height, AllPlanes, ZPixmap);
+    metric_add(METRIC_SHADOW_FULL, 1);
+
+    return s->fb != NULL;
+}
+
+/* Apply pending damage. Returns False if the shadow is unusable. Lock held. */
+static Bool update(shadowFb *s)
+{
+    XEvent e;
+    XRectangle *rects;
+    Bool damaged = False;
+    int i, n = 0;
+    size_t area = 0;
+
+    while (XPending(s->dpy))
+    {
+        XNextEvent(s->dpy, &e);
+        if (e.type == s->damageEvent + XDamageNotify)
+            damaged = True;
+        else if (e.type == ConfigureNotify && s->fb &&
+                 (e.xconfigure.width != s->fb->width || e.xconfigure.height != s->fb->height))
+            s->resized = True;
+        else if (e.type == DestroyNotify)
+            return False;
+    }
+
+    if (s->resized || !s->fb)
+    {
+        /* Drop what's damaged so far, it's all grabbed anew. */
+        g_lazy.XDamageSubtract(s->dpy, s->damage, None, None);
+        s->resized = False;
+        __atomic_add_fetch(&s->generation, 1, __ATOMIC_RELAXED);
+        return fullGrab(s);
+    }
+
+    if (!damaged)
+        return True;
+
+    g_lazy.XDamageSubtract(s->dpy, s->damage, None, s->region);
+    rects = g_lazy.XFixesFetchRegion(s->dpy, s->region, &n);
+
+    for (i = 0; i < n; i++)
+        area += rects[i].width * rects[i].height;
+
+    if (n > SHADOW_MAX_RECTS || area * 100 > (size_t)s->fb->width * s->fb->height * SHADOW_FULL_PCT)
+    {
+        XFree(rects);
+        __atomic_add_fetch(&s->generation, 1, __ATOMIC_RELAXED);
+        return fullGrab(s);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        XRectangle r = rects[i];
+
+        /* Clip to the shadow, damage may extend past a shrinking window. */
+        if (r.x >= s->fb->width || r.y >= s->fb->height)
+            continue;
+        if (r.x + r.width > s->fb->width)
+            r.width = s->fb->width - r.x;
+        if (r.y + r.height > s->fb->height)
+            r.height = s->fb->height - r.y;
+
+        if (!XGetSubImage(s->dpy, s->win, r.x, r.y, r.width, r.height, AllPlanes, ZPixmap, s->fb, r.x, r.y))
+        {
+            XFree(rects);
+            s->resized = True;
+            return False;
+        }
+    }
+
+    if (rects)
+        XFree(rects);
+
+    if (n)
+    {
+        __atomic_add_fetch(&s->generation, 1, __ATOMIC_RELAXED);
+        metric_add(METRIC_SHADOW_RECTS, n);
+        metric_add(METRIC_SHADOW_PIXELS, area);
+    }
+
+    return True;
+}
+
+Bool shadow_update(shadowFb *s)
+{
+    Bool rc;
+
+    pthread_mutex_lock(&s->lock);
+    rc = update(s);
+    pthread_mutex_unlock(&s->lock);
+
+    return rc;
+}
+
+/* Access the current content, shadow_unlock() when done with it. */
+const XImage *shadow_lock(shadowFb *s)
+{
+    pthread_mutex_lock(&s->lock);
+    return s->fb;
+}
+
+void shadow_unlock(shadowFb *s)
+{
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Changes whenever the content did. */
+uint64_t shadow_generation(shadowFb *s)
+{
+    return __atomic_load_n(&s->generation, __ATOMIC_RELAXED);
+}
+
+/* Copy of the up-to-date content of win, if a shadow is tracking it. */
+XImage *shadow_grab(Window win)
+{
+    shadowFb *s;
+    XImage *image = NULL;
+    char *data;
+
+    pthread_mutex_lock(&g_shadowsLock);
+    for (s = g_shadows; s && s->win != win; s = s->next)
+        ;
+    /* Updated by an idle priority worker, which may be starved: the
+     * backend is quicker than waiting for it. */
+    if (s && pthread_mutex_trylock(&s->lock))
+        s = NULL;
+    pthread_mutex_unlock(&g_shadowsLock);
+
+    if (!s)
+        return NULL;
+
+    if (update(s) && (data = malloc(s->fb->bytes_per_line * s->fb->height)) != NULL)
+    {
+        memcpy(data, s->fb->data, s->fb->bytes_per_line * s->fb->height);
+        image = XCreateImage(s->dpy, NULL, s->fb->depth, ZPixmap, 0, data,
+                s->fb->width, s->fb->height, s->fb->bitmap_pad, s->fb->bytes_per_line);
+        if (image)
+        {
+            image->red_mask = s->fb->red_mask;
+            image->green_mask = s->fb->green_mask;
+            image->blue_mask = s->fb->blue_mask;
+            metric_add(METRIC_SHADOW_GRABS, 1);
+        }
+        else
+        {
+            free(data);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return image;
+}
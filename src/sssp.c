@@ -9,7 +9,6 @@
  */
 #include <dlfcn.h>
 #include <link.h>
-#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,9 +16,6 @@
 #include <time.h>
 #include <unistd.h>
 #include <X11/XKBlib.h>
-#include <X11/extensions/Xcomposite.h>
-#include <X11/extensions/Xdamage.h>
-#include <X11/extensions/Xrender.h>
 
 #include "steam_sdk.h"
 #include "sssp.h"
@@ -30,9 +26,12 @@ hookFunc g_realSteamAPI_InitSafe;
 hookPFunc g_realXCheckIfEvent;
 hookPFunc g_realXCreateWindow;
 hookPFunc g_realXEventsQueued;
+hookPFunc g_realXGrabKeyboard;
+hookPFunc g_realXUngrabKeyboard;
 hookPFunc g_realXLookupString;
 hookPCPFunc g_realXOpenDisplay;
 hookPFunc g_realXPending;
+hookVPFunc g_realGlXSwapBuffers;
 
 hookPPFunc g_realDlsym = NULL;
 
@@ -49,29 +48,54 @@ static Display *g_xDisplay;
 static KeyCode g_xKeyCodeF11;
 static KeyCode g_xKeyCodeF12;
 
+/**
+ *
+ * Pool jobs.
+ *
+ */
+
+static void screenshotJob(void *arg);
+static void hideFeedbackJob(void *arg);
+static void warmJob(void *arg);
+
 /* Screenshot handling */
-timer_t g_screenshotTimer;
+static poolJob g_screenshotJob = POOL_JOB(screenshotJob, NULL);
 static Window g_shotWin = 0;
+static Bool g_burstDefault = False;
+static Bool g_burstPending = False;
+/* Average time a WriteScreenshot call takes (ns) */
+static uint64_t g_shotWriteNs = 0;
+/* Directory for PNG screenshots (deep ones and without steam) */
+static const char *g_pngDir = NULL;
 
 /* User feedback (aka thumb view) */
-timer_t g_userFbTimer;
-static Window g_userFbWin = 0;
-static XWindowAttributes g_oldFbAttrs;
+static poolJob g_hideFeedbackJob = POOL_JOB(hideFeedbackJob, NULL);
+
+/* Automatic shots on achievement unlocks, of the window the game last got
+ * input or focus in. Its capture is prepared when it changes. */
+static Bool g_achievementShot = False;
+static Display *g_targetDpy = NULL;
+static Window g_targetWin = None;
+static poolJob g_warmJob = POOL_JOB(warmJob, NULL);
 
 /* Internal duplicate loading check */
 extern Bool ssspRunning;
 Bool ssspRunning = False;
+/* Set once init() finished, until then (and for filtered processes) the
+ * hooks only pass calls through. So do the X11/GL hooks on pool workers,
+ * those calls are sssp's own. */
+static Bool g_active = False;
 
 enum LogLevel g_logLevel = DFLT_LOG_LEVEL;
 
-/**
- *
- * Timer handlers.
- *
- */
+/* Exported hooks libX11's headers don't declare */
+extern Bool SteamAPI_Init(void);
+extern Bool SteamAPI_InitSafe(void);
+extern void glXSwapBuffers(Display *dpy, XID drawable);
 
 static void doScreenShot(Display *dpy, Window win);
-static void screenshotTimerHandler(union sigval val UNUSED)
+static void writeScreenShot(void *image, int w, int h, uint64_t hash);
+static void screenshotJob(void *arg UNUSED)
 {
     if (g_shotWin)
     {
@@ -80,19 +104,15 @@ static void screenshotTimerHandler(union sigval val UNUSED)
     }
 }
 
-static void userFbTimerHandler(union sigval val UNUSED)
+static void hideFeedbackJob(void *arg UNUSED)
 {
-    // FIXME this seriously needs locking...
-    if (g_userFbWin)
-    {
-        log(LOG_WARN, "Unmappnig window: dpy=%p win=%x\n", g_xDisplay, g_userFbWin);
-        /* FIXME handle error (BadWindow?) */
-        /* Disappears on next repaint of parent */
-        XUnmapWindow(g_xDisplay, g_userFbWin);
-        /* Try to trigger repaint by flushing events */
-        XFlush(g_xDisplay);
-        usleep(50000);
-    }
+    feedback_hide();
+}
+
+static void warmJob(void *arg UNUSED)
+{
+    if (g_targetWin)
+        capture_warm(g_targetDpy, g_targetWin);
 }
 
 /**
@@ -136,44 +156,54 @@ p_cb(struct dl_phdr_info *info, size_t size, void *data)
 static Bool findDlSym(void)
 {
 #ifdef _GNU_SOURCE
+    /* dlsym moved from libdl into libc with glibc 2.34, libdl.so.2 is only
+     * a stub there. */
+    static const char *const libs[] = { "libc.so.6", "libdl.so.2" };
     ElfW(Sym) *sym;
-    ElfW(Addr) base = 0, strTab = 0, symTab = 0;
-    struct link_map *dli = NULL;
-
-    void *mm = dlopen("libdl.so.2", RTLD_NOW);
-    if (dlinfo(mm, RTLD_DI_LINKMAP, &dli) == 0 && dli)
-        base = dli->l_addr;
+    ElfW(Addr) base, strTab, symTab;
+    struct link_map *dli;
+    size_t i;
 
-    if (base)
+    for (i = 0; i < sizeof(libs) / sizeof(libs[0]) && !g_realDlsym; i++)
     {
-        for (ElfW(Dyn) *dyn = dli->l_ld; dyn->d_tag != DT_NULL; ++dyn)
+        void *mm = dlopen(libs[i], RTLD_NOW);
+
+        base = strTab = symTab = 0;
+        dli = NULL;
+        if (mm && dlinfo(mm, RTLD_DI_LINKMAP, &dli) == 0 && dli)
+            base = dli->l_addr;
+
+        if (base)
         {
-            switch (dyn->d_tag)
+            for (ElfW(Dyn) *dyn = dli->l_ld; dyn->d_tag != DT_NULL; ++dyn)
             {
-                case DT_STRTAB:
-                    strTab = dyn->d_un.d_ptr;
-                    break;
-                case DT_SYMTAB:
-                    symTab = dyn->d_un.d_ptr;
-                    break;
+                switch (dyn->d_tag)
+                {
+                    case DT_STRTAB:
+                        strTab = dyn->d_un.d_ptr;
+                        break;
+                    case DT_SYMTAB:
+                        symTab = dyn->d_un.d_ptr;
+                        break;
+                }
             }
-        }
 
-        for (sym = (ElfW(Sym) *)symTab; sym < (ElfW(Sym) *)strTab; sym++)
-        {
-            log(LOG_DEBUG, "sym: %s\n", (char *)(strTab + sym->st_name));
-            if (strncmp((char *)(strTab + sym->st_name), "dlsym", 5) == 0)
+            for (sym = (ElfW(Sym) *)symTab; sym < (ElfW(Sym) *)strTab; sym++)
             {
-                g_realDlsym = (hookPPFunc)(base + sym->st_value);
-                log(LOG_INFO, "real dlsym: %p\n", g_realDlsym);
-                break;
+                if (sym->st_shndx != SHN_UNDEF && strcmp((char *)(strTab + sym->st_name), "dlsym") == 0)
+                {
+                    g_realDlsym = (hookPPFunc)(base + sym->st_value);
+                    log(LOG_INFO, "real dlsym: %p (%s)\n", g_realDlsym, libs[i]);
+                    break;
+                }
             }
         }
-    }
 
-    //dl_iterate_phdr(p_cb, NULL);
+        //dl_iterate_phdr(p_cb, NULL);
 
-    dlclose(mm);
+        if (mm)
+            dlclose(mm);
+    }
 #else
     log(LOG_ERROR, "No dlsym hooking possible. Expect issues.\n");
     g_realDlsym = (hookPPFunc)dlsym;
@@ -181,6 +211,77 @@ static Bool findDlSym(void)
     return g_realDlsym != NULL;
 }
 
+/* Resolve what the hooks forward to, without side effects. Done for every
+ * process, filtered ones included. Hooks into libraries loaded later on
+ * (GL, steam_api) are resolved on first use. */
+static Bool findReal(void)
+{
+    if (!findDlSym())
+        return False;
+
+    g_realXCheckIfEvent = (hookPFunc)g_realDlsym(RTLD_NEXT, "XCheckIfEvent");
+    g_realXCreateWindow = (hookPFunc)g_realDlsym(RTLD_NEXT, "XCreateWindow");
+    g_realXEventsQueued = (hookPFunc)g_realDlsym(RTLD_NEXT, "XEventsQueued");
+    g_realXGrabKeyboard = (hookPFunc)g_realDlsym(RTLD_NEXT, "XGrabKeyboard");
+    g_realXLookupString = (hookPFunc)g_realDlsym(RTLD_NEXT, "XLookupString");
+    g_realXOpenDisplay = (hookPCPFunc)g_realDlsym(RTLD_NEXT, "XOpenDisplay");
+    g_realXPending = (hookPFunc)g_realDlsym(RTLD_NEXT, "XPending");
+    g_realXUngrabKeyboard = (hookPFunc)g_realDlsym(RTLD_NEXT, "XUngrabKeyboard");
+    g_realGlXSwapBuffers = (hookVPFunc)g_realDlsym(RTLD_NEXT, "glXSwapBuffers");
+    g_realSteamAPI_Init = (hookFunc)g_realDlsym(RTLD_NEXT, "SteamAPI_Init");
+    g_realSteamAPI_InitSafe = (hookFunc)g_realDlsym(RTLD_NEXT, "SteamAPI_InitSafe");
+
+    return True;
+}
+
+/* Take over the GOT entries of the loaded objects, instead of relying on
+ * the exported hooks. */
+static void hookGot(void)
+{
+    static const gotHook xHooks[] =
+    {
+        { "XCheckIfEvent", XCheckIfEvent, (void **)&g_realXCheckIfEvent },
+        { "XCreateWindow", XCreateWindow, (void **)&g_realXCreateWindow },
+        { "XEventsQueued", XEventsQueued, (void **)&g_realXEventsQueued },
+        { "XGrabKeyboard", XGrabKeyboard, (void **)&g_realXGrabKeyboard },
+        { "XLookupString", XLookupString, (void **)&g_realXLookupString },
+        { "XOpenDisplay", XOpenDisplay, (void **)&g_realXOpenDisplay },
+        { "XPending", XPending, (void **)&g_realXPending },
+        { "XUngrabKeyboard", XUngrabKeyboard, (void **)&g_realXUngrabKeyboard },
+    };
+    static const gotHook steamHooks[] =
+    {
+        { "SteamAPI_Init", SteamAPI_Init, (void **)&g_realSteamAPI_Init },
+        { "SteamAPI_InitSafe", SteamAPI_InitSafe, (void **)&g_realSteamAPI_InitSafe },
+    };
+    static const gotHook swapHooks[] =
+    {
+        { "glXSwapBuffers", glXSwapBuffers, (void **)&g_realGlXSwapBuffers },
+    };
+
+    log(LOG_NOTICE, "Installing hooks into the GOT.\n");
+
+    /* The hotkey is needed all the time, steam until it's set up, the GL
+     * swap only while burst or replay capture. */
+    got_require(GOT_X);
+    got_require(GOT_STEAM);
+    got_register(GOT_X, xHooks, sizeof(xHooks) / sizeof(xHooks[0]));
+    got_register(GOT_STEAM, steamHooks, sizeof(steamHooks) / sizeof(steamHooks[0]));
+    got_register(GOT_SWAP, swapHooks, sizeof(swapHooks) / sizeof(swapHooks[0]));
+}
+
+/* Whether this is the LD_AUDIT instance (audit.c), loaded into a namespace
+ * of its own. */
+static Bool isAuditor(void)
+{
+    struct link_map *self = NULL;
+    Dl_info info;
+    Lmid_t lmid = LM_ID_BASE;
+
+    return dladdr1((void *)isAuditor, &info, (void **)&self, RTLD_DL_LINKMAP) && self &&
+        dlinfo(self, RTLD_DI_LMID, &lmid) == 0 && lmid != LM_ID_BASE;
+}
+
 /* Initialization */
 __attribute__((constructor)) static void init(void)
 {
@@ -193,26 +294,34 @@ __attribute__((constructor)) static void init(void)
 
     // @todo relapath the program to find path
 
-    if (
-            // Don't hook into shells
-            strncmp(program_invocation_name, "sh", 2) == 0 ||
-            strncmp(program_invocation_name, "bash", 4) == 0 ||
-            strncmp(program_invocation_name, "zsh", 3) == 0 ||
-            // System paths /bin, /sbin are filtered
-            strncmp(program_invocation_name, "/bin", 4) == 0 ||
-            strncmp(program_invocation_name, "/sbin", 5) == 0 ||
-            // Steam executables are filtered
-            strncmp(program_invocation_short_name, "steam", 5) == 0 ||
-            strncmp(program_invocation_short_name, "steamwebhelper", 14) == 0 ||
-            strncmp(program_invocation_short_name, "streaming_client", 16) == 0
-    )
+    /* The auditor only needs dlsym to pass through, the preloaded instance
+     * does the work. */
+    if (isAuditor())
+    {
+        findDlSym();
+        return;
+    }
+
+    /* Filtered processes keep running in pass-through mode. */
+    if (!findReal())
+    {
+        log(LOG_ERROR, "Unable to set up dlsym hook. Won't work this way. "
+                "Please disable this module from being LD_PRELOAD'ed.\n");
+        return;
+    }
+
+    /* Disabled by the user, or filtered by the rules */
+    if (cfg_getLong("DISABLE", 0))
+        return;
+
+    rules_init();
+    if (!rules_allowed(program_invocation_name, program_invocation_short_name, getenv("SteamAppId")))
         return;
 
 
     log(LOG_NOTICE, "sssp_xy.so loaded into program '%s' (%s).\n",
             program_invocation_short_name, program_invocation_name);
 
-    /* TODO blacklist steam* executables */
     /* TODO don't do anything if gameoverlayrenderer.so is loaded? */
 
     if (ssspRunning)
@@ -223,20 +332,6 @@ __attribute__((constructor)) static void init(void)
 
     ssspRunning = True;
 
-    if (!findDlSym())
-    {
-        log(LOG_ERROR, "Unable to set up dlsym hook. Won't work this way. "
-                "Please disable this module from being LD_PRELOAD'ed.\n");
-        return;
-    }
-
-    g_realXCheckIfEvent = (hookPFunc)findHook(NULL, "XCheckIfEvent");
-    g_realXCreateWindow = (hookPFunc)findHook(NULL, "XCreateWindow");
-    g_realXEventsQueued = (hookPFunc)findHook(NULL, "XEventsQueued");
-    g_realXLookupString = (hookPFunc)findHook(NULL, "XLookupString");
-    g_realXOpenDisplay = (hookPCPFunc)findHook(NULL, "XOpenDisplay");
-    g_realXPending = (hookPFunc)findHook(NULL, "XPending");
-
     if (!g_realXCheckIfEvent ||
         !g_realXCreateWindow ||
         !g_realXEventsQueued ||
@@ -249,24 +344,29 @@ __attribute__((constructor)) static void init(void)
         return;
     }
 
-    struct sigevent sevp;
-    sevp.sigev_notify = SIGEV_THREAD;
-    sevp.sigev_value.sival_ptr = &g_userFbTimer;
-    sevp.sigev_notify_function = userFbTimerHandler;
-    sevp.sigev_notify_attributes = NULL;
-    int rc = timer_create(CLOCK_MONOTONIC, &sevp, &g_userFbTimer);
-    if (rc)
-        log(LOG_ERROR, "timer_create(g_userFbTimer): %s\n", strerror(errno));
-
-    sevp.sigev_notify_function = screenshotTimerHandler;
-    sevp.sigev_notify_attributes = NULL;
-    timer_create(CLOCK_MONOTONIC, &sevp, &g_screenshotTimer);
-    if (rc)
-        log(LOG_ERROR, "timer_create(g_screenshotTimer): %s\n", strerror(errno));
-
-    /* Init X11 thread support */
+    /* Init X11 thread support, before anything may open a display: the
+     * workers connect from the start. */
     XInitThreads();
 
+    /* Everything in the background runs on it */
+    pool_init();
+    g_achievementShot = cfg_getLong("ACHIEVEMENT_SHOT", 0);
+
+    budget_init();
+    backend_init();
+    capture_init();
+    dedup_init();
+    replay_init();
+    burst_init(writeScreenShot);
+    g_burstDefault = cfg_getLong("BURST", 0);
+    g_pngDir = cfg_getStr("PNG_DIR", NULL);
+    /* Steam puts the app id into the environment of games it starts */
+    client_init(getenv("SteamAppId") ? strtoul(getenv("SteamAppId"), NULL, 10) : 0);
+
+    g_active = True;
+    if (strcmp(cfg_getStr("HOOK_MODE", "preload"), "got") == 0)
+        hookGot();
+
     log(LOG_NOTICE, "sssp_xy.so initialized.\n");
 }
 
@@ -279,8 +379,9 @@ __attribute__((destructor)) static void deinit(void)
         log(LOG_NOTICE, "sssp_xy.so being unloaded from program '%s' (%s).\n",
                 program_invocation_short_name, program_invocation_name);
 
-        if (g_userFbTimer)
-            timer_delete(g_userFbTimer);
+        pool_cancel(&g_hideFeedbackJob);
+
+        metrics_log(LOG_NOTICE);
     }
 }
 
@@ -290,328 +391,214 @@ __attribute__((destructor)) static void deinit(void)
  *
  */
 
-static inline uint8_t mask32To8(uint32_t val, uint32_t mask)
+static void handleScreenShot(Display *dpy, Window win)
 {
-    switch (mask)
+    /* Bursts run on their own thread, just hand over the window. */
+    if (g_burstPending)
     {
-        case 0xFF:
-            return (val & mask);
-        case 0xFF00:
-            return (val & mask) >> 8;
-        case 0xFF0000:
-            return (val & mask) >> 16;
-        case 0xFF000000:
-            return (val & mask) >> 24;
+        g_burstPending = False;
+        if (!burst_request(win))
+            log(LOG_WARN, "Burst already running, request ignored.\n");
+        return;
     }
-    return 0;
+
+    /* The capture daemon does all the work, if there is one. */
+    if (client_request(win))
+        return;
+
+    g_xDisplay = dpy;
+    g_shotWin = win;
+
+    log(LOG_NOTICE, "%s()\n", __FUNCTION__);
+
+    if (!pool_schedule(&g_screenshotJob, 0))
+        log(LOG_ERROR, "No worker to take the screenshot on.\n");
 }
 
-/* Acquire/write Screenshot */
-static void *captureScreenShot(Display *dpy, Window *win, int *w, int *h)
+/* Save an RGB image with depth bits per channel as PNG into g_pngDir. */
+static void writePng(const void *image, int w, int h, int depth)
 {
-    XWindowAttributes attrs, cattrs;
-    Window c, p;
-    uint8_t *data;
-    int dx = -1, dy = -1;
-    int i;
-    XImage *image;
-
-    if (XGetWindowAttributes(dpy, *win, &attrs) == 0)
-    {
-        log(LOG_ERROR, "failed to acquire window attributes!");
-        return NULL;
-    }
+    static uint32_t count = 0;
+    char path[512];
+    char date[20];
+    const time_t t = time(NULL);
+    struct tm lt;
 
-    /* Can't directly use win, because SDL1 does have three windows, but only
-     * one for the content. Instead we translate from the root window and
-     * let X hand us the appropriate mapped child window that's probably the
-     * one we want. */
-    c = p = attrs.root;
-    while (1/*dx != 0 || dy != 0*/)
-    {
-        if (!XTranslateCoordinates(dpy, *win, p, 0, 0, &dx, &dy, &c) ||
-            c == None || XGetWindowAttributes(dpy, c, &cattrs) == 0 ||
-            cattrs.height < attrs.height || cattrs.width < attrs.width)
-        {
-            break;
-        }
+    localtime_r(&t, &lt);
+    strftime(date, sizeof(date), "%F_%H%M%S", &lt);
 
-        log(LOG_INFO, "XTranslateCoordinates: %d/%d %d/%d 0x%lx %d/%d\n", attrs.x, attrs.y, attrs.width, attrs.height, c, dx, dy);
-        p = c;
-    }
+    /* PNG_DIR/appID_2015-02-24_213012_00002.png */
+    snprintf(path, sizeof(path), "%s/%u_%s_%05u.png", g_pngDir, (unsigned int)g_steamAppID.appId, date,
+            __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED));
+
+    if (png_write(path, image, w, h, depth))
+        log(LOG_NOTICE, "Screenshot saved to '%s' (%d bit).\n", path, depth);
+}
+
+/* Issue an RGB image directly to steam. A deep (16 bit per channel) copy, if
+ * there's one, goes to the PNG directory. */
+static void submitScreenShot(void *image, const uint16_t *deep, int w, int h, uint64_t hash)
+{
+    struct timespec t0, t1;
+    uint64_t ns;
 
-    /* Update win to the one we grab from and we can display the feedback in. */
-    *win = p;
-    /* TODO switch to XRenderCreatePicture */
-    if ((image = XGetImage(dpy, *win, 0, 0, attrs.width, attrs.height, AllPlanes, ZPixmap)) == NULL)
+    if (dedup_isDuplicate(hash, w, h))
     {
-        log(LOG_ERROR, "failed to acquire window screenshot!");
-        return NULL;
+        log(LOG_NOTICE, "Screenshot identical to a recent one (hash %016jx), skipped: "
+                "saved %d bytes and ~%.1f ms.\n", (uintmax_t)hash, 3 * w * h, g_shotWriteNs / 1e6);
+        metric_add(METRIC_DEDUP_SKIPPED, 1);
+        metric_add(METRIC_DEDUP_SAVED_BYTES, 3 * w * h);
+        metric_add(METRIC_DEDUP_SAVED_US, g_shotWriteNs / 1000);
+        return;
     }
 
-    log(LOG_NOTICE, "Grabbed image of window 0x%lx (size %dx%d, depth %d).\n", *win, image->width, image->height, image->depth);
+    if (deep && g_pngDir)
+        writePng(deep, w, h, 16);
 
-    /* Convert to plain RGB as required by steam. */
-    *h = attrs.height;
-    *w = attrs.width;
-    data = (uint8_t *)malloc(3 * *w * *h);
+    if (g_steamInitialized)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (!g_steamIScreenshot->vtab->WriteScreenshot(g_steamIScreenshot, image, 3 * w * h, w, h))
+            log(LOG_ERROR, "Failed to issue screenshot to steam.\n");
+        clock_gettime(CLOCK_MONOTONIC, &t1);
 
-    /* TrueColor (which we assume) has got 4 bytes per pixel. */
-    /* TODO assert depth */
-    for (i = 0; i < *w * *h; i++)
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+        g_shotWriteNs = g_shotWriteNs ? (3 * g_shotWriteNs + ns) / 4 : ns;
+    }
+    else if (g_pngDir)
     {
-        uint32_t p = *(uint32_t *)(image->data + 4 * i);
-        data[3 * i + 0] = mask32To8(p, image->red_mask);
-        data[3 * i + 1] = mask32To8(p, image->green_mask);
-        data[3 * i + 2] = mask32To8(p, image->blue_mask);
+        /* Without steam the PNG is all there is */
+        if (!deep)
+            writePng(image, w, h, 8);
+    }
+    else
+    {
+        log(LOG_ERROR, "Steam not initialized and no SSSP_PNG_DIR set, no screenshot saved.\n");
     }
-
-    XDestroyImage(image);
-
-    return (void *)data;
 }
 
-static void handleScreenShot(Display *dpy, Window win)
+static void writeScreenShot(void *image, int w, int h, uint64_t hash)
 {
-    g_xDisplay = dpy;
-    g_shotWin = win;
-
-    struct itimerspec tval;
-    tval.it_value.tv_sec = 0;
-    tval.it_value.tv_nsec = 10000;
-    tval.it_interval.tv_sec = 0;
-    tval.it_interval.tv_nsec = 0;
+    submitScreenShot(image, NULL, w, h, hash);
+}
 
-    log(LOG_NOTICE, "%s()\n", __FUNCTION__);
+/* Hand a screenshot file written by the capture daemon to steam. */
+static void addScreenShotFile(const char *path, int w, int h)
+{
+    if (!g_steamInitialized)
+    {
+        log(LOG_NOTICE, "Screenshot saved to '%s'.\n", path);
+        return;
+    }
 
-    int rc = timer_settime(g_screenshotTimer, 0, &tval, NULL);
-    if (rc)
-        log(LOG_ERROR, "timer_settime(g_screenshotTimer): %s\n", strerror(errno));
+    if (!g_steamIScreenshot->vtab->AddScreenshotToLibrary(g_steamIScreenshot, path, NULL, w, h))
+        log(LOG_ERROR, "Failed to add screenshot '%s' to steam.\n", path);
 }
 
 static void doScreenShot(Display *dpy, Window win)
 {
-    /* User feedback size */
     int w, h;
     XWindowAttributes attrs;
-    union sigval unused;
+    budgetSlot slot = { 0 };
+    uint64_t hash = 0;
+    uint16_t *deep = NULL;
 
     log(LOG_NOTICE, "doScreenShot(%p, 0x%lx)\n", dpy, win);
 
     /* Hide feedback window */
-    userFbTimerHandler(unused);
+    hideFeedbackJob(NULL);
 
     /* Image grabbed through X11 and converted to RGB */
-    void *image = captureScreenShot(dpy, &win, &w, &h);
+    void *image = capture_grab(dpy, &win, &w, &h, &slot, &hash, g_pngDir ? &deep : NULL);
     if (!image)
+    {
+        budget_release(&slot);
         return;
+    }
 
     /* User feedback */
     if (XGetWindowAttributes(dpy, win, &attrs) != 0)
     {
-        const int fbb = 2, fbh = 100, fbw = fbh * (attrs.width * 1.0 / attrs.height);
-        double s = (1.0 * fbh) / attrs.height;
-        XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, attrs.visual);
-
-        /* Hide thumb if it's there */
-        if (g_userFbWin)
-        {
-#if 0
-            /* Issue damage notification, since we're going to capture it again right now */
-            XserverRegion reg = XFixesCreateRegionFromWindow(dpy, g_userFbWin, 0);
-            XDamageAdd(dpy, win, reg);
-            XDamageAdd(dpy, g_userFbWin, reg);
-            XFixesDestroyRegion(dpy, reg);
-#endif
-
-            /* And destroy on size change */
-            if (attrs.width != g_oldFbAttrs.width || attrs.height != g_oldFbAttrs.height)
-            {
-                log(LOG_NOTICE, "XDestroyWindow(g_userFbWin)\n");
-                XDestroyWindow(dpy, g_userFbWin);
-                g_userFbWin = 0;
-            }
-        }
-
-        XFlush(dpy);
-
-        /* (Re-)init if needed */
-        if (!g_userFbWin)
-        {
-            g_userFbWin = XCreateSimpleWindow(dpy, win,
-                    attrs.width - fbw - fbb - fbb, attrs.height - fbh - fbb - fbb, fbw, fbh,
-                    fbb, 0x45323232, 0);
-            g_oldFbAttrs = attrs;
-        }
+        feedback_show(dpy, win, &attrs, image, w, h);
 
-        /* Redirect src and thumb window to offscreen */
-        XCompositeRedirectWindow(dpy, win, CompositeRedirectAutomatic);
-        XCompositeRedirectWindow(dpy, g_userFbWin, CompositeRedirectAutomatic);
-        /* Save a reference to the current pixmap */
-        Pixmap pix = XCompositeNameWindowPixmap(dpy, win);
-        Picture picture = XRenderCreatePicture(dpy, pix, fmt, 0, 0);
-        /* Scale to the thumb size */
-        XTransform scale = {{{XDoubleToFixed(1), 0, 0}, {0, XDoubleToFixed(1), 0}, {0, 0, XDoubleToFixed(s)}}};
-        XRenderSetPictureTransform(dpy, picture, &scale);
-
-        /* Xrender target for thumb */
-        Picture pic2 = XRenderCreatePicture(dpy, g_userFbWin, fmt, 0, 0);
-        XMapWindow(dpy, g_userFbWin);
-
-        /* Compose into the thumb window */
-        XRenderComposite(dpy, PictOpSrc, picture, None, pic2, 0, 0, 0, 0, 0, 0, fbw, fbh);
-        /* Free */
-        XRenderFreePicture(dpy, picture);
-        XRenderFreePicture(dpy, pic2);
-        XCompositeUnredirectWindow(dpy, win, CompositeRedirectAutomatic);
-        XCompositeUnredirectWindow(dpy, g_userFbWin, CompositeRedirectAutomatic);
-
-        /* Start unmap timer */
+        /* Hide it again in 5 s */
         g_xDisplay = dpy;
-        struct itimerspec tval;
-        tval.it_value.tv_sec = 5;
-        tval.it_value.tv_nsec = 0;
-        tval.it_interval.tv_sec = 0;
-        tval.it_interval.tv_nsec = 0;
-        int rc = timer_settime(g_userFbTimer, 0, &tval, NULL);
-        if (rc)
-            log(LOG_ERROR, "timer_settime(g_userFbTimer): %s\n", strerror(errno));
+        pool_schedule(&g_hideFeedbackJob, 5000000000ULL);
     }
 
-    /* Issue the RGB image directly to steam. */
-    if (g_steamInitialized)
+    /* Frames from the instant replay ring are older, so they go first. */
+    replay_submit(writeScreenShot);
+
+    if (budget_isDropped(&slot))
     {
-        if (!g_steamIScreenshot->vtab->WriteScreenshot(g_steamIScreenshot, image, 3 * w * h, w, h))
-            log(LOG_ERROR, "Failed to issue screenshot to steam.\n");
+        log(LOG_WARN, "Capture dropped due to memory budget, no screenshot saved.\n");
     }
     else
     {
-        // TODO
-        log(LOG_ERROR, "Steam not initialized, no screenshot saved.\n");
-#if 0
-        /* Hand made fallback disabled in favour of Steam's screenshot writer. */
-        static uint32_t count = 0;
-        char path[512];
-        char date[11];
-        const time_t t = time(NULL);
-        struct tm lt;
-
-        localtime_r(&t, &lt);
-        strftime(date, sizeof(date), "%F", &lt);
-        count++;
-
-        /* STEAM_DIR/userdata/accountID/760/remote/appID/screenshots/2015-02-24_00002.jpg */
-        snprintf(path, sizeof(path), "%s/userdata/%d/760/remote/%d/screenshots/%s_%05d.jpg",
-                SteamAPI_GetSteamInstallPath(), g_steamUserID.asComponent.accountID,
-                g_steamAppID, date, count);
-        log(LOG_INFO, "screenshot file: '%s'\n", path);
-
-        /* TODO mkdir -p */
-#endif
-
+        submitScreenShot(image, deep, w, h, hash);
     }
+
     free(image);
+    free(deep);
+    budget_release(&slot);
+    metrics_log(LOG_INFO);
 }
 
-extern void doStatsUpdate()
+/* Remember the window for automatic shots and prepare its capture off the
+ * game's thread, so the shot on an unlock is just the grab. */
+static void setTarget(Display *dpy, Window win)
 {
-    if (!g_steamIUserStats)
+    if (win == g_targetWin)
         return;
 
-#if USE_OLD_USERSTATS
-    if (g_steamIUserStats->vtab->RequestCurrentStats(g_steamIUserStats, g_steamAppID))
-    {
-        uint32_t scount = g_steamIUserStats->vtab->GetNumStats(g_steamIUserStats, g_steamAppID);
-        uint32_t i = 0;
+    g_targetDpy = dpy;
+    g_targetWin = win;
+    pool_schedule(&g_warmJob, 0);
+}
 
-        while (scount && i++ < scount - 1)
-        {
-            const char *sname = g_steamIUserStats->vtab->GetStatName(g_steamIUserStats, g_steamAppID, i);
-            log(LOG_NOTICE, "stats[%d].sname: %s\n", i, sname);
-            Bool sachieved = False;
-            uint32_t tstamp = 0;
-            if (g_steamIUserStats->vtab->GetAchievementAndUnlockTime(g_steamIUserStats, g_steamAppID, sname, &sachieved, &tstamp))
-            {
-                log(LOG_NOTICE, "stats[%d].achieved: %d\n", i, sachieved);
-                if (sachieved)
-                    log(LOG_NOTICE, "stats[%d].tsamp: 0x%x\n", i, tstamp);
-            }
+/* Called from SteamAPI_RunCallbacks() in the game's loop, so the shot is
+ * queued within the frame the achievement was unlocked in. */
+static void achievementUnlocked(const char *name)
+{
+    if (!g_achievementShot)
+        return;
 
-            int32_t sdata = -1;
-            if (g_steamIUserStats->vtab->GetStat(g_steamIUserStats, g_steamAppID, sname, &sdata))
-            {
-                log(LOG_NOTICE, "stats[%d].data: 0x%x\n", i, sdata);
-            }
-        }
-    }
-#else
-    if (g_steamIUserStats->vtab->RequestCurrentStats(g_steamIUserStats))
+    if (!g_targetWin)
     {
-    return;
-        uint32_t scount = g_steamIUserStats->vtab->GetNumAchievements(g_steamIUserStats);
-        uint32_t i = 0;
-        while (scount && i++ < scount - 1)
-        {
-            const char *sname = g_steamIUserStats->vtab->GetAchievementName(g_steamIUserStats, i);
-            log(LOG_NOTICE, "stats[%d].sname: %s\n", i, sname);
-            log(LOG_NOTICE, "NAME: %s\n", g_steamIUserStats->vtab->GetAchievementDisplayAttribute(g_steamIUserStats, sname, "name"));
-            log(LOG_NOTICE, "DESC: %s\n", g_steamIUserStats->vtab->GetAchievementDisplayAttribute(g_steamIUserStats, sname, "desc"));
-            Bool sachieved = False;
-            uint32_t tstamp = 0;
-            if (g_steamIUserStats->vtab->GetAchievementAndUnlockTime(g_steamIUserStats, sname, &sachieved, &tstamp))
-            {
-                log(LOG_NOTICE, "stats[%d].achieved: %d\n", i, sachieved);
-                if (sachieved) {
-                    log(LOG_NOTICE, "stats[%d].tsamp: 0x%x\n", i, tstamp);
-                    continue;
-                }
-            }
-
-            // FIXME this needs the api stat name, not the achievement name :/
-            int32_t stat = 0;
-            float statf = 0.0;
-            Bool ret = 0;
-            Bool ach = 0;
-            ret = g_steamIUserStats->vtab->GetAchievement(g_steamIUserStats, sname, &ach);
-            log(LOG_NOTICE, "RET: %d\n", ret);
-            ret = g_steamIUserStats->vtab->GetStat(g_steamIUserStats, sname, &stat);
-            log(LOG_NOTICE, "RET: %d\n", ret);
-            ret = g_steamIUserStats->vtab->GetStatF(g_steamIUserStats, sname, &statf);
-            log(LOG_NOTICE, "RET: %d\n", ret);
-            log(LOG_NOTICE, "ACH: %d\n", ach);
-            log(LOG_NOTICE, "STATD: %d\n", stat);
-            log(LOG_NOTICE, "STATF: %f\n", statf);
-            int32_t sdata = -1;
-            if (g_steamIUserStats->vtab->GetStat(g_steamIUserStats, sname, &sdata))
-            {
-                log(LOG_NOTICE, "stats[%d].data: %x\n", i, sdata);
-            }
-        }
+        log(LOG_WARN, "No window for the shot of achievement '%s' yet.\n", name);
+        return;
     }
-#endif
+
+    log(LOG_NOTICE, "Achievement '%s' unlocked, taking a screenshot.\n", name);
+    handleScreenShot(g_targetDpy, g_targetWin);
 }
 
 /* Filter XEvent */
-static Bool filter(Display *dpy UNUSED, XEvent *event, XPointer arg UNUSED)
+static Bool filter(Display *dpy, XEvent *event, XPointer arg UNUSED)
 {
     XKeyEvent *ke = NULL;
     Bool rc = False;
     static Time t = 0;
 
+    if (g_achievementShot &&
+        (event->type == KeyPress || event->type == ButtonPress || event->type == FocusIn))
+        setTarget(dpy, event->xany.window);
+
     if (event->type == KeyPress /*|| event->type == KeyRelease*/)
     {
         log(LOG_INFO, "key press/release\n");
 
         ke = (XKeyEvent *)event;
-        if (!ke->send_event && !(ke->state & 0xFF/* kbd modifiers */))
+        replay_setTarget(ke->window);
+        /* No kbd modifiers, except shift selecting a burst */
+        if (!ke->send_event && !(ke->state & 0xFF & ~ShiftMask))
         {
             log(LOG_INFO, "got keycode: 0x%x\n", ke->keycode);
-            if (ke->keycode == g_xKeyCodeF11)
+            if (ke->keycode == g_xKeyCodeF11 && !(ke->state & ShiftMask))
             {
                 log(LOG_NOTICE, "Stats key recognized\n");
                 rc = False;
-                /* TODO delay/call through thread */
-                doStatsUpdate();
+                stats_show();
             }
             else if (ke->keycode == g_xKeyCodeF12)
             {
@@ -620,7 +607,8 @@ static Bool filter(Display *dpy UNUSED, XEvent *event, XPointer arg UNUSED)
                 {
                     t = ke->time;
                     rc = True;
-                    log(LOG_NOTICE, "Screenshot key recognized\n");
+                    g_burstPending = g_burstDefault || (ke->state & ShiftMask);
+                    log(LOG_NOTICE, "Screenshot key recognized%s\n", g_burstPending ? " (burst)" : "");
                 }
                 else
                     log(LOG_WARN, "Screenshot key skipped due to flooding (<50ms)\n");
@@ -635,6 +623,12 @@ static Bool handleRequest(Display *dpy)
 {
     XEvent e;
 
+    /* The game's event loop, the pool keeps off its CPU */
+    pool_noteGame(POOL_GAME_MAIN);
+
+    /* Shots the capture daemon finished */
+    client_poll(addScreenShotFile);
+
     if (!g_steamInitialized)
         return False;
 
@@ -663,7 +657,6 @@ static Bool steamPrepare(void)
 
     return True;
 }
-void called() { log(LOG_WARN, "run()\n"); exit(2);}
 /* Grab the various handles from the interfaces. Actually userid and appid aren't needed. */
 static void steamSetup(void)
 {
@@ -672,18 +665,6 @@ static void steamSetup(void)
     ISteamUser *su;
     ISteamUtils *sut;
 
-    struct {
-        void (*run)();
-        void (*run2)();
-        int32_t id;
-        uint8_t m_nCallbackFlags;
-        int m_iCallback;
-    } ccb;
-    ccb.id = 1101;
-    ccb.run = called; 
-    ccb.run2 = called; 
-    SteamAPI_RegisterCallback(&ccb, 1101);
-
     sc = SteamClient();
 
     if (!sc)
@@ -738,9 +719,7 @@ static void steamSetup(void)
         return;
     }
 
-#if 1
-    doStatsUpdate();
-#endif
+    stats_init(g_steamIUserStats, g_steamAppID.appId, g_steamUserID.as64Bit, achievementUnlocked);
 
 #if 0
     Bool b;
@@ -810,6 +789,8 @@ static void steamSetup(void)
 #endif
 
     g_steamInitialized = True;
+    /* SteamAPI_Init* hooks aren't needed anymore */
+    got_release(GOT_STEAM);
 }
 
 /**
@@ -821,6 +802,9 @@ extern Display *XOpenDisplay(const char *name)
 {
     Display *dpy;
 
+    if (!g_active || pool_isWorker())
+        return (Display *)g_realXOpenDisplay(name);
+
     log(LOG_DEBUG, "%s(%s)\n", __FUNCTION__, name);
 
     dpy = (Display *)g_realXOpenDisplay(name);
@@ -844,12 +828,18 @@ extern Display *XOpenDisplay(const char *name)
 // Fake keyboard grabbing to be able to switch windows.
 extern int XGrabKeyboard(Display *dpy, Window win, Bool oe, int pm, int km, Time t)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXGrabKeyboard(dpy, win, oe, pm, km, t);
+
     log(LOG_DEBUG, "%s(%p, 0x%lx, %d, 0x%x, 0x%x, 0x%lx)\n", __FUNCTION__, dpy, win, oe, pm, km, t);
     return GrabSuccess;
 }
 // Reverse for the above.
 extern int XUngrabKeyboard(Display *dpy, Time t)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXUngrabKeyboard(dpy, t);
+
     log(LOG_DEBUG, "%s(%p, 0x%lx)\n", __FUNCTION__, dpy, t);
     return GrabSuccess;
 }
@@ -900,6 +890,9 @@ Window XCreateWindow(
     unsigned long valuemask,
     XSetWindowAttributes *attributes)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXCreateWindow(display, parent, x, y, width, height, border_width, depth, class, visual, valuemask, attributes);
+
     // I want my windows window manager managed...
     // https://specifications.freedesktop.org/wm-spec/wm-spec-1.3.html
     if (attributes)
@@ -917,6 +910,9 @@ extern Bool XCheckIfEvent(Display *dpy, XEvent *event_return,
 {
     Bool r;
 
+    if (!g_active || pool_isWorker())
+        return g_realXCheckIfEvent(dpy, event_return, predicate, arg);
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
 
     // Check for our key interception first
@@ -930,6 +926,9 @@ extern Bool XCheckIfEvent(Display *dpy, XEvent *event_return,
 
 extern int XEventsQueued(Display *dpy, int mode)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXEventsQueued(dpy, mode);
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
     handleRequest(dpy);
     log(LOG_DEBUG, "%s() calling real\n", __FUNCTION__);
@@ -941,6 +940,9 @@ extern int XEventsQueued(Display *dpy, int mode)
 extern int XLookupString(XKeyEvent *ke, char *bufret, int bufsiz,
         KeySym *keysym, XComposeStatus *status_in_out)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXLookupString(ke, bufret, bufsiz, keysym, status_in_out);
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
     if (filter(ke->display, (XEvent *)ke, NULL))
     {
@@ -955,6 +957,9 @@ extern int XLookupString(XKeyEvent *ke, char *bufret, int bufsiz,
 
 extern int XPending(Display *dpy)
 {
+    if (!g_active || pool_isWorker())
+        return g_realXPending(dpy);
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
     handleRequest(dpy);
     log(LOG_DEBUG, "%s() calling real\n", __FUNCTION__);
@@ -963,10 +968,41 @@ extern int XPending(Display *dpy)
     return rc;
 }
 
+/* Lets the GL capture backend read the back buffer before it's shown. */
+extern void glXSwapBuffers(Display *dpy, XID drawable)
+{
+    if (!g_active || pool_isWorker())
+    {
+        if (!g_realGlXSwapBuffers)
+            g_realGlXSwapBuffers = (hookVPFunc)g_realDlsym(RTLD_NEXT, "glXSwapBuffers");
+        if (g_realGlXSwapBuffers)
+            g_realGlXSwapBuffers(dpy, drawable);
+        return;
+    }
+
+    log(LOG_DEBUG, "%s()\n", __FUNCTION__);
+
+    if (!g_realGlXSwapBuffers)
+        g_realGlXSwapBuffers = (hookVPFunc)findHook(NULL, "glXSwapBuffers");
+
+    pool_noteGame(POOL_GAME_RENDER);
+    backend_glSwap(dpy, drawable);
+
+    if (g_realGlXSwapBuffers)
+        g_realGlXSwapBuffers(dpy, drawable);
+}
+
 extern Bool SteamAPI_Init(void)
 {
     Bool r;
 
+    if (!g_active || pool_isWorker())
+    {
+        if (!g_realSteamAPI_Init)
+            g_realSteamAPI_Init = (hookFunc)g_realDlsym(RTLD_NEXT, "SteamAPI_Init");
+        return g_realSteamAPI_Init ? g_realSteamAPI_Init() : False;
+    }
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
 
     if (g_steamInitialized)
@@ -987,6 +1023,13 @@ extern Bool SteamAPI_InitSafe(void)
 {
     Bool r;
 
+    if (!g_active || pool_isWorker())
+    {
+        if (!g_realSteamAPI_InitSafe)
+            g_realSteamAPI_InitSafe = (hookFunc)g_realDlsym(RTLD_NEXT, "SteamAPI_InitSafe");
+        return g_realSteamAPI_InitSafe ? g_realSteamAPI_InitSafe() : False;
+    }
+
     log(LOG_DEBUG, "%s()\n", __FUNCTION__);
 
     if (g_steamInitialized)
@@ -1006,6 +1049,9 @@ extern Bool SteamAPI_InitSafe(void)
 #ifdef _GNU_SOURCE
 extern void *dlsym(void *handle, const char *symbol)
 {
+    if (!g_active)
+        return g_realDlsym ? g_realDlsym(handle, symbol) : NULL;
+
     log(LOG_DEBUG, "%s(%p, %s)\n", __FUNCTION__, handle, symbol);
 
     /* Redirect these symbols through our ones */
@@ -1023,7 +1069,8 @@ extern void *dlsym(void *handle, const char *symbol)
         strcmp(symbol, "XRaiseWindow") == 0 ||
         strcmp(symbol, "XReparentWindow") == 0 ||
         strcmp(symbol, "XUngrabKeyboard") == 0 ||
-        strcmp(symbol, "XUngrabPointer") == 0
+        strcmp(symbol, "XUngrabPointer") == 0 ||
+        strcmp(symbol, "glXSwapBuffers") == 0
     )
     {
         handle = NULL;
@@ -1043,108 +1090,5 @@ extern void *dlsym(void *handle, const char *symbol)
     return sym;
 }
 
-#if 1 //USE_LA_AUDIT
-
-/*
-uintptr_t la_symbind64(Elf64_Sym *sym, unsigned int ndx,
-        uintptr_t *refcook, uintptr_t *defcook,
-        unsigned int *flags, const char *symname)
-{
-    log(LOG_INFO, "%s()\n", __FUNCTION__);
-    return sym->st_value;
-}
-*/
-
-unsigned int
-la_version(unsigned int version)
-{
-    log(LOG_INFO, "la_version(): %d\n", version);
-
-    return version;
-}
-
-char *
-la_objsearch(const char *name, uintptr_t *cookie, unsigned int flag)
-{
-    log(LOG_INFO, "la_objsearch(): name = %s; cookie = %p", name, cookie);
-    log(LOG_INFO, "; flag = %s\n",
-            (flag == LA_SER_ORIG) ?    "LA_SER_ORIG" :
-            (flag == LA_SER_LIBPATH) ? "LA_SER_LIBPATH" :
-            (flag == LA_SER_RUNPATH) ? "LA_SER_RUNPATH" :
-            (flag == LA_SER_DEFAULT) ? "LA_SER_DEFAULT" :
-            (flag == LA_SER_CONFIG) ?  "LA_SER_CONFIG" :
-            (flag == LA_SER_SECURE) ?  "LA_SER_SECURE" :
-            "???");
-
-    return (char *)name;
-}
-
-void
-la_activity (uintptr_t *cookie, unsigned int flag)
-{
-    log(LOG_INFO, "la_activity(): cookie = %p; flag = %s\n", cookie,
-            (flag == LA_ACT_CONSISTENT) ? "LA_ACT_CONSISTENT" :
-            (flag == LA_ACT_ADD) ?        "LA_ACT_ADD" :
-            (flag == LA_ACT_DELETE) ?     "LA_ACT_DELETE" :
-            "???");
-}
-
-
-void
-la_preinit(uintptr_t *cookie)
-{
-    log(LOG_INFO, "la_preinit(): %p\n", cookie);
-}
-
-unsigned int
-la_objopen(struct link_map *map, Lmid_t lmid, uintptr_t *cookie)
-{
-    log(LOG_INFO, "la_objopen(): loading \"%s\"; lmid = %s; cookie=%p\n",
-            map->l_name,
-            (lmid == LM_ID_BASE) ?  "LM_ID_BASE" :
-            (lmid == LM_ID_NEWLM) ? "LM_ID_NEWLM" :
-            "???",
-            cookie);
-
-    return LA_FLG_BINDTO | LA_FLG_BINDFROM;
-}
-
-unsigned int
-la_objclose (uintptr_t *cookie)
-{
-    log(LOG_INFO, "la_objclose(): %p\n", cookie);
-
-    return 0;
-}
-
-
-/*
-uintptr_t
-la_symbind32(Elf32_Sym *sym, unsigned int ndx, uintptr_t *refcook,
-        uintptr_t *defcook, unsigned int *flags, const char *symname)
-{
-    log(LOG_INFO, "la_symbind32(): symname = %s; sym->st_value = %p\n",
-            symname, sym->st_value);
-    log(LOG_INFO, "        ndx = %d; flags = 0x%x", ndx, *flags);
-    log(LOG_INFO, "; refcook = %p; defcook = %p\n", refcook, defcook);
-
-    return sym->st_value;
-}
-
-uintptr_t
-la_symbind64(Elf64_Sym *sym, unsigned int ndx, uintptr_t *refcook,
-        uintptr_t *defcook, unsigned int *flags, const char *symname)
-{
-    log(LOG_INFO, "la_symbind64(): symname = %s; sym->st_value = %p\n",
-            symname, sym->st_value);
-    log(LOG_INFO, "        ndx = %d; flags = 0x%x", ndx, *flags);
-    log(LOG_INFO, "; refcook = %p; defcook = %p\n", refcook, defcook);
-
-    return sym->st_value;
-}
-*/
-
-#endif /* USE_LA_AUDIT */
-
 #endif
 
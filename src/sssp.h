@@ -4,6 +4,11 @@
 #include <errno.h>
 #include <stdint.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xrender.h>
+#include <zlib.h>
 
 #define CPPSTR(s) #s
 #define ISTEAMERROR(i, v) "ERROR: " #i " is NULL! " \
@@ -32,6 +37,9 @@ typedef void (*hookVPFunc)(void *, ...);
 typedef void *(*hookPPFunc)(void *, ...);
 typedef void *(*hookPCPFunc)(const void *, ...);
 
+/* Screenshot submission, hash is the content's hash64() */
+typedef void (*submitFunc)(void *rgb, int w, int h, uint64_t hash);
+
 
 /* Logging */
 #ifndef DFLT_LOG_LEVEL
@@ -70,4 +78,456 @@ extern void
 log_dolog(enum LogLevel ll, const char *func,
 		const uint32_t line, const char *format, ...);
 
+
+/* Configuration (environment variables prefixed with SSSP_) */
+extern long
+cfg_getLong(const char *name, long dflt);
+
+extern const char *
+cfg_getStr(const char *name, const char *dflt);
+
+
+/* Metrics */
+enum Metric
+{
+	METRIC_MEM_DROP_NEWEST,
+	METRIC_MEM_DROP_OLDEST,
+	METRIC_MEM_DOWNSCALE,
+	METRIC_MEM_PEAK,
+	METRIC_REPLAY_FRAMES,
+	METRIC_REPLAY_BYTES,
+	METRIC_REPLAY_CPU_US,
+	METRIC_REPLAY_THROTTLED,
+	METRIC_REPLAY_SUBMITTED,
+	METRIC_REPLAY_UNCHANGED,
+	METRIC_SHADOW_FULL,
+	METRIC_SHADOW_RECTS,
+	METRIC_SHADOW_PIXELS,
+	METRIC_SHADOW_GRABS,
+	METRIC_BURST_FRAMES,
+	METRIC_BURST_SKIPPED,
+	METRIC_DEDUP_SKIPPED,
+	METRIC_DEDUP_SAVED_BYTES,
+	METRIC_DEDUP_SAVED_US,
+	METRIC_BACKEND_PROBES,
+	METRIC_BACKEND_FALLBACKS,
+	METRIC_BACKEND_XGETIMAGE,
+	METRIC_BACKEND_XSHM,
+	METRIC_BACKEND_COMPOSITE,
+	METRIC_BACKEND_GL,
+	METRIC_GOT_PATCHES,
+	METRIC_GOT_US,
+	METRIC_STATS_REFRESHES,
+	METRIC_STATS_US,
+	METRIC_STATS_CALLS,
+	METRIC_STATS_UNLOCKS,
+	METRIC_STATS_UPDATES,
+	METRIC_POOL_JOBS,
+
+	METRIC_MAX
+};
+
+extern void
+metric_add(enum Metric m, uint64_t val);
+
+extern void
+metric_max(enum Metric m, uint64_t val);
+
+extern uint64_t
+metric_get(enum Metric m);
+
+extern void
+metrics_log(enum LogLevel ll);
+
+
+/* Memory budget for in-flight captures */
+#define CAPTURE_BAND_ROWS 64
+
+typedef struct budgetSlot_s
+{
+	size_t bytes;
+	Bool dropped;
+	struct budgetSlot_s *next;
+} budgetSlot;
+
+extern void
+budget_init(void);
+
+extern int
+budget_reserveCapture(budgetSlot *slot, int w, int h);
+
+extern Bool
+budget_reserveBytes(budgetSlot *slot, size_t bytes);
+
+extern void
+budget_shrink(budgetSlot *slot, size_t bytes);
+
+extern Bool
+budget_grow(budgetSlot *slot, size_t bytes);
+
+extern void
+budget_release(budgetSlot *slot);
+
+extern Bool
+budget_isDropped(budgetSlot *slot);
+
+
+/* Content hashing */
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * 8)
+
+typedef struct
+{
+	uint64_t acc[HASH_LANES];
+	uint8_t buf[HASH_STRIPE];
+	size_t buffered;
+	uint64_t total;
+	unsigned int stripes;
+} hashState;
+
+extern void
+hash_init(hashState *h);
+
+extern void
+hash_update(hashState *h, const void *data, size_t len);
+
+extern uint64_t
+hash_final(hashState *h);
+
+extern uint64_t
+hash64(const void *data, size_t len);
+
+
+/* Capturing */
+extern void
+capture_init(void);
+
+extern Window
+capture_findWindow(Display *dpy, Window win, XWindowAttributes *attrs);
+
+extern void
+capture_warm(Display *dpy, Window win);
+
+extern void
+capture_convert(const XImage *image, uint8_t *data, int w, int h, int scale, hashState *hash);
+
+extern Bool
+capture_isDeep(const XImage *image);
+
+extern void
+capture_convertDeep(const XImage *image, uint16_t *deep, uint8_t *data, int w, int h, hashState *hash);
+
+extern void *
+capture_grab(Display *dpy, Window *win, int *w, int *h, budgetSlot *slot, uint64_t *hash, uint16_t **deep);
+
+
+/* LZ compression */
+extern size_t
+lz_bound(size_t size);
+
+extern size_t
+lz_compress(const void *src, size_t size, void *dst, size_t cap);
+
+extern size_t
+lz_decompress(const void *src, size_t size, void *dst, size_t cap);
+
+
+/* Duplicate suppression */
+extern void
+dedup_init(void);
+
+extern Bool
+dedup_isDuplicate(uint64_t hash, int w, int h);
+
+
+/* Damage tracked shadow framebuffer */
+typedef struct shadowFb_s shadowFb;
+
+extern shadowFb *
+shadow_create(Display *dpy, Window win);
+
+extern void
+shadow_destroy(shadowFb *s);
+
+extern Bool
+shadow_update(shadowFb *s);
+
+extern const XImage *
+shadow_lock(shadowFb *s);
+
+extern void
+shadow_unlock(shadowFb *s);
+
+extern uint64_t
+shadow_generation(shadowFb *s);
+
+extern XImage *
+shadow_grab(Window win);
+
+
+/* Worker pool for the background work. Jobs are owned by the caller and
+ * (re)scheduled like one-shot timers, func runs on a worker. Background jobs
+ * run at idle priority, so they may only do CPU work and use sssp's own X
+ * connections: nothing the game's threads could wait for. */
+typedef void (*poolFunc)(void *arg);
+
+typedef struct poolJob
+{
+	poolFunc func;
+	void *arg;
+	Bool background;
+	/* The pool's, requests from any thread */
+	uint64_t request;
+	Bool posted;
+	struct poolJob *postedNext;
+	/* The pool's, the workers' queue */
+	uint64_t due;
+	Bool queued;
+	Bool running;
+	struct poolJob *next;
+} poolJob;
+
+#define POOL_JOB(func, arg) { (func), (arg), False, 0, False, NULL, 0, False, False, NULL }
+#define POOL_BACKGROUND_JOB(func, arg) { (func), (arg), True, 0, False, NULL, 0, False, False, NULL }
+
+/* The game's threads the workers keep off */
+enum PoolGameThread
+{
+	POOL_GAME_MAIN,
+	POOL_GAME_RENDER,
+	POOL_GAME_MAX
+};
+
+extern void
+pool_init(void);
+
+extern Bool
+pool_schedule(poolJob *job, uint64_t delayNs);
+
+extern void
+pool_cancel(poolJob *job);
+
+extern void
+pool_noteGame(enum PoolGameThread thread);
+
+extern Bool
+pool_isWorker(void);
+
+
+/* Instant replay */
+extern void
+replay_init(void);
+
+extern void
+replay_setTarget(Window win);
+
+extern void
+replay_submit(submitFunc submit);
+
+
+/* Burst capture */
+extern void
+burst_init(submitFunc submit);
+
+extern Bool
+burst_request(Window win);
+
+/* Capture backends */
+extern void
+backend_init(void);
+
+extern XImage *
+backend_grab(Display *dpy, Window win, const XWindowAttributes *attrs);
+
+extern void
+backend_release(XImage *image);
+
+extern void
+backend_glSwap(Display *dpy, XID drawable);
+
+/* Trap X errors on dpy instead of exiting, until backend_untrapErrors(),
+ * which tells whether there were any. One trap at a time process wide. */
+extern void
+backend_trapErrors(Display *dpy);
+
+extern Bool
+backend_untrapErrors(Display *dpy);
+
+/* PNG writing */
+extern Bool
+png_write(const char *path, const void *data, int w, int h, int depth);
+
+/* Downscaling */
+extern Bool
+scale_box(const uint8_t *src, int sw, int sh, uint8_t *dst, int dw, int dh);
+
+/* Thumbnail feedback */
+extern void
+feedback_show(Display *dpy, Window win, const XWindowAttributes *attrs, const void *rgb, int w, int h);
+
+extern void
+feedback_hide(void);
+
+/* Capture daemon protocol. A client sends a daemonHello over the socket and
+ * receives the ring's memfd and the request eventfd (SCM_RIGHTS) in return.
+ * Both rings are single producer/single consumer: the client produces
+ * requests, the daemon replies. */
+#define DAEMON_MAGIC 0x73737370
+#define DAEMON_VERSION 1
+#define DAEMON_RING_SLOTS 16
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t appId;
+	char display[64];
+} daemonHello;
+
+typedef struct
+{
+	uint32_t seq;
+	uint32_t flags;
+	uint64_t window;
+} daemonRequest;
+
+typedef struct
+{
+	uint32_t seq;
+	/* 1 saved to path, 0 failed, -1 duplicate of a recent one */
+	int32_t ok;
+	int32_t w, h;
+	char path[256];
+} daemonReply;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t reqHead, reqTail;
+	uint32_t repHead, repTail;
+	daemonRequest req[DAEMON_RING_SLOTS];
+	daemonReply rep[DAEMON_RING_SLOTS];
+} daemonRing;
+
+extern const char *
+ipc_socketPath(char *buf, size_t len);
+
+/* Capture daemon client */
+extern Bool
+client_init(uint32_t appId);
+
+extern Bool
+client_request(Window win);
+
+typedef void (*fileSubmitFunc)(const char *path, int w, int h);
+
+extern void
+client_poll(fileSubmitFunc submit);
+
+/* GOT hook installer */
+enum GotGroup
+{
+	/* X11 entry points the hotkey handling needs */
+	GOT_X,
+	/* SteamAPI_Init*, until steam is set up */
+	GOT_STEAM,
+	/* glXSwapBuffers, for the GL capture backend */
+	GOT_SWAP,
+
+	GOT_MAX
+};
+
+typedef struct
+{
+	const char *name;
+	void *hook;
+	/* What the hook forwards to, entries are left alone while NULL */
+	void **real;
+} gotHook;
+
+extern void
+got_register(enum GotGroup group, const gotHook *hooks, int count);
+
+extern void
+got_require(enum GotGroup group);
+
+extern void
+got_release(enum GotGroup group);
+
+/* Process rules */
+extern void
+rules_init(void);
+
+extern Bool
+rules_allowed(const char *path, const char *name, const char *appId);
+
+/* Achievement cache, userStats is the ISteamUserStats interface. unlocked
+ * is called from the game's thread as soon as steam reports an unlock. */
+typedef void (*unlockFunc)(const char *name);
+
+extern void
+stats_init(void *userStats, uint32_t appId, uint64_t userId, unlockFunc unlocked);
+
+extern void
+stats_show(void);
+
+/* Libraries only needed for capturing, dlopen()ed on first use so that
+ * processes the preload ignores don't pay for loading them. Call sites check
+ * lazy_load() before using the g_lazy entry points of that library. */
+enum LazyLib
+{
+	LAZY_XEXT,
+	LAZY_XCOMPOSITE,
+	LAZY_XDAMAGE,
+	LAZY_XFIXES,
+	LAZY_XRENDER,
+	LAZY_ZLIB,
+
+	LAZY_MAX
+};
+
+#define LAZY_FUNCS(F) \
+	F(LAZY_XEXT, XShmQueryExtension) \
+	F(LAZY_XEXT, XShmCreateImage) \
+	F(LAZY_XEXT, XShmAttach) \
+	F(LAZY_XEXT, XShmDetach) \
+	F(LAZY_XEXT, XShmGetImage) \
+	F(LAZY_XCOMPOSITE, XCompositeQueryExtension) \
+	F(LAZY_XCOMPOSITE, XCompositeQueryVersion) \
+	F(LAZY_XCOMPOSITE, XCompositeRedirectWindow) \
+	F(LAZY_XCOMPOSITE, XCompositeUnredirectWindow) \
+	F(LAZY_XCOMPOSITE, XCompositeNameWindowPixmap) \
+	F(LAZY_XDAMAGE, XDamageQueryExtension) \
+	F(LAZY_XDAMAGE, XDamageCreate) \
+	F(LAZY_XDAMAGE, XDamageDestroy) \
+	F(LAZY_XDAMAGE, XDamageSubtract) \
+	F(LAZY_XFIXES, XFixesCreateRegion) \
+	F(LAZY_XFIXES, XFixesDestroyRegion) \
+	F(LAZY_XFIXES, XFixesFetchRegion) \
+	F(LAZY_XRENDER, XRenderQueryExtension) \
+	F(LAZY_XRENDER, XRenderFindVisualFormat) \
+	F(LAZY_XRENDER, XRenderCreatePicture) \
+	F(LAZY_XRENDER, XRenderFreePicture) \
+	F(LAZY_XRENDER, XRenderSetPictureTransform) \
+	F(LAZY_XRENDER, XRenderSetPictureFilter) \
+	F(LAZY_XRENDER, XRenderComposite) \
+	F(LAZY_ZLIB, crc32) \
+	F(LAZY_ZLIB, deflateInit_) \
+	F(LAZY_ZLIB, deflate) \
+	F(LAZY_ZLIB, deflateEnd)
+
+#define LAZY_MEMBER(lib, name) __typeof__(name) *name;
+typedef struct
+{
+	LAZY_FUNCS(LAZY_MEMBER)
+} lazyFuncs;
+#undef LAZY_MEMBER
+
+extern lazyFuncs g_lazy;
+
+extern Bool
+lazy_load(enum LazyLib lib);
+
 #endif /* __SSSP_H__ */
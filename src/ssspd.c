@@ -0,0 +1,467 @@
+/**
+ *
+ * ssspd: capture daemon for sssp_xy.so.
+ *
+ * Owns the X connections, grabbing, conversion, PNG encoding and disk I/O,
+ * so none of that, nor its memory, lives in the game process. Each game
+ * (client) connects to the UNIX socket and gets a shared memory ring
+ * (memfd) plus an eventfd for its requests; finished shots are written to
+ * SSSP_PNG_DIR and their path is put into the reply ring, from where the
+ * game hands them to steam. One daemon serves any number of games, requests
+ * are processed one at a time.
+ *
+ * Configured through the same SSSP_* variables as the library.
+ *
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sssp.h"
+
+#define DAEMON_MAX_EVENTS 16
+
+enum LogLevel g_logLevel = DFLT_LOG_LEVEL;
+
+/* epoll data tells listener, client socket and client eventfd apart */
+typedef struct
+{
+    enum { SRC_LISTEN, SRC_SOCKET, SRC_EVENT } type;
+    struct daemonClient_s *client;
+} eventSource;
+
+/* X connections by display name, kept until exit (the feedback and
+ * backend state refer to them) */
+#define DAEMON_MAX_DISPLAYS 8
+
+typedef struct daemonClient_s
+{
+    struct daemonClient_s *next;
+    int sock;
+    int memFd;
+    int eventFd;
+    daemonRing *ring;
+    daemonHello hello;
+    Display *dpy;
+    eventSource sockSrc, eventSrc;
+    /* Closed, freed after the current batch of events */
+    Bool dead;
+} daemonClient;
+
+static daemonClient *g_clients = NULL;
+static struct
+{
+    char name[64];
+    Display *dpy;
+    /* The connection broke, opened again on the next request */
+    Bool lost;
+} g_displays[DAEMON_MAX_DISPLAYS];
+/* X errors and broken connections so far, they fail the request they
+ * happen in instead of exiting the daemon */
+static unsigned long g_xErrors = 0;
+static const char *g_pngDir = NULL;
+/* When to hide the feedback thumbnail (CLOCK_MONOTONIC ms), 0 if shown */
+static uint64_t g_feedbackUntil = 0;
+static volatile sig_atomic_t g_quit = 0;
+
+static void onSignal(int sig UNUSED)
+{
+    g_quit = 1;
+}
+
+static int onXError(Display *dpy, XErrorEvent *e)
+{
+    char text[128];
+
+    XGetErrorText(dpy, e->error_code, text, sizeof(text));
+    log(LOG_WARN, "X error: %s (request %d.%d, resource 0x%lx).\n",
+            text, e->request_code, e->minor_code, e->resourceid);
+    g_xErrors++;
+
+    return 0;
+}
+
+/* Returning makes Xlib give up on the display instead of exiting. */
+static void onDisplayLost(Display *dpy UNUSED, void *data)
+{
+    int i = (int)(intptr_t)data;
+
+    log(LOG_ERROR, "Connection to display \"%s\" lost.\n", g_displays[i].name);
+    g_displays[i].lost = True;
+    g_xErrors++;
+}
+
+/* Display connections are shared by the clients on the same server. */
+static Display *openDisplay(const char *name)
+{
+    int i;
+
+    for (i = 0; i < DAEMON_MAX_DISPLAYS && g_displays[i].dpy; i++)
+    {
+        if (strcmp(g_displays[i].name, name) == 0)
+        {
+            /* Broken ones are left alone, the feedback may still refer to them */
+            if (!g_displays[i].lost)
+                return g_displays[i].dpy;
+            break;
+        }
+    }
+
+    if (i == DAEMON_MAX_DISPLAYS)
+    {
+        log(LOG_ERROR, "Too many displays.\n");
+        return NULL;
+    }
+
+    snprintf(g_displays[i].name, sizeof(g_displays[i].name), "%s", name);
+    if ((g_displays[i].dpy = XOpenDisplay(*name ? name : NULL)) == NULL)
+        return NULL;
+    g_displays[i].lost = False;
+    XSetIOErrorExitHandler(g_displays[i].dpy, onDisplayLost, (void *)(intptr_t)i);
+
+    return g_displays[i].dpy;
+}
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void closeClient(int ep, daemonClient *client)
+{
+    client->dead = True;
+
+    log(LOG_NOTICE, "Client %d (app %u) disconnected.\n", client->hello.pid, client->hello.appId);
+
+    epoll_ctl(ep, EPOLL_CTL_DEL, client->sock, NULL);
+    close(client->sock);
+    if (client->eventFd >= 0)
+    {
+        epoll_ctl(ep, EPOLL_CTL_DEL, client->eventFd, NULL);
+        close(client->eventFd);
+    }
+    if (client->ring)
+        munmap(client->ring, sizeof(daemonRing));
+    if (client->memFd >= 0)
+        close(client->memFd);
+}
+
+static void reapClients(void)
+{
+    daemonClient **p = &g_clients, *c;
+
+    while ((c = *p) != NULL)
+    {
+        if (c->dead)
+        {
+            *p = c->next;
+            free(c);
+        }
+        else
+        {
+            p = &c->next;
+        }
+    }
+}
+
+static Bool watch(int ep, int fd, eventSource *src)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+
+    return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/* Handshake: set up the ring and pass it with the eventfd. */
+static Bool helloClient(daemonClient *client)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctrl;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t version = DAEMON_VERSION;
+    int fds[2];
+
+    if (read(client->sock, &client->hello, sizeof(client->hello)) != sizeof(client->hello) ||
+        client->hello.magic != DAEMON_MAGIC || client->hello.version != DAEMON_VERSION)
+    {
+        log(LOG_WARN, "Invalid hello from client.\n");
+        return False;
+    }
+    client->hello.display[sizeof(client->hello.display) - 1] = '\0';
+
+    if ((client->dpy = openDisplay(client->hello.display)) == NULL)
+    {
+        log(LOG_ERROR, "Unable to open display \"%s\" for client %d.\n", client->hello.display, client->hello.pid);
+        return False;
+    }
+
+    if ((client->memFd = memfd_create("ssspd-ring", MFD_CLOEXEC)) < 0 ||
+        ftruncate(client->memFd, sizeof(daemonRing)) < 0 ||
+        (client->ring = mmap(NULL, sizeof(daemonRing), PROT_READ | PROT_WRITE, MAP_SHARED,
+                client->memFd, 0)) == MAP_FAILED ||
+        (client->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+        log(LOG_ERROR, "Unable to set up the ring for client %d: %s\n", client->hello.pid, strerror(errno));
+        if (client->ring == MAP_FAILED)
+            client->ring = NULL;
+        return False;
+    }
+    client->ring->magic = DAEMON_MAGIC;
+    client->ring->version = DAEMON_VERSION;
+
+    fds[0] = client->memFd;
+    fds[1] = client->eventFd;
+    iov.iov_base = &version;
+    iov.iov_len = sizeof(version);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(client->sock, &msg, MSG_NOSIGNAL) != sizeof(version))
+        return False;
+
+    log(LOG_NOTICE, "Client %d (app %u) on display \"%s\" connected.\n",
+            client->hello.pid, client->hello.appId, client->hello.display);
+
+    return True;
+}
+
+/* Grab, convert and save one shot. 1 if saved, -1 for a duplicate. */
+static int capture(daemonClient *client, Window win, daemonReply *rep)
+{
+    static uint32_t count = 0;
+    XWindowAttributes attrs;
+    budgetSlot slot = { 0 };
+    uint16_t *deep = NULL;
+    uint64_t hash = 0;
+    uint8_t *image;
+    char date[20];
+    const time_t t = time(NULL);
+    struct tm lt;
+    unsigned long errors = g_xErrors;
+    int ok = 0;
+    int w, h;
+
+    if ((client->dpy = openDisplay(client->hello.display)) == NULL)
+        return 0;
+
+    /* Errors are reported asynchronously, collect the grab's */
+    image = capture_grab(client->dpy, &win, &w, &h, &slot, &hash, &deep);
+    XSync(client->dpy, False);
+    if (!image || budget_isDropped(&slot) || g_xErrors != errors)
+    {
+        free(deep);
+        free(image);
+        budget_release(&slot);
+        return 0;
+    }
+
+    if (XGetWindowAttributes(client->dpy, win, &attrs) != 0)
+    {
+        feedback_show(client->dpy, win, &attrs, image, w, h);
+        g_feedbackUntil = nowMs() + 5000;
+    }
+
+    if (dedup_isDuplicate(hash, w, h))
+    {
+        log(LOG_NOTICE, "Screenshot identical to a recent one (hash %016jx), skipped.\n", (uintmax_t)hash);
+        metric_add(METRIC_DEDUP_SKIPPED, 1);
+        metric_add(METRIC_DEDUP_SAVED_BYTES, 3 * w * h);
+        ok = -1;
+    }
+    else
+    {
+        localtime_r(&t, &lt);
+        strftime(date, sizeof(date), "%F_%H%M%S", &lt);
+        count++;
+
+        /* PNG_DIR/appID_2015-02-24_213012_00002.png, deep ones get a -16 variant */
+        if (deep)
+        {
+            snprintf(rep->path, sizeof(rep->path), "%s/%u_%s_%05u-16.png", g_pngDir,
+                    client->hello.appId, date, count);
+            png_write(rep->path, deep, w, h, 16);
+        }
+        snprintf(rep->path, sizeof(rep->path), "%s/%u_%s_%05u.png", g_pngDir,
+                client->hello.appId, date, count);
+        ok = png_write(rep->path, image, w, h, 8);
+        rep->w = w;
+        rep->h = h;
+    }
+
+    free(image);
+    free(deep);
+    budget_release(&slot);
+
+    return ok;
+}
+
+static void serveRequests(daemonClient *client)
+{
+    daemonRing *r = client->ring;
+    uint64_t n;
+    uint32_t tail;
+
+    /* Reset the counter, the ring tells what's pending. */
+    if (read(client->eventFd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        log(LOG_WARN, "eventfd read: %s\n", strerror(errno));
+
+    /* The client could have scribbled anything over the ring. */
+    tail = r->reqTail;
+    if (__atomic_load_n(&r->reqHead, __ATOMIC_ACQUIRE) - tail > DAEMON_RING_SLOTS)
+    {
+        log(LOG_WARN, "Request ring of client %d corrupted, resetting.\n", client->hello.pid);
+        r->reqTail = r->reqHead;
+        return;
+    }
+
+    for (; tail != __atomic_load_n(&r->reqHead, __ATOMIC_ACQUIRE); tail++)
+    {
+        daemonRequest req = r->req[tail % DAEMON_RING_SLOTS];
+        uint32_t head = r->repHead;
+        daemonReply *rep;
+
+        __atomic_store_n(&r->reqTail, tail + 1, __ATOMIC_RELEASE);
+
+        /* A client not picking up replies loses new ones. */
+        if (head - __atomic_load_n(&r->repTail, __ATOMIC_ACQUIRE) >= DAEMON_RING_SLOTS)
+        {
+            log(LOG_WARN, "Reply ring of client %d full.\n", client->hello.pid);
+            continue;
+        }
+
+        rep = &r->rep[head % DAEMON_RING_SLOTS];
+        memset(rep, 0, sizeof(*rep));
+        rep->seq = req.seq;
+
+        log(LOG_NOTICE, "Request %u of client %d: window 0x%jx.\n", req.seq, client->hello.pid, (uintmax_t)req.window);
+        rep->ok = capture(client, req.window, rep);
+
+        __atomic_store_n(&r->repHead, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+int main(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event events[DAEMON_MAX_EVENTS];
+    struct sigaction sa = { .sa_handler = onSignal };
+    eventSource listenSrc = { SRC_LISTEN, NULL };
+    int ep, lsock, n, i;
+
+    g_logLevel = cfg_getLong("LOG_LEVEL", DFLT_LOG_LEVEL);
+    g_pngDir = cfg_getStr("PNG_DIR", "/tmp");
+
+    XInitThreads();
+    XSetErrorHandler(onXError);
+    budget_init();
+    backend_init();
+    capture_init();
+    dedup_init();
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    ipc_socketPath(addr.sun_path, sizeof(addr.sun_path));
+    unlink(addr.sun_path);
+    if ((lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(addr.sun_path, 0600) < 0 ||
+        listen(lsock, 8) < 0 ||
+        (ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        !watch(ep, lsock, &listenSrc))
+    {
+        log(LOG_ERROR, "Unable to listen on %s: %s\n", addr.sun_path, strerror(errno));
+        return 1;
+    }
+
+    log(LOG_NOTICE, "ssspd listening on %s, saving to %s.\n", addr.sun_path, g_pngDir);
+
+    while (!g_quit)
+    {
+        /* The thumbnail goes away after a while, like in-process. */
+        if (g_feedbackUntil && nowMs() >= g_feedbackUntil)
+        {
+            feedback_hide();
+            g_feedbackUntil = 0;
+        }
+
+        if ((n = epoll_wait(ep, events, DAEMON_MAX_EVENTS,
+                g_feedbackUntil ? (int)(g_feedbackUntil - nowMs()) + 1 : -1)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log(LOG_ERROR, "epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            eventSource *src = events[i].data.ptr;
+            daemonClient *c = src->client;
+
+            if (c && c->dead)
+                continue;
+
+            switch (src->type)
+            {
+                case SRC_LISTEN:
+                    if ((c = calloc(1, sizeof(*c))) == NULL)
+                        break;
+                    c->memFd = c->eventFd = -1;
+                    c->sockSrc.type = SRC_SOCKET;
+                    c->eventSrc.type = SRC_EVENT;
+                    c->sockSrc.client = c->eventSrc.client = c;
+                    if ((c->sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC)) < 0 || !watch(ep, c->sock, &c->sockSrc))
+                    {
+                        if (c->sock >= 0)
+                            close(c->sock);
+                        free(c);
+                        break;
+                    }
+                    c->next = g_clients;
+                    g_clients = c;
+                    break;
+
+                case SRC_SOCKET:
+                    /* First data is the hello, afterwards only hangup */
+                    if (c->ring || !helloClient(c) || !watch(ep, c->eventFd, &c->eventSrc))
+                        closeClient(ep, c);
+                    break;
+
+                case SRC_EVENT:
+                    serveRequests(c);
+                    break;
+            }
+        }
+
+        reapClients();
+    }
+
+    close(lsock);
+    unlink(addr.sun_path);
+    metrics_log(LOG_NOTICE);
+
+    return 0;
+}
@@ -0,0 +1,667 @@
+/**
+ *
+ * Achievement cache.
+ *
+ * Querying steam for the achievements takes several calls through the
+ * ISteamUserStats vtable per achievement, too much for the game's event
+ * processing the hotkey is handled in. The stats job keeps a snapshot
+ * instead, a flat table of the achievements with a hash index by name.
+ *
+ * A full snapshot is only taken when steam delivers the user's stats
+ * (UserStatsReceived); names and display attributes never change, so they
+ * are carried over from the previous snapshot rather than queried again.
+ * Until then, they are read from steam's copy of the game's stats schema
+ * (appcache/stats), with the schema visitor stopping once it's past the
+ * achievements. After that, UserAchievementStored callbacks name what
+ * changed, and only those entries are queried again and updated, so keeping
+ * the cache current costs a call per change. The callbacks run on the
+ * game's thread inside SteamAPI_RunCallbacks(), so they only queue the name
+ * and schedule the stats job on the worker pool. SSSP_STATS_INTERVAL
+ * additionally takes full snapshots periodically, for games that don't run
+ * callbacks. The hotkey only logs the snapshot.
+ *
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "schema.h"
+#include "sssp.h"
+/* Needs the X11 and stdint types */
+#include "steam_sdk.h"
+
+#if USE_OLD_USERSTATS
+#define STATS_CALL(f, args...) g_stats.iface->vtab->f(g_stats.iface, g_stats.appId, ##args)
+#else
+#define STATS_CALL(f, args...) g_stats.iface->vtab->f(g_stats.iface, ##args)
+#endif
+
+/* Changes queued by callbacks, more make for a full snapshot */
+#define STATS_CHANGES 32
+
+typedef struct
+{
+    /* Offsets into the snapshot's string pool */
+    uint32_t name;
+    uint32_t display;
+    uint32_t desc;
+    Bool achieved;
+    uint32_t unlockTime;
+} statsEntry;
+
+typedef struct
+{
+    statsEntry *entries;
+    uint32_t count;
+    /* Open addressing, indices into entries + 1, 0 is empty */
+    uint32_t *index;
+    uint32_t mask;
+    char *pool;
+    size_t poolLen;
+    size_t poolCap;
+    /* Entries unlocked since the previous snapshot */
+    uint32_t *unlocks;
+    uint32_t unlockCount;
+    uint32_t achieved;
+    uint64_t updatedNs;
+    /* Only names and display attributes from the schema, or taken before
+     * steam sent the stats: nothing to compare with */
+    Bool provisional;
+} statsSnapshot;
+
+static void statsJob(void *arg);
+
+static struct
+{
+    poolJob job;
+    Bool started;
+    pthread_mutex_t lock;
+    /* Full snapshot requested */
+    Bool pending;
+    /* Steam sent the stats, snapshots are real from then on */
+    Bool received;
+    char changes[STATS_CHANGES][sizeof(((UserAchievementStored_t *)0)->achievementName)];
+    uint32_t changeCount;
+    statsSnapshot *current;
+
+    ISteamUserStats *iface;
+    SteamAppID appId;
+    uint64_t userId;
+    long interval;
+    unlockFunc unlocked;
+} g_stats = { .job = POOL_JOB(statsJob, NULL), .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t nameHash(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+
+    return h;
+}
+
+static inline const char *entryStr(const statsSnapshot *s, uint32_t off)
+{
+    return s->pool + off;
+}
+
+static const statsEntry *find(const statsSnapshot *s, const char *name)
+{
+    uint32_t i;
+
+    if (!s)
+        return NULL;
+
+    for (i = nameHash(name) & s->mask; s->index[i]; i = (i + 1) & s->mask)
+    {
+        const statsEntry *e = &s->entries[s->index[i] - 1];
+        if (strcmp(entryStr(s, e->name), name) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Copy len bytes of str into the pool as a string, returns its offset. */
+static Bool poolAddN(statsSnapshot *s, const char *str, size_t len, uint32_t *off)
+{
+    len++;
+
+    if (s->poolLen + len > s->poolCap)
+    {
+        size_t cap = s->poolCap ? 2 * s->poolCap : 4096;
+        char *pool;
+
+        while (cap < s->poolLen + len)
+            cap *= 2;
+        if ((pool = realloc(s->pool, cap)) == NULL)
+            return False;
+        s->pool = pool;
+        s->poolCap = cap;
+    }
+
+    memcpy(s->pool + s->poolLen, str, len - 1);
+    s->pool[s->poolLen + len - 1] = '\0';
+    *off = s->poolLen;
+    s->poolLen += len;
+
+    return True;
+}
+
+static inline Bool poolAdd(statsSnapshot *s, const char *str, uint32_t *off)
+{
+    return poolAddN(s, str ? str : "", str ? strlen(str) : 0, off);
+}
+
+/* Index entries[i] by its name. */
+static inline void indexAdd(statsSnapshot *s, uint32_t i)
+{
+    uint32_t slot;
+
+    for (slot = nameHash(entryStr(s, s->entries[i].name)) & s->mask; s->index[slot]; slot = (slot + 1) & s->mask)
+        ;
+    s->index[slot] = i + 1;
+}
+
+static void freeSnapshot(statsSnapshot *s)
+{
+    if (!s)
+        return;
+
+    free(s->entries);
+    free(s->index);
+    free(s->pool);
+    free(s->unlocks);
+    free(s);
+}
+
+/* Query steam for all achievements. Steam calls for what prev already has
+ * are saved. Unlocks are only found against a snapshot that isn't
+ * provisional. */
+static statsSnapshot *takeSnapshot(const statsSnapshot *prev, Bool provisional)
+{
+    statsSnapshot *s;
+    uint32_t n, i, size = 1, calls = 1;
+    Bool diff = prev && !prev->provisional;
+
+    n = STATS_CALL(GetNumAchievements);
+    while (size < 2 * n)
+        size *= 2;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL ||
+        (s->entries = calloc(n ? n : 1, sizeof(*s->entries))) == NULL ||
+        (s->index = calloc(size, sizeof(*s->index))) == NULL ||
+        (s->unlocks = calloc(n ? n : 1, sizeof(*s->unlocks))) == NULL)
+    {
+        freeSnapshot(s);
+        return NULL;
+    }
+    s->mask = size - 1;
+    s->provisional = provisional;
+
+    for (i = 0; i < n; i++)
+    {
+        statsEntry *e = &s->entries[s->count];
+        const char *name = STATS_CALL(GetAchievementName, i);
+        const statsEntry *old;
+
+        calls++;
+        if (!name || !*name || find(s, name))
+            continue;
+        old = find(prev, name);
+
+        if (!poolAdd(s, name, &e->name))
+            break;
+        if (old && (!prev->provisional || *entryStr(prev, old->display)))
+        {
+            if (!poolAdd(s, entryStr(prev, old->display), &e->display) ||
+                !poolAdd(s, entryStr(prev, old->desc), &e->desc))
+                break;
+        }
+        else
+        {
+#if USE_OLD_USERSTATS
+            const char *display = NULL, *desc = NULL;
+#else
+            const char *display = STATS_CALL(GetAchievementDisplayAttribute, name, "name");
+            const char *desc = STATS_CALL(GetAchievementDisplayAttribute, name, "desc");
+            calls += 2;
+#endif
+            if (!poolAdd(s, display, &e->display) || !poolAdd(s, desc, &e->desc))
+                break;
+        }
+
+        e->achieved = False;
+        if (!STATS_CALL(GetAchievementAndUnlockTime, name, &e->achieved, &e->unlockTime))
+            e->achieved = False;
+        calls++;
+
+        if (e->achieved)
+        {
+            s->achieved++;
+            if (diff && (!old || !old->achieved))
+                s->unlocks[s->unlockCount++] = s->count;
+        }
+
+        indexAdd(s, s->count++);
+    }
+
+    s->updatedNs = nowNs();
+    metric_add(METRIC_STATS_CALLS, calls);
+
+    return s;
+}
+
+/* Schema layout: <appid>/stats/<id>/bits/<bit>/{name, display/{name, desc}/<language>} */
+enum
+{
+    SCHEMA_DEPTH_STATS = 1,
+    SCHEMA_DEPTH_BITS = 3,
+    SCHEMA_DEPTH_ACHIEVEMENT = 4,
+    SCHEMA_DEPTH_DISPLAY = 5,
+    SCHEMA_DEPTH_ATTRIBUTE = 6,
+    SCHEMA_DEPTH_LANGUAGE = 7,
+};
+
+typedef struct
+{
+    statsSnapshot *s;
+    const char *language;
+    uint32_t cap;
+    /* Of the achievement being parsed, views into the schema */
+    schemaItem name;
+    schemaItem display;
+    schemaItem desc;
+    Bool failed;
+} schemaLoad;
+
+static enum SchemaNext schemaEnter(void *ctx, const schemaItem *item, const schemaItem *path UNUSED)
+{
+    schemaLoad *l = ctx;
+
+    switch (item->depth)
+    {
+        case SCHEMA_DEPTH_STATS:
+            return schema_isKey(item, "stats") ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        case SCHEMA_DEPTH_BITS:
+            return schema_isKey(item, "bits") ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        case SCHEMA_DEPTH_ACHIEVEMENT:
+            memset(&l->name, 0, sizeof(l->name));
+            memset(&l->display, 0, sizeof(l->display));
+            memset(&l->desc, 0, sizeof(l->desc));
+            return SCHEMA_CONTINUE;
+        case SCHEMA_DEPTH_DISPLAY:
+            return schema_isKey(item, "display") ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        case SCHEMA_DEPTH_ATTRIBUTE:
+            return schema_isKey(item, "name") || schema_isKey(item, "desc") ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        default:
+            return SCHEMA_CONTINUE;
+    }
+}
+
+static enum SchemaNext schemaValue(void *ctx, const schemaItem *item, const schemaItem *path)
+{
+    schemaLoad *l = ctx;
+
+    if (item->type != SCHEMA_STRING)
+        return SCHEMA_CONTINUE;
+
+    if (item->depth == SCHEMA_DEPTH_DISPLAY && schema_isKey(item, "name"))
+        l->name = *item;
+    else if (item->depth == SCHEMA_DEPTH_LANGUAGE && schema_isKey(item, l->language))
+        *(schema_isKey(&path[SCHEMA_DEPTH_ATTRIBUTE], "name") ? &l->display : &l->desc) = *item;
+
+    return SCHEMA_CONTINUE;
+}
+
+static enum SchemaNext schemaLeave(void *ctx, const schemaItem *item, const schemaItem *path UNUSED)
+{
+    schemaLoad *l = ctx;
+    statsSnapshot *s = l->s;
+    statsEntry *e;
+
+    /* Everything after the stats is of no interest. */
+    if (item->depth == SCHEMA_DEPTH_STATS)
+        return SCHEMA_STOP;
+    if (item->depth != SCHEMA_DEPTH_ACHIEVEMENT || !l->name.keyLen || !l->name.valueLen)
+        return SCHEMA_CONTINUE;
+
+    if (s->count == l->cap)
+    {
+        uint32_t cap = l->cap ? 2 * l->cap : 64;
+        if ((e = realloc(s->entries, cap * sizeof(*e))) == NULL)
+        {
+            l->failed = True;
+            return SCHEMA_STOP;
+        }
+        s->entries = e;
+        l->cap = cap;
+    }
+
+    e = &s->entries[s->count];
+    memset(e, 0, sizeof(*e));
+    if (!poolAddN(s, (const char *)l->name.value, l->name.valueLen, &e->name) ||
+        !poolAddN(s, (const char *)l->display.value, l->display.valueLen, &e->display) ||
+        !poolAddN(s, (const char *)l->desc.value, l->desc.valueLen, &e->desc))
+    {
+        l->failed = True;
+        return SCHEMA_STOP;
+    }
+    s->count++;
+
+    return SCHEMA_CONTINUE;
+}
+
+/* Names and display attributes from steam's copy of the schema, NULL if
+ * there's none. */
+static statsSnapshot *loadSchema(void)
+{
+    const schemaVisitor visitor = { schemaEnter, schemaLeave, schemaValue };
+    schemaLoad l = { .language = cfg_getStr("STATS_LANGUAGE", "english") };
+    const char *steam = SteamAPI_GetSteamInstallPath();
+    char path[4096], err[256];
+    uint32_t i, size = 1;
+    int rc;
+
+    if (!steam)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/appcache/stats/UserGameStatsSchema_%u.bin", steam,
+            (unsigned int)g_stats.appId.appId);
+
+    if ((l.s = calloc(1, sizeof(*l.s))) == NULL)
+        return NULL;
+    l.s->provisional = True;
+
+    rc = schema_parseFile(path, &visitor, &l, err, sizeof(err));
+    if (rc < 0)
+        log(LOG_INFO, "Stats: no schema: %s\n", err);
+
+    while (size < 2 * l.s->count)
+        size *= 2;
+    if (rc < 0 || l.failed || !l.s->count ||
+        (l.s->index = calloc(size, sizeof(*l.s->index))) == NULL)
+    {
+        freeSnapshot(l.s);
+        return NULL;
+    }
+    l.s->mask = size - 1;
+    for (i = 0; i < l.s->count; i++)
+        indexAdd(l.s, i);
+
+    log(LOG_INFO, "Stats: %u achievements in the schema.\n", l.s->count);
+
+    return l.s;
+}
+
+static void refresh(void)
+{
+    statsSnapshot *s, *prev;
+    uint64_t t0 = nowNs();
+    uint32_t i;
+
+    /* Only the job replaces the snapshot, so it can be read unlocked. */
+    if ((s = takeSnapshot(g_stats.current, !__atomic_load_n(&g_stats.received, __ATOMIC_ACQUIRE))) == NULL)
+    {
+        log(LOG_WARN, "Stats: unable to get the current achievements.\n");
+        return;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+    prev = g_stats.current;
+    g_stats.current = s;
+    pthread_mutex_unlock(&g_stats.lock);
+    freeSnapshot(prev);
+
+    for (i = 0; i < s->unlockCount; i++)
+    {
+        const statsEntry *e = &s->entries[s->unlocks[i]];
+        log(LOG_NOTICE, "Achievement unlocked: %s (%s)\n", entryStr(s, e->display), entryStr(s, e->name));
+    }
+
+    metric_add(METRIC_STATS_REFRESHES, 1);
+    metric_add(METRIC_STATS_UNLOCKS, s->unlockCount);
+    metric_add(METRIC_STATS_US, (nowNs() - t0) / 1000);
+}
+
+/* Query the achievement name again and update its entry. */
+static void update(const char *name)
+{
+    statsSnapshot *s = g_stats.current;
+    statsEntry *e;
+    Bool achieved = False;
+    uint32_t unlockTime = 0;
+
+    /* Unknown achievements need the full table. */
+    if (!s || s->provisional || (e = (statsEntry *)find(s, name)) == NULL)
+    {
+        refresh();
+        return;
+    }
+
+    if (!STATS_CALL(GetAchievementAndUnlockTime, name, &achieved, &unlockTime))
+        return;
+    metric_add(METRIC_STATS_CALLS, 1);
+
+    pthread_mutex_lock(&g_stats.lock);
+    if (achieved && !e->achieved)
+    {
+        s->achieved++;
+        /* Unless it was reset and unlocked again */
+        if (s->unlockCount < s->count)
+            s->unlocks[s->unlockCount++] = e - s->entries;
+    }
+    else if (!achieved && e->achieved)
+    {
+        s->achieved--;
+    }
+    e->achieved = achieved;
+    e->unlockTime = unlockTime;
+    s->updatedNs = nowNs();
+    pthread_mutex_unlock(&g_stats.lock);
+
+    if (achieved)
+    {
+        log(LOG_NOTICE, "Achievement unlocked: %s (%s)\n", entryStr(s, e->display), name);
+        metric_add(METRIC_STATS_UNLOCKS, 1);
+    }
+    metric_add(METRIC_STATS_UPDATES, 1);
+}
+
+/* Runs whenever something changed, or every interval. */
+static void statsJob(void *arg UNUSED)
+{
+    char changes[STATS_CHANGES][sizeof(g_stats.changes[0])];
+    uint32_t count, i;
+    Bool full, first = !g_stats.started;
+
+    if (first)
+    {
+        g_stats.started = True;
+
+        /* Have steam send the stats, answered by UserStatsReceived */
+        if (!STATS_CALL(RequestCurrentStats))
+            log(LOG_WARN, "Stats: unable to request the current stats.\n");
+
+        /* Names until then, the stats come with UserStatsReceived */
+        pthread_mutex_lock(&g_stats.lock);
+        g_stats.current = loadSchema();
+        pthread_mutex_unlock(&g_stats.lock);
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+    /* Nothing queued is the interval running out */
+    full = g_stats.pending || (!g_stats.changeCount && !first);
+    g_stats.pending = False;
+    count = g_stats.changeCount;
+    g_stats.changeCount = 0;
+    memcpy(changes, g_stats.changes, count * sizeof(changes[0]));
+    pthread_mutex_unlock(&g_stats.lock);
+
+    if (full)
+        refresh();
+    else
+        for (i = 0; i < count; i++)
+            update(changes[i]);
+
+    if (g_stats.interval > 0)
+        pool_schedule(&g_stats.job, g_stats.interval * 1000000000ULL);
+}
+
+/* Steam callbacks, called from the game's thread */
+
+static Bool isOurs(uint64_t gameId)
+{
+    /* The app id is the low 24 bits of a CGameID */
+    return (gameId & 0xFFFFFF) == g_stats.appId.appId;
+}
+
+static void userStatsReceived(CCallbackBase *thiz UNUSED, void *param)
+{
+    const UserStatsReceived_t *cb = param;
+
+    if (!isOurs(cb->gameId) || cb->user.as64Bit != g_stats.userId)
+        return;
+    if (cb->result != ERESULT_OK)
+    {
+        log(LOG_WARN, "Stats: receiving stats failed (%d).\n", cb->result);
+        return;
+    }
+
+    pthread_mutex_lock(&g_stats.lock);
+    g_stats.pending = True;
+    __atomic_store_n(&g_stats.received, True, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_stats.lock);
+    pool_schedule(&g_stats.job, 0);
+}
+
+static void userStatsStored(CCallbackBase *thiz UNUSED, void *param)
+{
+    const UserStatsStored_t *cb = param;
+
+    /* What changed comes with UserAchievementStored */
+    if (isOurs(cb->gameId) && cb->result != ERESULT_OK)
+        log(LOG_INFO, "Stats: the game failed to store stats (%d).\n", cb->result);
+}
+
+static void userAchievementStored(CCallbackBase *thiz UNUSED, void *param)
+{
+    const UserAchievementStored_t *cb = param;
+    char name[sizeof(cb->achievementName)];
+
+    /* Progress notifications don't change anything. */
+    if (!isOurs(cb->gameId) || cb->maxProgress)
+        return;
+
+    memcpy(name, cb->achievementName, sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+
+    /* Right away, not after the stats job got to it */
+    if (g_stats.unlocked)
+        g_stats.unlocked(name);
+
+    pthread_mutex_lock(&g_stats.lock);
+    if (g_stats.changeCount < STATS_CHANGES)
+    {
+        memcpy(g_stats.changes[g_stats.changeCount++], name, sizeof(name));
+    }
+    else
+    {
+        g_stats.pending = True;
+    }
+    pthread_mutex_unlock(&g_stats.lock);
+    pool_schedule(&g_stats.job, 0);
+}
+
+#define STATS_CALLBACK(name, type) \
+    static void name##Result(CCallbackBase *thiz, void *param, uint8_t ioFailure UNUSED, uint64_t call UNUSED) \
+    { \
+        name(thiz, param); \
+    } \
+    static int name##Size(CCallbackBase *thiz UNUSED) \
+    { \
+        return sizeof(type); \
+    } \
+    static const __typeof__(*((CCallbackBase *)0)->vtab) name##Vtab = { name, name##Result, name##Size };
+
+STATS_CALLBACK(userStatsReceived, UserStatsReceived_t)
+STATS_CALLBACK(userStatsStored, UserStatsStored_t)
+STATS_CALLBACK(userAchievementStored, UserAchievementStored_t)
+
+#undef STATS_CALLBACK
+
+/* Registered once and for the lifetime of the process, steam keeps them. */
+static CCallbackBase g_statsCallbacks[] =
+{
+    { &userStatsReceivedVtab, 0, USERSTATSRECEIVED_CALLBACK },
+    { &userStatsStoredVtab, 0, USERSTATSSTORED_CALLBACK },
+    { &userAchievementStoredVtab, 0, USERACHIEVEMENTSTORED_CALLBACK },
+};
+
+/* Start caching the achievements of userStats (an ISteamUserStats) for
+ * user. */
+void stats_init(void *userStats, uint32_t appId, uint64_t userId, unlockFunc unlocked)
+{
+    size_t i;
+
+    if (g_stats.iface || !userStats)
+        return;
+
+    g_stats.iface = userStats;
+    g_stats.appId.appId = appId;
+    g_stats.userId = userId;
+    g_stats.unlocked = unlocked;
+    g_stats.interval = cfg_getLong("STATS_INTERVAL", 0);
+
+    if (!pool_schedule(&g_stats.job, 0))
+    {
+        log(LOG_ERROR, "Stats: no worker to run on.\n");
+        g_stats.iface = NULL;
+        return;
+    }
+
+    /* Answers come through SteamAPI_RunCallbacks() on this thread, so not
+     * before these are registered. */
+    for (i = 0; i < sizeof(g_statsCallbacks) / sizeof(g_statsCallbacks[0]); i++)
+        SteamAPI_RegisterCallback(&g_statsCallbacks[i], g_statsCallbacks[i].callback);
+}
+
+/* Called from the game's thread: log the cached achievements. */
+void stats_show(void)
+{
+    const statsSnapshot *s;
+    uint32_t i;
+
+    if (!g_stats.iface)
+        return;
+
+    pthread_mutex_lock(&g_stats.lock);
+
+    if ((s = g_stats.current) == NULL || s->provisional)
+    {
+        log(LOG_NOTICE, "Stats: no achievements yet.\n");
+    }
+    else
+    {
+        log(LOG_NOTICE, "Stats: %u of %u achievements, updated %.1fs ago.\n",
+                s->achieved, s->count, (nowNs() - s->updatedNs) / 1e9);
+        for (i = 0; i < s->count; i++)
+        {
+            const statsEntry *e = &s->entries[i];
+            log(LOG_INFO, "  %c %s: %s\n", e->achieved ? '+' : '-', entryStr(s, e->display),
+                    entryStr(s, e->desc));
+        }
+    }
+
+    pthread_mutex_unlock(&g_stats.lock);
+}
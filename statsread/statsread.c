@@ -1,17 +1,39 @@
 /**
  * Read a stean stats schema file
- *   ./exe UserGameStatsSchema_[0-9]+.bin
+ *   ./exe [-C cache] UserGameStatsSchema_[0-9]+.bin [key/path]
+ * or many of them
+ *   ./exe -b [-c] [-j jobs] [-L language] [-l list] [dir|file ...]
  * Compile with
- *   gcc -o exe statsread.c -Wall -Wextra
+ *   gcc -o exe statsread.c ../src/schema.c -I../src -Wall -Wextra -lpthread
+ * or make statsread
+ *
+ * The file is parsed in one pass by the schema visitor (src/schema.c), which
+ * sssp uses as well. With a key path (e.g. 440/stats/1), only that part is
+ * printed; collections off the path are skipped and parsing stops once it's
+ * done. With -C, the key path is looked up in the schema's index, kept in the
+ * cache file and only rebuilt when the schema changes.
+ *
+ * Batch mode takes directories (e.g. appcache/stats, for the schemas in it),
+ * files and a list of files ("-" for stdin). The files are parsed on a pool
+ * of threads, each into its own buffer, and printed in order as one JSON
+ * Lines (or with -c, CSV) table: a row per stat and per achievement with the
+ * appid, id, name, display name, type and the other values. The throughput
+ * goes to stderr.
  */
 
-#include <assert.h>
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "schema.h"
 
-#define KEY_MAX 128
-#define VAL_MAX 2048
 #define iprint(indent, args...) \
 { \
     for (size_t i = 0; i < indent; i++) { \
@@ -20,210 +42,709 @@
     fprintf(stdout, args); \
 }
 
-enum {
-    TYPE_COLLECTION = 0,
-    TYPE_STRING,
-    TYPE_INTEGER,
-    TYPE_FLOAT,
-    TYPE_POINTER,
-    TYPE_WSTRING,
-    TYPE_COLOR,
-    TYPE_UNSIGNED_INTEGER,
-    TYPE_END
-};
+typedef struct
+{
+    /* Key path to print, split at '/' */
+    char *keys[SCHEMA_DEPTH_MAX];
+    size_t numkeys;
+} dumpctx_t;
 
-typedef struct statsnode_s
-{
-    u_int8_t type;
-    char name[KEY_MAX];
-    void *data;
-    size_t datalen;
-    struct statsnode_s *parent;
-    struct statsnode_s **children;
-    ssize_t numchildren;
-} statsnode_t;
-
-size_t collect(const char *data, size_t size, size_t offset, statsnode_t *node)
-{
-    u_int8_t type;
-    char value[VAL_MAX];
-    size_t keylen = 0;
-    size_t vallen = 0;
-    size_t off = offset;
-    u_int16_t len;
-    statsnode_t *child;
-
-    while (off < size) {
-        // Get type
-        type = *(data + off++);
-
-        // EON
-        if (type == TYPE_END) {
-            break;
-        }
-
-        // Add a new node holding the data to our parent
-        node->numchildren++;
-        node->children = realloc(node->children, node->numchildren * sizeof(node));
-        child = node->children[node->numchildren - 1] = calloc(1, sizeof(*node));
-        child->parent = node;
-
-        // Set type and name
-        child->type = type;
-        keylen = strlen(data + off) + 1;
-        assert(keylen < KEY_MAX);
-        strncpy(child->name, data + off, keylen);
-        child->name[keylen - 1] = 0;
-        off += keylen;
-
-        // @fixme assert there's enough room in the source buffer
-        switch (type) {
-            case TYPE_COLLECTION:
-                off += collect(data, size, off, child);
-                break;
-            case TYPE_STRING:
-                vallen = strlen(data + off) + 1;
-                strncpy(value, data + off, vallen);
-                value[vallen - 1] = 0;
-                break;
-            case TYPE_INTEGER:
-                vallen = 4;
-                snprintf(value, 20, "%d", *((int32_t*)(data + off)));
-                break;
-            case TYPE_FLOAT:
-                vallen = 4;
-                break;
-            case TYPE_POINTER:
-                vallen = 4;
-                break;
-            case TYPE_WSTRING:
-                len = *(data + off) << 8 | *(data + off + 1);
-                vallen = 2 + sizeof(wchar_t) * len;
-                break;
-            case TYPE_COLOR:
-                vallen = 4; // 4 char
-                break;
-            case TYPE_UNSIGNED_INTEGER:
-                vallen = 8;
+/* Whether item is on the key path, printing everything at or below its end */
+static int onpath(const dumpctx_t *ctx, const schemaItem *item)
+{
+    return item->depth >= ctx->numkeys || schema_isKey(item, ctx->keys[item->depth]);
+}
+
+static size_t indentof(const dumpctx_t *ctx, const schemaItem *item)
+{
+    return 2 * (item->depth - (ctx->numkeys ? ctx->numkeys - 1 : 0));
+}
+
+static enum SchemaNext dumpenter(void *arg, const schemaItem *item, const schemaItem *path)
+{
+    const dumpctx_t *ctx = arg;
+    (void)path;
+
+    if (!onpath(ctx, item)) {
+        return SCHEMA_SKIP;
+    }
+    if (item->depth + 1 >= ctx->numkeys) {
+        iprint(indentof(ctx, item), "key: %.*s, value: [\n", (int)item->keyLen, item->key);
+    }
+
+    return SCHEMA_CONTINUE;
+}
+
+static enum SchemaNext dumpleave(void *arg, const schemaItem *item, const schemaItem *path)
+{
+    const dumpctx_t *ctx = arg;
+    (void)path;
+
+    if (item->depth + 1 >= ctx->numkeys) {
+        iprint(indentof(ctx, item), "]\n");
+    }
+
+    // Done with the collection on the end of the path
+    return ctx->numkeys && item->depth + 1 == ctx->numkeys ? SCHEMA_STOP : SCHEMA_CONTINUE;
+}
+
+static void printitem(size_t indent, const schemaItem *item)
+{
+    int keylen = item->keyLen;
+    const char *key = item->key;
+
+    switch (item->type) {
+        case SCHEMA_STRING:
+            iprint(indent, "key: %.*s, value: %.*s\n", keylen, key, (int)item->valueLen, item->value);
+            break;
+        case SCHEMA_INT32:
+            iprint(indent, "key: %.*s, value: %d\n", keylen, key, schema_int32(item));
+            break;
+        case SCHEMA_FLOAT:
+            iprint(indent, "key: %.*s, value: %g\n", keylen, key, schema_float(item));
+            break;
+        case SCHEMA_POINTER:
+        case SCHEMA_COLOR:
+            iprint(indent, "key: %.*s, value: 0x%08x\n", keylen, key, schema_uint32(item));
+            break;
+        case SCHEMA_UINT64:
+            iprint(indent, "key: %.*s, value: %llu\n", keylen, key, (unsigned long long)schema_uint64(item));
+            break;
+        case SCHEMA_WSTRING:
+            iprint(indent, "key: %.*s, value: (wstring, %zu bytes)\n", keylen, key, item->valueLen - 2);
+            break;
+        default:
+            break;
+    }
+}
+
+static enum SchemaNext dumpvalue(void *arg, const schemaItem *item, const schemaItem *path)
+{
+    const dumpctx_t *ctx = arg;
+    (void)path;
+
+    if (item->depth + 1 < ctx->numkeys || !onpath(ctx, item)) {
+        return SCHEMA_CONTINUE;
+    }
+    printitem(indentof(ctx, item), item);
+
+    // A single value was asked for
+    return ctx->numkeys && item->depth + 1 == ctx->numkeys ? SCHEMA_STOP : SCHEMA_CONTINUE;
+}
+
+/* Print node and what's in it from the index, like the dump visitor */
+static int dumpnode(const schemaIndex *index, const schemaNode *node, size_t indent)
+{
+    const schemaNode *child;
+    schemaItem item;
+
+    if (!schema_item(index, node, &item) || indent > 2 * SCHEMA_DEPTH_MAX) {
+        return -1;
+    }
+    if (item.type != SCHEMA_COLLECTION) {
+        printitem(indent, &item);
+        return 0;
+    }
+
+    iprint(indent, "key: %.*s, value: [\n", (int)item.keyLen, item.key);
+    for (child = schema_first(index, node); child; child = schema_next(index, child)) {
+        if (dumpnode(index, child, indent + 2) < 0) {
+            return -1;
+        }
+    }
+    iprint(indent, "]\n");
+
+    return 0;
+}
+
+/* Look path up in the index of file, kept in cache */
+static int dumpindexed(const char *file, const char *cache, const char *path)
+{
+    const schemaNode *node;
+    schemaIndex *index;
+    char err[256];
+    int rc = 0;
+
+    if ((index = schema_indexFile(file, cache, err, sizeof(err))) == NULL) {
+        fprintf(stderr, "%s: %s\n", file, err);
+        return 1;
+    }
+
+    if (path) {
+        if ((node = schema_find(index, path)) == NULL) {
+            fprintf(stderr, "%s: no %s\n", file, path);
+            rc = 1;
+        } else {
+            rc = dumpnode(index, node, 0) < 0;
+        }
+    } else {
+        for (node = schema_first(index, NULL); node; node = schema_next(index, node)) {
+            if ((rc = dumpnode(index, node, 0) < 0)) {
                 break;
+            }
+        }
+    }
+    if (rc && node) {
+        fprintf(stderr, "%s: corrupt index\n", cache ? cache : file);
+    }
+
+    schema_indexFree(index);
+    return rc;
+}
+
+/* Values of a row besides name, display name and type */
+#define ROW_VALUES 32
+
+/* Stat types, the "type" of a stat */
+static const char *const stattypes[] = {
+    "unknown", "int", "float", "avgrate", "achievements", "groupachievements"
+};
+
+#define STAT_ACHIEVEMENTS 4
+#define STAT_GROUPACHIEVEMENTS 5
+
+/* A stat or achievement, views into the file */
+typedef struct
+{
+    const schemaItem *id;
+    schemaItem name;
+    schemaItem display;
+    long type;
+    schemaItem values[ROW_VALUES];
+    size_t numvalues;
+} row_t;
+
+typedef struct
+{
+    char *path;
+    /* Rows, written by the worker */
+    char *out;
+    size_t outlen;
+    off_t size;
+    size_t rows;
+    int failed;
+} batchfile_t;
+
+typedef struct
+{
+    batchfile_t *files;
+    size_t count;
+    size_t next;
+    int csv;
+    const char *language;
+} batch_t;
+
+typedef struct
+{
+    const batch_t *batch;
+    FILE *out;
+    size_t rows;
+    const schemaItem *appid;
+    row_t stat;
+    row_t achievement;
+} batchctx_t;
+
+/* Stats are at depth 2, achievements in their bits at depth 4 */
+#define DEPTH_STAT 2
+#define DEPTH_ACHIEVEMENT 4
+
+#define BATCH_JOBS_MAX 256
+
+/* Whether the collection at DEPTH_ACHIEVEMENT in path is an achievement */
+static int isbit(const schemaItem *path)
+{
+    return schema_isKey(&path[DEPTH_ACHIEVEMENT - 1], "bits");
+}
+
+/* The row item belongs to, and its depth */
+static row_t *rowof(batchctx_t *ctx, const schemaItem *item, const schemaItem *path, size_t *depth)
+{
+    if (item->depth > DEPTH_ACHIEVEMENT && isbit(path)) {
+        *depth = DEPTH_ACHIEVEMENT;
+        return &ctx->achievement;
+    }
+    *depth = DEPTH_STAT;
+    return &ctx->stat;
+}
+
+static void printstr(FILE *out, int csv, const char *str, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)str;
+
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == '"') {
+            fputs(csv ? "\"\"" : "\\\"", out);
+        } else if (csv) {
+            fputc(p[i], out);
+        } else if (p[i] == '\\') {
+            fputs("\\\\", out);
+        } else if (p[i] < 0x20) {
+            fprintf(out, "\\u%04x", p[i]);
+        } else {
+            fputc(p[i], out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* A value as JSON, into a string for CSV */
+static void printvalue(FILE *out, const schemaItem *item)
+{
+    float f;
+
+    switch (item->type) {
+        case SCHEMA_STRING:
+            printstr(out, 0, (const char *)item->value, item->valueLen);
+            break;
+        case SCHEMA_INT32:
+            fprintf(out, "%d", schema_int32(item));
+            break;
+        case SCHEMA_FLOAT:
+            f = schema_float(item);
+            if (isfinite(f)) {
+                fprintf(out, "%g", f);
+            } else {
+                fputs("null", out);
+            }
+            break;
+        case SCHEMA_POINTER:
+        case SCHEMA_COLOR:
+            fprintf(out, "%u", schema_uint32(item));
+            break;
+        case SCHEMA_UINT64:
+            fprintf(out, "%llu", (unsigned long long)schema_uint64(item));
+            break;
+        default:
+            fputs("null", out);
+            break;
+    }
+}
+
+/* The values of row as a JSON object */
+static void printvalues(FILE *out, const row_t *row)
+{
+    fputc('{', out);
+    for (size_t i = 0; i < row->numvalues; i++) {
+        if (i) {
+            fputc(',', out);
         }
+        printstr(out, 0, row->values[i].key, row->values[i].keyLen);
+        fputc(':', out);
+        printvalue(out, &row->values[i]);
+    }
+    fputc('}', out);
+}
+
+static void printrow(batchctx_t *ctx, const row_t *row, const char *type)
+{
+    FILE *out = ctx->out;
+    char id[256];
+    char *values = NULL;
+    size_t valueslen = 0;
+    FILE *v;
+
+    if (row == &ctx->achievement) {
+        snprintf(id, sizeof(id), "%.*s/%.*s", (int)ctx->stat.id->keyLen, ctx->stat.id->key,
+                (int)row->id->keyLen, row->id->key);
+    } else {
+        snprintf(id, sizeof(id), "%.*s", (int)row->id->keyLen, row->id->key);
+    }
 
-        if (type != TYPE_COLLECTION) {
-            child->datalen = vallen;
-            assert(!child->data);
-            child->data = malloc(vallen);
-            memcpy(child->data, value, vallen);
+    if (ctx->batch->csv) {
+        fprintf(out, "%lu,", strtoul(ctx->appid->key, NULL, 10));
+        printstr(out, 1, id, strlen(id));
+        fputc(',', out);
+        printstr(out, 1, (const char *)row->name.value, row->name.valueLen);
+        fputc(',', out);
+        printstr(out, 1, (const char *)row->display.value, row->display.valueLen);
+        fprintf(out, ",%s,", type);
+        // The values are one JSON column
+        if ((v = open_memstream(&values, &valueslen)) != NULL) {
+            printvalues(v, row);
+            fclose(v);
+            printstr(out, 1, values, valueslen);
+            free(values);
         }
+        fputc('\n', out);
+    } else {
+        fprintf(out, "{\"appid\":%lu,\"id\":", strtoul(ctx->appid->key, NULL, 10));
+        printstr(out, 0, id, strlen(id));
+        fputs(",\"name\":", out);
+        printstr(out, 0, (const char *)row->name.value, row->name.valueLen);
+        fputs(",\"display\":", out);
+        printstr(out, 0, (const char *)row->display.value, row->display.valueLen);
+        fprintf(out, ",\"type\":\"%s\",\"values\":", type);
+        printvalues(out, row);
+        fputs("}\n", out);
+    }
+    ctx->rows++;
+}
 
-        off += vallen;
+static enum SchemaNext batchenter(void *arg, const schemaItem *item, const schemaItem *path)
+{
+    batchctx_t *ctx = arg;
+    row_t *row;
+    size_t depth;
+
+    switch (item->depth) {
+        case 0:
+            ctx->appid = item;
+            return SCHEMA_CONTINUE;
+        case 1:
+            return schema_isKey(item, "stats") ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        case DEPTH_STAT:
+            memset(&ctx->stat, 0, sizeof(ctx->stat));
+            ctx->stat.id = item;
+            return SCHEMA_CONTINUE;
+        case DEPTH_ACHIEVEMENT:
+            if (isbit(path)) {
+                memset(&ctx->achievement, 0, sizeof(ctx->achievement));
+                ctx->achievement.id = item;
+                return SCHEMA_CONTINUE;
+            }
+            break;
+        default:
+            break;
     }
 
-    return off - offset;
+    // Besides the bits, only <row>/display/name has anything for the row
+    row = rowof(ctx, item, path, &depth);
+    switch (item->depth - depth) {
+        case 1:
+            return schema_isKey(item, "display") ||
+                (row == &ctx->stat && schema_isKey(item, "bits")) ? SCHEMA_CONTINUE : SCHEMA_SKIP;
+        case 2:
+            return schema_isKey(&path[depth + 1], "display") && schema_isKey(item, "name") ?
+                SCHEMA_CONTINUE : SCHEMA_SKIP;
+        default:
+            return SCHEMA_SKIP;
+    }
 }
 
-size_t dump(const char *data, size_t size, size_t offset, size_t indent)
+static enum SchemaNext batchvalue(void *arg, const schemaItem *item, const schemaItem *path)
 {
-    u_int8_t type;
-    char key[1024];
-    char value[2048];
-    size_t keylen = 0;
-    size_t vallen = 0;
-    size_t off = offset;
-    u_int16_t len;
+    batchctx_t *ctx = arg;
+    row_t *row;
+    size_t depth;
+
+    if (item->depth <= DEPTH_STAT || item->type == SCHEMA_WSTRING) {
+        return SCHEMA_CONTINUE;
+    }
+    row = rowof(ctx, item, path, &depth);
+
+    switch (item->depth - depth) {
+        case 1:
+            if (schema_isKey(item, "name") && item->type == SCHEMA_STRING) {
+                row->name = *item;
+                return SCHEMA_CONTINUE;
+            }
+            if (schema_isKey(item, "type") && row == &ctx->stat) {
+                row->type = item->type == SCHEMA_STRING ? strtol((const char *)item->value, NULL, 10) :
+                    item->type == SCHEMA_INT32 ? schema_int32(item) : 0;
+                return SCHEMA_CONTINUE;
+            }
+            break;
+        case 2:
+            // Stats have a plain <row>/display/name
+            if (schema_isKey(item, "name") && item->type == SCHEMA_STRING) {
+                row->display = *item;
+                return SCHEMA_CONTINUE;
+            }
+            break;
+        case 3:
+            // Achievements have <row>/display/name/<language>
+            if (schema_isKey(item, ctx->batch->language) && item->type == SCHEMA_STRING) {
+                row->display = *item;
+            }
+            return SCHEMA_CONTINUE;
+        default:
+            break;
+    }
+
+    if (row->numvalues < ROW_VALUES) {
+        row->values[row->numvalues++] = *item;
+    }
 
-    while (off < size) {
-        type = *(data + off++);
+    return SCHEMA_CONTINUE;
+}
 
-        if (type == 8) {
+static enum SchemaNext batchleave(void *arg, const schemaItem *item, const schemaItem *path)
+{
+    batchctx_t *ctx = arg;
+    long type = ctx->stat.type;
+
+    switch (item->depth) {
+        case 1:
+            // Past the stats
+            return SCHEMA_STOP;
+        case DEPTH_STAT:
+            // Achievement blocks are printed as their achievements
+            if (type != STAT_ACHIEVEMENTS && type != STAT_GROUPACHIEVEMENTS) {
+                printrow(ctx, &ctx->stat, stattypes[type > 0 && type <= STAT_GROUPACHIEVEMENTS ? type : 0]);
+            }
+            break;
+        case DEPTH_ACHIEVEMENT:
+            if (isbit(path)) {
+                printrow(ctx, &ctx->achievement, "achievement");
+            }
             break;
+        default:
+            break;
+    }
+
+    return SCHEMA_CONTINUE;
+}
+
+static void batchfile(const batch_t *batch, batchfile_t *file)
+{
+    const schemaVisitor visitor = { batchenter, batchleave, batchvalue };
+    batchctx_t ctx;
+    struct stat st;
+    char err[256];
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.batch = batch;
+    if (stat(file->path, &st) == 0) {
+        file->size = st.st_size;
+    }
+    if ((ctx.out = open_memstream(&file->out, &file->outlen)) == NULL) {
+        file->failed = 1;
+        return;
+    }
+
+    if (schema_parseFile(file->path, &visitor, &ctx, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s: %s\n", file->path, err);
+        file->failed = 1;
+    }
+    fclose(ctx.out);
+    file->rows = ctx.rows;
+}
+
+static void *batchworker(void *arg)
+{
+    batch_t *batch = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        batchfile(batch, &batch->files[i]);
+    }
+
+    return NULL;
+}
+
+static int addfile(batch_t *batch, size_t *cap, const char *path)
+{
+    batchfile_t *files;
+
+    if (batch->count == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        if ((files = realloc(batch->files, *cap * sizeof(*files))) == NULL) {
+            return -1;
         }
+        batch->files = files;
+    }
+    files = &batch->files[batch->count];
+    memset(files, 0, sizeof(*files));
+    if ((files->path = strdup(path)) == NULL) {
+        return -1;
+    }
+    batch->count++;
+
+    return 0;
+}
 
-        keylen = strlen(data + off) + 1;
-        strncpy(key, data + off, keylen);
-        key[keylen - 1] = 0;
-        off += keylen;
+static int isschema(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
 
-        if (type == 0) {
-            iprint(indent, "key: %s, value: [\n", key);
+    return strncmp(d->d_name, "UserGameStatsSchema_", 20) == 0 && strcmp(d->d_name + len - 4, ".bin") == 0;
+}
+
+/* Add the schemas in dir, sorted by name. */
+static int adddir(batch_t *batch, size_t *cap, const char *dir)
+{
+    struct dirent **names;
+    char path[4096];
+    int n, i, rc = 0;
+
+    if ((n = scandir(dir, &names, isschema, alphasort)) < 0) {
+        perror(dir);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        if (rc == 0) {
+            rc = addfile(batch, cap, path);
         }
+        free(names[i]);
+    }
+    free(names);
 
-        switch (type) {
-            case 0:
-                //iprint(indent, "SUB");
-                off += dump(data, size, off, indent + 2);
-                break;
-            case 1:
-                //iprint(indent, "STRING %s ", data + off);
-                vallen = strlen(data + off) + 1;
-                strncpy(value, data + off, vallen);
-                value[vallen - 1] = 0;
-                off += vallen;
-                break;
-            case 2:
-                //iprint(indent, "INT");
-                //iprint(indent, " %d ", *((int32_t*)(data + off)));
+    return rc;
+}
+
+/* Add the files in list, one per line. */
+static int addlist(batch_t *batch, size_t *cap, const char *list)
+{
+    FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int rc = 0;
+
+    if (!f) {
+        perror(list);
+        return -1;
+    }
+    while (rc == 0 && (len = getline(&line, &size, f)) > 0) {
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len) {
+            rc = addfile(batch, cap, line);
+        }
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    return rc;
+}
+
+static int runbatch(batch_t *batch, long jobs)
+{
+    pthread_t threads[jobs];
+    struct timespec t0, t1;
+    size_t i, rows = 0, failed = 0;
+    long started, j;
+    double secs, mb = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (started = 0; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, batchworker, batch) != 0) {
+            break;
+        }
+    }
+    // Without any thread, do it here
+    if (started == 0) {
+        batchworker(batch);
+    }
+    for (j = 0; j < started; j++) {
+        pthread_join(threads[j], NULL);
+    }
 
-                snprintf(value, 20, "%d", *((int32_t*)(data + off)));
-                off += 4;
+    if (batch->csv) {
+        printf("appid,id,name,display,type,values\n");
+    }
+    for (i = 0; i < batch->count; i++) {
+        batchfile_t *file = &batch->files[i];
+        if (file->failed) {
+            failed++;
+        } else {
+            fwrite(file->out, 1, file->outlen, stdout);
+            rows += file->rows;
+        }
+        mb += file->size / 1e6;
+        free(file->out);
+        free(file->path);
+    }
+    free(batch->files);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu files (%zu failed), %zu rows, %.2f MB in %.3f s on %ld threads: %.1f files/s, %.1f MB/s\n",
+            batch->count, failed, rows, mb, secs, started ? started : 1,
+            secs > 0 ? batch->count / secs : 0, secs > 0 ? mb / secs : 0);
+
+    return failed ? 1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-C cache] file [key/path]\n"
+            "       %s -b [-c] [-j jobs] [-L language] [-l list] [dir|file ...]\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+    const schemaVisitor dumper = { dumpenter, dumpleave, dumpvalue };
+    batch_t batch = { .language = "english" };
+    size_t cap = 0;
+    struct stat st;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *cache = NULL;
+    int opt, isbatch = 0, rc;
+    dumpctx_t ctx;
+    char err[256];
+    char *save = NULL, *key;
+
+    while ((opt = getopt(argc, argv, "bC:cj:L:l:")) != -1) {
+        switch (opt) {
+            case 'b':
+                isbatch = 1;
                 break;
-            case 3:
-                off += 4;
-                //iprint(indent, "FLOAT");
+            case 'C':
+                cache = optarg;
                 break;
-            case 4:
-                //iprint(indent, "PTR");
-                off += 4;
+            case 'c':
+                batch.csv = 1;
                 break;
-            case 5:
-                //iprint(indent, "WSTRING");
-                len = *(data + off) << 8 | *(data + off + 1);
-                //iprint(indent, "len: %u", len);
-                off += 2;
-                off += sizeof(wchar_t) * len;
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
                 break;
-            case 6:
-                //iprint(indent, "COLOR");
-                off += 4; // 4 char
+            case 'L':
+                batch.language = optarg;
                 break;
-            case 7:
-                //iprint(indent, "UINT64");
-                off += 8;
+            case 'l':
+                if (addlist(&batch, &cap, optarg) < 0) {
+                    return 1;
+                }
                 break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
+    }
 
-        if (type != 0) {
-            iprint(indent, "key: %s, value: %s\n", key, value);
-        } else {
-            iprint(indent, "]\n");
+    if (isbatch) {
+        for (; optind < argc; optind++) {
+            if (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) {
+                rc = adddir(&batch, &cap, argv[optind]);
+            } else {
+                rc = addfile(&batch, &cap, argv[optind]);
+            }
+            if (rc < 0) {
+                return 1;
+            }
         }
+        if (jobs > (long)batch.count) {
+            jobs = batch.count;
+        }
+        return runbatch(&batch, jobs < 1 ? 1 : jobs > BATCH_JOBS_MAX ? BATCH_JOBS_MAX : jobs);
     }
 
-    return off - offset;
-}
-
-int main(int argc, char **argv)
-{
-    if (argc != 2) {
+    if (argc - optind != 1 && argc - optind != 2) {
+        usage(argv[0]);
         return 1;
     }
 
-    char *data;
-    const char *file = argv[1];
-    size_t size;
-    statsnode_t root;
-    bzero(&root, sizeof(root));
-
-    FILE *fp = fopen(file, "r");
-    if (fp) {
-        fseek(fp, 0, SEEK_END);
-        size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        data = malloc(size);
-        fread(data, size, 1, fp);
-        collect(data, size, 0, &root);
-        dump(data, size, 0, 0);
-        free(data);
-        fclose(fp);
+    if (cache) {
+        return dumpindexed(argv[optind], cache, argc - optind == 2 ? argv[optind + 1] : NULL);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (argc - optind == 2) {
+        for (key = strtok_r(argv[optind + 1], "/", &save); key && ctx.numkeys < SCHEMA_DEPTH_MAX; key = strtok_r(NULL, "/", &save)) {
+            ctx.keys[ctx.numkeys++] = key;
+        }
+    }
+
+    if (schema_parseFile(argv[optind], &dumper, &ctx, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], err);
+        return 1;
     }
 
     return 0;